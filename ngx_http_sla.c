@@ -32,6 +32,17 @@
 #include <ngx_http.h>
 #include <math.h>
 #include <nginx.h>
+#include "ngx_http_sla_binary.h"
+#include "ngx_http_sla_engine.h"
+#include "ngx_http_sla_events.h"
+
+/**
+ * Статистика модуля stream (ngx_stream_sla_module) требует фазы логирования и upstream_states сессии
+ */
+#if (NGX_STREAM) && nginx_version >= 1011005
+    #define NGX_STREAM_SLA 1
+    #include <ngx_stream.h>
+#endif
 
 /**
  * Максимальная длина имени апстрима (минус терминирующий ноль)
@@ -44,6 +55,24 @@
     #error "NGX_HTTP_SLA_MAX_NAME_LEN must be at least 2"
 #endif
 
+/**
+ * Максимальная длина исходного имени апстрима в таблице sla_alias_zone
+ */
+#ifndef NGX_HTTP_SLA_MAX_PEER_LEN
+    #define NGX_HTTP_SLA_MAX_PEER_LEN 64
+#endif
+
+#if NGX_HTTP_SLA_MAX_PEER_LEN < 8
+    #error "NGX_HTTP_SLA_MAX_PEER_LEN must be at least 8"
+#endif
+
+/**
+ * Количество попыток чтения ячейки таблицы sla_alias_zone, изменяемой в момент чтения
+ */
+#ifndef NGX_HTTP_SLA_ALIAS_TRIES
+    #define NGX_HTTP_SLA_ALIAS_TRIES 16
+#endif
+
 /**
  * Максимальное количество отслеживаемых статусов HTTP (минус 1 для суммарной статистики)
  */
@@ -56,57 +85,112 @@
 #endif
 
 /**
- * Максимальное количество отслеживаемых таймингов (минус 1 для "бесконечности")
+ * Максимальное количество счетчиков в пуле (минус 1 для счетчика по умолчанию)
  */
-#ifndef NGX_HTTP_SLA_MAX_TIMINGS_LEN
-    #define NGX_HTTP_SLA_MAX_TIMINGS_LEN 32
+#ifndef NGX_HTTP_SLA_MAX_COUNTERS_LEN
+    #define NGX_HTTP_SLA_MAX_COUNTERS_LEN 16
 #endif
 
-#if NGX_HTTP_SLA_MAX_TIMINGS_LEN < 4
-    #error "NGX_HTTP_SLA_MAX_TIMINGS_LEN must be at least 4"
+#if NGX_HTTP_SLA_MAX_COUNTERS_LEN < 1
+    #error "NGX_HTTP_SLA_MAX_COUNTERS_LEN must be at least 1"
 #endif
 
 /**
- * Максимальное число вычисляемых квантилей (минус 2 для 25% и 75%)
- * На данный момент список квантилей не конфигурируется (их 7)
+ * Интервал пересчета скоростей запросов в ms
  */
-#ifndef NGX_HTTP_SLA_MAX_QUANTILES_LEN
-    #define NGX_HTTP_SLA_MAX_QUANTILES_LEN 7
+#ifndef NGX_HTTP_SLA_RATE_INTERVAL
+    #define NGX_HTTP_SLA_RATE_INTERVAL 5000
 #endif
 
-#if NGX_HTTP_SLA_MAX_QUANTILES_LEN != 7
-    #error "NGX_HTTP_SLA_MAX_QUANTILES_LEN must be 7"
+#if NGX_HTTP_SLA_RATE_INTERVAL < 1000
+    #error "NGX_HTTP_SLA_RATE_INTERVAL must be at least 1000"
 #endif
 
 /**
- * Максимальное количество счетчиков в пуле (минус 1 для счетчика по умолчанию)
+ * Максимальный размер датаграммы при отправке статистики по udp
  */
-#ifndef NGX_HTTP_SLA_MAX_COUNTERS_LEN
-    #define NGX_HTTP_SLA_MAX_COUNTERS_LEN 16
+#ifndef NGX_HTTP_SLA_EXPORT_MTU
+    #define NGX_HTTP_SLA_EXPORT_MTU 1400
 #endif
 
-#if NGX_HTTP_SLA_MAX_COUNTERS_LEN < 1
-    #error "NGX_HTTP_SLA_MAX_COUNTERS_LEN must be at least 1"
+/**
+ * Максимальная длина URI медленного запроса (slow=)
+ */
+#ifndef NGX_HTTP_SLA_SLOW_URI_LEN
+    #define NGX_HTTP_SLA_SLOW_URI_LEN 256
 #endif
 
 /**
- * Размер FIFO буфера для вычисления квантилей
+ * Количество бит индекса регистров HyperLogLog уникальных клиентов (clients=), по умолчанию
+ * 1024 однобайтовых регистра на счетчик и стандартная ошибка оценки около 3%
  */
-#ifndef NGX_HTTP_SLA_QUANTILE_M
-    #define NGX_HTTP_SLA_QUANTILE_M 100
+#ifndef NGX_HTTP_SLA_CLIENTS_BITS
+    #define NGX_HTTP_SLA_CLIENTS_BITS 10
+#endif
+
+#if NGX_HTTP_SLA_CLIENTS_BITS < 4 || NGX_HTTP_SLA_CLIENTS_BITS > 16
+    #error "NGX_HTTP_SLA_CLIENTS_BITS must be between 4 and 16"
 #endif
 
-#if NGX_HTTP_SLA_QUANTILE_M < 10
-    #error "NGX_HTTP_SLA_QUANTILE_M must be at least 10"
+/**
+ * Длина $request_id
+ */
+#define NGX_HTTP_SLA_REQUEST_ID_LEN 32
+
+/**
+ * Размер shared memory для результатов вывода sla_status cache=
+ */
+#ifndef NGX_HTTP_SLA_RENDER_CACHE_SIZE
+    #define NGX_HTTP_SLA_RENDER_CACHE_SIZE (4 * 1024 * 1024)
 #endif
 
 /**
- * Весовой коэффициент обновления вычисляемых квантилей
+ * Отправка статистики (sla_export) использует отменяемые таймеры и ngx_worker
  */
-#ifndef NGX_HTTP_SLA_QUANTILE_W
-    #define NGX_HTTP_SLA_QUANTILE_W 0.01
+#if nginx_version >= 1012000
+    #define NGX_HTTP_SLA_EXPORT 1
 #endif
 
+/**
+ * Протоколы отправки статистики
+ */
+#define NGX_HTTP_SLA_EXPORT_STATSD   0
+#define NGX_HTTP_SLA_EXPORT_GRAPHITE 1
+#define NGX_HTTP_SLA_EXPORT_ZABBIX   2
+
+/**
+ * Группировка счетчиков пула (group_by), upstream:peer - оба флага
+ */
+#define NGX_HTTP_SLA_GROUP_PEER     0x01
+#define NGX_HTTP_SLA_GROUP_UPSTREAM 0x02
+
+/**
+ * Переменные модуля
+ */
+#define NGX_HTTP_SLA_VARIABLE_P99       0
+#define NGX_HTTP_SLA_VARIABLE_AVG_MOV   1
+#define NGX_HTTP_SLA_VARIABLE_ERR_RATIO 2
+
+/**
+ * Состояния ячейки таблицы sla_alias_zone
+ */
+#define NGX_HTTP_SLA_ALIAS_EMPTY   0
+#define NGX_HTTP_SLA_ALIAS_USED    1
+#define NGX_HTTP_SLA_ALIAS_REMOVED 2
+
+
+/**
+ * Скорости запросов с экспоненциальным затуханием за 1, 5 и 15 минут
+ */
+typedef struct {
+    ngx_msec_t tick;          /** Начало текущего интервала                */
+    ngx_uint_t requests;      /** Количество запросов в текущем интервале  */
+    ngx_uint_t errors;        /** Количество ответов 5xx в интервале       */
+    ngx_uint_t time;          /** Суммарное время ответов в интервале      */
+    double     rps[3];        /** Запросов в секунду                       */
+    double     eps[3];        /** Ответов 5xx в секунду                    */
+    double     time_avg[3];   /** Среднее время ответа                     */
+} ngx_http_sla_rates_t;
 
 /**
  * Данные счетчиков в shm
@@ -114,32 +198,103 @@
 typedef struct {
     u_char     name[NGX_HTTP_SLA_MAX_NAME_LEN];               /** Имя апстрима                            */
     ngx_uint_t name_len;                                      /** Длина имени апстрима                    */
+    ngx_uint_t created;                                       /** Изменение пула при создании/сбросе      */
     ngx_uint_t http[NGX_HTTP_SLA_MAX_HTTP_LEN];               /** Количество ответов HTTP                 */
     ngx_uint_t http_xxx[6];                                   /** Количество ответов в группах HTTP       */
-    ngx_uint_t timings[NGX_HTTP_SLA_MAX_TIMINGS_LEN];         /** Количество ответов в интервале времени  */
-    ngx_uint_t timings_agg[NGX_HTTP_SLA_MAX_TIMINGS_LEN];     /** Количество ответов до интервала времени */
-    double     quantiles[NGX_HTTP_SLA_MAX_QUANTILES_LEN];     /** Значения квантилей                      */
-    double     time_avg;                                      /** Среднее время ответа                    */
-    double     time_avg_mov;                                  /** Скользящее среднее время ответа         */
-    ngx_uint_t quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M];       /** FIFO для вычисления квантилей           */
-    double     quantiles_f[NGX_HTTP_SLA_MAX_QUANTILES_LEN];   /** f-оценки плотности распределения        */
-    double     quantiles_c;                                   /** Коэффициент для вычисления оценок f     */
+    ngx_http_sla_timing_t timing;                             /** Времена ответов                         */
     ngx_uint_t generation;                                    /** Номер поколения счетчика                */
+    ngx_uint_t sequence;                                      /** Номер последнего изменения в пуле       */
+    ngx_uint_t modified;                                      /** Номер последнего изменения счетчика     */
+    ngx_uint_t connect_count;                                 /** Количество соединений с апстримом       */
+    double     connect_avg_mov;                               /** Скользящее среднее время соединения     */
+    ngx_uint_t first_byte_count;                              /** Количество ответов апстрима             */
+    double     first_byte_avg_mov;                            /** Скользящее среднее время первого байта  */
+    ngx_uint_t bytes_sent;                                    /** Отправлено байт                         */
+    ngx_uint_t bytes_received;                                /** Получено байт                           */
+    ngx_uint_t cache_lookup;                                  /** Запросов с обращением к кэшу            */
+    ngx_uint_t cache_hit;                                     /** Ответов из кэша                         */
+    ngx_uint_t tries[3];                                      /** Запросов с 1, 2 и 3+ попытками          */
+    ngx_uint_t retry_time;                                    /** Время неудачных попыток                 */
+    ngx_uint_t next[NGX_HTTP_SLA_MAX_COUNTERS_LEN];           /** Повторных попыток в счетчик с индексом  */
+    ngx_http_sla_rates_t rates;                               /** Скорости запросов                       */
 } ngx_http_sla_pool_shm_t;
 
+/**
+ * Внутренняя статистика модуля (времена в микросекундах)
+ */
+typedef struct {
+    ngx_uint_t lock_count;        /** Количество захватов мьютекса пула             */
+    ngx_uint_t lock_wait;         /** Суммарное время ожидания мьютекса             */
+    ngx_uint_t lock_hold;         /** Суммарное время удержания мьютекса            */
+    ngx_uint_t drop_counter;      /** Потеряно записей: нет места для счетчика      */
+    ngx_uint_t drop_generation;   /** Потеряно записей: не совпало поколение пула   */
+    ngx_uint_t shed;              /** Отклонено запросов sla_shed (не записываются) */
+    ngx_uint_t ewsa_count;        /** Количество обновлений квантилей               */
+    ngx_uint_t ewsa_time;         /** Суммарное время обновления квантилей          */
+    ngx_uint_t render_count;      /** Количество выводов статистики пула            */
+    ngx_uint_t render_bytes;      /** Суммарный объем вывода статистики пула        */
+    ngx_uint_t render_time;       /** Суммарное время вывода статистики пула        */
+} ngx_http_sla_stats_t;
+
+/**
+ * Медленный запрос (slow=)
+ */
+typedef struct {
+    time_t         sec;                                 /** Время завершения запроса          */
+    ngx_msec_t     msec;                                /** Миллисекунды времени завершения   */
+    ngx_msec_int_t time;                                /** Суммарное время ответов апстримов */
+    ngx_msec_int_t request;                             /** Полное время обработки запроса    */
+    ngx_uint_t     status;                              /** Статус ответа клиенту             */
+    size_t         uri_len;                             /** Длина URI                         */
+    size_t         peer_len;                            /** Длина имени апстрима              */
+    size_t         id_len;                              /** Длина $request_id                 */
+    u_char         uri[NGX_HTTP_SLA_SLOW_URI_LEN];      /** URI с аргументами                 */
+    u_char         peer[NGX_HTTP_SLA_MAX_PEER_LEN];     /** Последний апстрим с учетом алиаса */
+    u_char         id[NGX_HTTP_SLA_REQUEST_ID_LEN];     /** $request_id                       */
+} ngx_http_sla_slow_t;
+
+/**
+ * Кольцевой буфер медленных запросов в shared memory
+ */
+typedef struct {
+    ngx_uint_t          head;         /** Количество записанных запросов */
+    ngx_http_sla_slow_t entries[1];   /** Запросы (slow= элементов)      */
+} ngx_http_sla_slow_ring_t;
+
 /**
  * Пул статистики
  */
 typedef struct {
-    ngx_str_t                name;         /** Имя пула                             */
-    ngx_array_t              http;         /** Коды HTTP (ngx_uint_t)               */
-    ngx_array_t              timings;      /** Тайминги (ngx_uint_t)                */
-    ngx_array_t              quantiles;    /** Квантили (ngx_uint_t)                */
-    ngx_uint_t               avg_window;   /** Размер окна для скользящего среднего */
-    ngx_uint_t               min_timing;   /** Время "отсечки"                      */
-    ngx_slab_pool_t*         shm_pool;     /** Shared memory pool                   */
-    ngx_http_sla_pool_shm_t* shm_ctx;      /** Данные в shared memory               */
-    ngx_uint_t               generation;   /** Номер поколения пула                 */
+    ngx_str_t                 name;            /** Имя пула                             */
+    ngx_array_t               http;            /** Коды HTTP (ngx_uint_t)               */
+    ngx_array_t               timings;         /** Тайминги (ngx_uint_t)                */
+    ngx_array_t               quantiles;       /** Квантили (ngx_uint_t)                */
+    ngx_uint_t                avg_window;      /** Размер окна для скользящего среднего */
+    ngx_uint_t                min_timing;      /** Время "отсечки"                      */
+    ngx_http_sla_engine_t     engine;          /** Параметры ядра агрегации             */
+    ngx_slab_pool_t*          shm_pool;        /** Shared memory pool                   */
+    ngx_http_sla_pool_shm_t*  shm_ctx;         /** Данные в shared memory               */
+    ngx_uint_t                generation;      /** Номер поколения пула                 */
+    ngx_uint_t                stream;          /** Пул модуля stream                    */
+    ngx_uint_t                cache;           /** Счетчики по статусам кэша            */
+    ngx_uint_t                request;         /** Счетчик полного времени запроса      */
+    ngx_uint_t                status_timings;  /** Времена ответов по группам статусов  */
+    ngx_uint_t                retries;         /** Учет повторных попыток               */
+    ngx_uint_t                clients;         /** Оценка числа уникальных клиентов     */
+    ngx_str_t                 clients_var;     /** Имя переменной клиента (clients=$)   */
+    ngx_int_t                 clients_index;   /** Индекс переменной или -1 (адрес)     */
+    ngx_uint_t                group_by;        /** Группировка счетчиков (group_by)     */
+    ngx_uint_t                slow;            /** Размер буфера медленных запросов     */
+    ngx_uint_t                slow_timing;     /** Порог медленного запроса (0 - p99)   */
+    ngx_uint_t                p99_index;       /** Индекс p99 (или старшего) квантиля   */
+    ngx_http_sla_slow_ring_t* shm_slow;        /** Медленные запросы в shared memory    */
+    ngx_http_sla_timing_t*    shm_timing_xxx;  /** Времена 2xx-5xx счетчиков (по 4)     */
+    u_char*                   shm_clients;     /** Регистры HyperLogLog счетчиков       */
+    ngx_flag_t                stats;           /** Сбор внутренней статистики модуля    */
+    ngx_http_sla_stats_t*     stats_local;     /** Статистика, накопленная процессом    */
+    ngx_http_sla_stats_t*     shm_stats;       /** Статистика модуля в shared memory    */
+    ngx_msec_t                stats_flush;     /** Время последнего сброса в shm        */
+    ngx_uint_t                lock_time;       /** Время захвата мьютекса пула          */
 } ngx_http_sla_pool_t;
 
 /**
@@ -150,30 +305,194 @@ typedef struct {
     ngx_str_t alias;   /** Алиас для статистики  */
 } ngx_http_sla_alias_t;
 
+/**
+ * Алиас апстрима в shared memory (sla_alias_api)
+ */
+typedef struct {
+    ngx_atomic_t version;                            /** Версия ячейки (нечетная - идет изменение) */
+    ngx_uint_t   state;                              /** Состояние ячейки (NGX_HTTP_SLA_ALIAS_*)   */
+    ngx_uint_t   hash;                               /** Хэш исходного имени апстрима              */
+    size_t       name_len;                           /** Длина исходного имени апстрима            */
+    size_t       alias_len;                          /** Длина алиаса                              */
+    u_char       name[NGX_HTTP_SLA_MAX_PEER_LEN];    /** Исходное имя апстрима                     */
+    u_char       alias[NGX_HTTP_SLA_MAX_NAME_LEN];   /** Алиас для статистики                      */
+} ngx_http_sla_alias_shm_t;
+
+/**
+ * Таблица алиасов, изменяемых без перезагрузки (sla_alias_zone)
+ */
+typedef struct {
+    ngx_uint_t                limit;      /** Максимальное количество алиасов      */
+    ngx_uint_t                size;       /** Количество ячеек (открытая адресация) */
+    ngx_slab_pool_t*          shm_pool;   /** Shared memory pool                   */
+    ngx_uint_t*               count;      /** Количество алиасов в shared memory   */
+    ngx_uint_t*               probe;      /** Наибольшее смещение алиаса от хэша    */
+    ngx_http_sla_alias_shm_t* entries;    /** Ячейки в shared memory               */
+} ngx_http_sla_alias_table_t;
+
+/**
+ * Отправка статистики во внешнюю систему мониторинга
+ */
+typedef struct {
+    ngx_addr_t*              addr;       /** Адрес получателя                            */
+    ngx_uint_t               type;       /** Тип сокета (SOCK_DGRAM или SOCK_STREAM)     */
+    ngx_uint_t               format;     /** Протокол (NGX_HTTP_SLA_EXPORT_*)            */
+    ngx_msec_t               interval;   /** Интервал отправки                           */
+    size_t                   size;       /** Размер буфера для отправки по tcp           */
+    ngx_str_t                prefix;     /** Префикс ключей                              */
+    ngx_str_t                host;       /** Имя узла в zabbix                           */
+    ngx_array_t*             pools;      /** Пулы статистики (ngx_http_sla_pool_t)       */
+    ngx_http_sla_pool_shm_t* current;    /** Снимок счетчиков пула                       */
+    ngx_http_sla_pool_shm_t* previous;   /** Снимки счетчиков всех пулов с прошлой отправки */
+    u_char*                  start;      /** Буфер для отправки                          */
+    u_char*                  end;        /** Конец буфера                                */
+    u_char*                  pos;        /** Отправленная часть буфера (tcp)             */
+    u_char*                  last;       /** Заполненная часть буфера                    */
+    ngx_uint_t               items;      /** Количество значений в буфере                */
+    ngx_uint_t               overflow;   /** Буфер переполнен                            */
+    ngx_socket_t             fd;         /** Сокет udp                                   */
+    ngx_peer_connection_t    peer;       /** Соединение tcp                              */
+    ngx_event_t              event;      /** Таймер отправки                             */
+    ngx_log_t*               log;        /** Лог                                         */
+} ngx_http_sla_export_t;
+
+/**
+ * Кольцевой буфер событий в файле (sla_events), отображается в память до запуска рабочих процессов
+ */
+typedef struct {
+    ngx_str_t                     path;       /** Путь к файлу               */
+    size_t                        size;       /** Размер файла               */
+    ngx_http_sla_events_header_t* header;     /** Заголовок (начало файла)   */
+    ngx_http_sla_event_t*         records;    /** Записи                     */
+} ngx_http_sla_events_t;
+
+/**
+ * Результат вывода статистики одного location (sla_status cache=)
+ */
+typedef struct {
+    u_char*    body;       /** Тело ответа (в shared memory)               */
+    size_t     len;        /** Длина тела ответа                           */
+    ngx_msec_t expires;    /** Время устаревания                           */
+    ngx_msec_t updating;   /** Время окончания обновления другим процессом */
+} ngx_http_sla_render_t;
+
+/**
+ * Результаты вывода статистики, общие для всех рабочих процессов
+ */
+typedef struct {
+    ngx_uint_t             n;                /** Количество location с sla_status cache=   */
+    ngx_uint_t             generation;       /** Поколение конфигурации массива результатов */
+    ngx_slab_pool_t*       shm_pool;         /** Shared memory pool                        */
+    ngx_uint_t*            shm_generation;   /** Текущее поколение в shared memory         */
+    ngx_http_sla_render_t* renders;          /** Результаты в shared memory                */
+} ngx_http_sla_render_cache_t;
+
 /**
  * Основная конфигурация
  */
 typedef struct {
-    ngx_array_t pools;          /** Пулы статистики (ngx_http_sla_pool_t)   */
-    ngx_array_t aliases;        /** Алиасы апстримов (ngx_http_sla_alias_t) */
-    ngx_str_t   default_pool;   /** Имя пула по умолчанию                   */
+    ngx_array_t                  pools;          /** Пулы статистики (ngx_http_sla_pool_t)      */
+    ngx_array_t                  aliases;        /** Алиасы апстримов (ngx_http_sla_alias_t)    */
+    ngx_http_sla_alias_table_t*  alias_table;    /** Алиасы времени выполнения (sla_alias_zone) */
+    ngx_uint_t                   alias_api;      /** Используется sla_alias_api                 */
+    ngx_http_sla_render_cache_t* render_cache;   /** Результаты вывода (sla_status cache=)      */
+    ngx_str_t                    default_pool;   /** Имя пула по умолчанию                      */
+    ngx_flag_t                   stats;          /** Сбор внутренней статистики модуля          */
+    ngx_http_sla_export_t*       export;         /** Отправка статистики (sla_export)           */
+    ngx_http_sla_events_t*       events;         /** Кольцевой буфер событий (sla_events)       */
+    ngx_int_t                    request_id;     /** Индекс переменной $request_id или -1       */
+    ngx_uint_t                   shed;           /** Используется sla_shed                      */
 } ngx_http_sla_main_conf_t;
 
+/**
+ * Сброс нагрузки (sla_shed)
+ */
+typedef struct {
+    ngx_http_sla_pool_t* pool;       /** Пул статистики                            */
+    ngx_int_t            index;      /** Индекс квантиля в пуле (-1 - среднее)     */
+    ngx_uint_t           target;     /** Целевое значение метрики                  */
+    ngx_uint_t           share;      /** Доля отклоняемых запросов в процентах     */
+    ngx_uint_t           status;     /** Статус ответа отклоненным запросам        */
+} ngx_http_sla_shed_t;
+
 /**
  * Конфигурация location
  */
 typedef struct {
-    ngx_http_sla_pool_t* pool;      /** Пул для сбора статистики                */
-    ngx_array_t*         aliases;   /** Алиасы апстримов (ngx_http_sla_alias_t) */
-    ngx_uint_t           off;       /** Сбор статистики выключен                */
+    ngx_array_t*              pools;     /** Пулы для сбора статистики (ngx_http_sla_pool_t*) */
+    ngx_http_complex_value_t* filter;    /** Условие сбора статистики (if=)                   */
+    ngx_array_t*              aliases;   /** Алиасы апстримов (ngx_http_sla_alias_t)          */
+    ngx_uint_t                off;       /** Сбор статистики выключен                         */
+    ngx_uint_t                reset;     /** Обнуление счетчиков при выводе                   */
+    ngx_uint_t                binary;    /** Вывод в двоичном формате                         */
+    ngx_uint_t                slow;      /** Вывод медленных запросов                         */
+    ngx_msec_t                cache;     /** Время жизни результата вывода (cache=)           */
+    ngx_uint_t                slot;      /** Номер результата в ngx_http_sla_render_cache_t   */
+    ngx_http_sla_shed_t*      shed;      /** Сброс нагрузки (sla_shed), NULL - выключен       */
+    ngx_uint_t                shed_set;  /** Директива sla_shed задана на этом уровне         */
 } ngx_http_sla_loc_conf_t;
 
+/**
+ * Ответ апстрима для записи в пулы
+ */
+typedef struct {
+    ngx_str_t*     name;     /** Имя апстрима с учетом алиаса */
+    ngx_str_t*     group;    /** Имя "группа/апстрим"         */
+    ngx_msec_int_t ms;       /** Время ответа                 */
+    ngx_uint_t     status;   /** Статус ответа                */
+} ngx_http_sla_state_t;
+
+/**
+ * Запрос для записи в пулы
+ */
+typedef struct {
+    ngx_http_sla_state_t* states;      /** Ответы апстримов                     */
+    ngx_uint_t            n;           /** Количество ответов апстримов         */
+    ngx_str_t*            upstream;    /** Имя группы upstream или NULL         */
+    ngx_str_t             uri;         /** URI для медленных запросов           */
+    ngx_str_t             id;          /** $request_id для медленных запросов   */
+    ngx_msec_int_t        time;        /** Суммарное время ответов апстримов    */
+    ngx_uint_t            status;      /** Статус ответа клиенту                */
+    ngx_msec_int_t        request;     /** Полное время обработки запроса       */
+    ngx_str_t*            cache;       /** Счетчик статуса кэша или NULL        */
+    ngx_uint_t            cache_hit;   /** Ответ отдан из кэша                  */
+    ngx_uint_t            client;      /** Клиент определен (clients=)          */
+    uint32_t              hash;        /** Хэш клиента для HyperLogLog          */
+} ngx_http_sla_request_t;
+
+/**
+ * Конфигурация балансировки upstream
+ */
+typedef struct {
+    ngx_str_t                   name;          /** Имя пула статистики                         */
+    ngx_str_t                   upstream;      /** Имя группы upstream                         */
+    ngx_http_sla_pool_t*        pool;          /** Пул статистики                              */
+    ngx_array_t*                aliases;       /** Алиасы апстримов (ngx_http_sla_alias_t)     */
+    ngx_http_sla_alias_table_t* alias_table;   /** Алиасы времени выполнения (sla_alias_zone)  */
+    ngx_uint_t                  quantile;      /** Квантиль метрики (0 - скользящее среднее)   */
+    ngx_int_t                   index;         /** Индекс квантиля в пуле (-1 - среднее)       */
+} ngx_http_sla_balance_conf_t;
+
+/**
+ * Данные балансировки запроса
+ */
+typedef struct {
+    ngx_http_upstream_rr_peer_data_t rrp;       /** Данные round robin (должны быть первыми) */
+    ngx_http_sla_balance_conf_t*     conf;      /** Конфигурация балансировки                */
+    ngx_uint_t                       number;    /** Количество основных серверов             */
+    double*                          metrics;   /** Метрики серверов (по порядку в списке)   */
+} ngx_http_sla_balance_peer_data_t;
+
 
 /* стандартные методы модуля nginx */
+static ngx_int_t ngx_http_sla_add_variables    (ngx_conf_t* cf);
 static ngx_int_t ngx_http_sla_init             (ngx_conf_t* cf);
 static void*     ngx_http_sla_create_main_conf (ngx_conf_t* cf);
+static char*     ngx_http_sla_init_main_conf   (ngx_conf_t* cf, void* conf);
+static void*     ngx_http_sla_create_srv_conf  (ngx_conf_t* cf);
 static void*     ngx_http_sla_create_loc_conf  (ngx_conf_t* cf);
 static char*     ngx_http_sla_merge_loc_conf   (ngx_conf_t* cf, void* parent, void* child);
+static ngx_int_t ngx_http_sla_init_process     (ngx_cycle_t* cycle);
 
 /**
  * Обработчик конфигурации sla_pool
@@ -185,21 +504,96 @@ static char* ngx_http_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
  */
 static char* ngx_http_sla_alias (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 
+/**
+ * Обработчик конфигурации sla_alias_zone
+ */
+static char* ngx_http_sla_alias_zone (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+/**
+ * Обработчик конфигурации sla_alias_api
+ */
+static char* ngx_http_sla_alias_api (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
 /**
  * Обработчик конфигурации sla_pass
  */
 static char* ngx_http_sla_pass (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 
+/**
+ * Разбор списка пулов sla_pass (общий для http и stream)
+ */
+static char* ngx_http_sla_parse_pass (ngx_conf_t* cf, ngx_http_sla_loc_conf_t* config, ngx_http_sla_main_conf_t* mconfig, ngx_uint_t stream);
+
+/**
+ * Наследование списка пулов sla_pass (общее для http и stream)
+ */
+static char* ngx_http_sla_merge_pass (ngx_conf_t* cf, ngx_http_sla_loc_conf_t* prev, ngx_http_sla_loc_conf_t* current, ngx_http_sla_main_conf_t* mconfig);
+
+/**
+ * Обработчик конфигурации sla_export
+ */
+static char* ngx_http_sla_export (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+/**
+ * Обработчик конфигурации sla_events
+ */
+static char* ngx_http_sla_events (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+/**
+ * Отображение файла sla_events в память (с сохранением записей при перезагрузке конфигурации)
+ */
+static ngx_int_t ngx_http_sla_events_map (ngx_conf_t* cf, ngx_http_sla_events_t* events);
+
+/**
+ * Освобождение отображения файла sla_events при завершении цикла
+ */
+static void ngx_http_sla_events_unmap (void* data);
+
 /**
  * Установка обработчика команды sla_stub
  */
 static char* ngx_http_sla_status (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 
+/**
+ * Установка обработчика команды sla_value
+ */
+static char* ngx_http_sla_value (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
 /**
  * Установка обработчика команды sla_purge
  */
 static char* ngx_http_sla_purge (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 
+/**
+ * Обработчик конфигурации sla_balance
+ */
+static char* ngx_http_sla_balance (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+/**
+ * Обработчик конфигурации sla_shed
+ */
+static char* ngx_http_sla_shed (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+/**
+ * Значения $sla_p99, $sla_avg_mov и $sla_err_ratio первого пула location (без захвата мьютекса)
+ */
+static ngx_int_t ngx_http_sla_variable (ngx_http_request_t* r, ngx_http_variable_value_t* v, uintptr_t data);
+
+/**
+ * Обработчик фазы preaccess - отклонение доли запросов при превышении целевой метрики пула
+ */
+static ngx_int_t ngx_http_sla_shed_handler (ngx_http_request_t* r);
+
+/**
+ * Метка отклоненного sla_shed запроса в r->pool (переживает внутренние перенаправления, в отличие от ctx)
+ */
+static void ngx_http_sla_shed_cleanup (void* data);
+
+/**
+ * Запрос отклонен sla_shed - не записывается в пулы, чтобы не занижать метрику и не учитываться как 5xx
+ */
+static ngx_uint_t ngx_http_sla_is_shed (ngx_http_request_t* r);
+
 /**
  * Обработчик вызова метода sla_stub - вывод статистических данных
  */
@@ -210,11 +604,107 @@ static ngx_int_t ngx_http_sla_status_handler (ngx_http_request_t* r);
  */
 static ngx_int_t ngx_http_sla_purge_handler (ngx_http_request_t* r);
 
+/**
+ * Обработчик вызова метода sla_value - одно значение статистики по ключу
+ */
+static ngx_int_t ngx_http_sla_value_handler (ngx_http_request_t* r);
+
+/**
+ * Получение общего результата вывода: NGX_OK - результат скопирован в buf,
+ * NGX_DECLINED - результат устарел и должен быть сформирован вызывающим
+ */
+static ngx_int_t ngx_http_sla_get_render (ngx_http_sla_render_cache_t* cache, const ngx_http_sla_loc_conf_t* config, ngx_http_request_t* r, ngx_buf_t** buf);
+
+/**
+ * Сохранение результата вывода для других рабочих процессов
+ */
+static void ngx_http_sla_set_render (ngx_http_sla_render_cache_t* cache, const ngx_http_sla_loc_conf_t* config, const ngx_buf_t* buf);
+
+/**
+ * Инициализация shared memory результатов вывода
+ */
+static ngx_int_t ngx_http_sla_init_render_zone (ngx_shm_zone_t* shm_zone, void* data);
+
+/**
+ * Максимальный размер вывода одного счетчика в текстовом формате
+ */
+static size_t ngx_http_sla_counter_size (void);
+
+/**
+ * Обработчик вызова метода sla_alias_api - изменение алиасов без перезагрузки
+ */
+static ngx_int_t ngx_http_sla_alias_api_handler (ngx_http_request_t* r);
+
+/**
+ * Список всех пулов (http, затем stream) для вывода и сброса статистики
+ */
+static ngx_http_sla_pool_t** ngx_http_sla_get_all_pools (ngx_http_request_t* r, ngx_uint_t* n);
+
+/**
+ * Получение аргументов pool и counter для выбора пула и счетчика
+ */
+static ngx_int_t ngx_http_sla_get_selector (ngx_http_request_t* r, ngx_str_t* pool, ngx_str_t* counter);
+
+/**
+ * Получение раскодированного аргумента запроса
+ */
+static ngx_int_t ngx_http_sla_get_arg (ngx_http_request_t* r, const char* name, ngx_str_t* value);
+
+/**
+ * Проверка соответствия имени выбору (пустой выбор соответствует любому имени)
+ */
+static ngx_uint_t ngx_http_sla_match (const ngx_str_t* selector, const u_char* name, size_t len);
+
+/**
+ * Обнуление счетчика с сохранением имени
+ */
+static void ngx_http_sla_reset_counter (ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter);
+
+/**
+ * Обнуление выбранных счетчиков пула с сохранением имен (под мьютексом пула)
+ */
+static void ngx_http_sla_reset_pool (ngx_http_sla_pool_t* pool, const ngx_str_t* counter);
+
 /**
  * Обработчик завершения запроса - сбор статистических данных
  */
 static ngx_int_t ngx_http_sla_processor (ngx_http_request_t* r);
 
+/**
+ * Запись ответов апстримов и запроса в пул (под мьютексом пула)
+ */
+static void ngx_http_sla_record (ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req);
+
+/**
+ * Запись ответа апстрима в счетчик пула (мьютекс пула должен быть захвачен), counter - счетчик или NULL
+ */
+static ngx_int_t ngx_http_sla_record_state (ngx_http_sla_pool_t* pool, const ngx_str_t* name, const ngx_http_sla_state_t* state, ngx_http_sla_pool_shm_t** counter);
+
+/**
+ * Хэш клиента запроса для пула: адрес или значение переменной clients=$
+ */
+static ngx_int_t ngx_http_sla_get_client (ngx_http_request_t* r, const ngx_http_sla_pool_t* pool, uint32_t* hash);
+
+/**
+ * Регистры HyperLogLog счетчика (блок clients в shared memory)
+ */
+static u_char* ngx_http_sla_get_clients (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter);
+
+/**
+ * Учет клиента в регистрах HyperLogLog счетчика
+ */
+static void ngx_http_sla_add_client (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter, uint32_t hash);
+
+/**
+ * Оценка числа уникальных клиентов счетчика по регистрам HyperLogLog
+ */
+static ngx_uint_t ngx_http_sla_count_clients (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter);
+
+/**
+ * Учет количества попыток и времени неудачных попыток запроса (мьютекс пула должен быть захвачен)
+ */
+static void ngx_http_sla_record_tries (ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req);
+
 /**
  * Инициализация зоны shared memory
  */
@@ -245,6 +735,32 @@ static ngx_int_t ngx_http_sla_compare_pools (const ngx_http_sla_pool_t* pool1, c
  */
 static ngx_str_t* ngx_http_sla_get_alias (const ngx_array_t* aliases, const ngx_str_t* name);
 
+/**
+ * Поиск алиаса сначала в таблице sla_alias_zone, затем среди sla_alias
+ * (при нахождении в таблице алиас копируется в buf размером NGX_HTTP_SLA_MAX_NAME_LEN)
+ */
+static ngx_str_t* ngx_http_sla_find_alias (const ngx_http_sla_alias_table_t* table, const ngx_array_t* aliases, const ngx_str_t* name, ngx_str_t* buf);
+
+/**
+ * Чтение алиаса из таблицы sla_alias_zone без мьютекса
+ */
+static ngx_int_t ngx_http_sla_get_runtime_alias (const ngx_http_sla_alias_table_t* table, const ngx_str_t* name, ngx_str_t* alias);
+
+/**
+ * Установка (alias != NULL) или удаление (alias == NULL) алиаса в таблице sla_alias_zone
+ */
+static ngx_int_t ngx_http_sla_set_runtime_alias (ngx_http_sla_alias_table_t* table, const ngx_str_t* name, const ngx_str_t* alias);
+
+/**
+ * Освобождение удаленных ячеек в конце цепочки sla_alias_zone (под мьютексом зоны)
+ */
+static void ngx_http_sla_clear_removed_aliases (ngx_http_sla_alias_table_t* table, ngx_uint_t index);
+
+/**
+ * Инициализация shared memory таблицы sla_alias_zone
+ */
+static ngx_int_t ngx_http_sla_init_alias_zone (ngx_shm_zone_t* shm_zone, void* data);
+
 /**
  * Поиск счетчика по имени или создание нового счетчика в пуле
  */
@@ -255,6 +771,21 @@ static ngx_http_sla_pool_shm_t* ngx_http_sla_get_counter (ngx_http_sla_pool_t* p
  */
 static ngx_http_sla_pool_shm_t* ngx_http_sla_add_counter (ngx_http_sla_pool_t* pool, const ngx_str_t* name, ngx_uint_t hint);
 
+/**
+ * Отметка об изменении счетчика для выдачи изменений по курсору
+ */
+static void ngx_http_sla_touch_counter (ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter);
+
+/**
+ * Начальный номер изменения для пула, очищенного при (пере)запуске
+ */
+static ngx_uint_t ngx_http_sla_sequence_seed (void);
+
+/**
+ * Разбор курсора (номера изменений пулов через "-") из аргумента since
+ */
+static ngx_int_t ngx_http_sla_parse_cursor (const ngx_str_t* value, ngx_uint_t* cursor, ngx_uint_t n);
+
 /**
  * Установка HTTP кода в счетчике
  */
@@ -263,12 +794,42 @@ static ngx_int_t ngx_http_sla_set_http_status (const ngx_http_sla_pool_t* pool,
 /**
  * Установка времени обработки запроса в счетчике
  */
-static ngx_int_t ngx_http_sla_set_http_time (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t ms);
+static ngx_int_t ngx_http_sla_set_http_time (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t ms, ngx_uint_t status);
+
+/**
+ * Времена ответов 2xx-5xx счетчика (блок status_timings в shared memory)
+ */
+static ngx_http_sla_timing_t* ngx_http_sla_get_timing_xxx (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter);
+
+/**
+ * Учет времени в счетчике и, при status_timings=on, в группе статуса ответа (без отсечки)
+ */
+static void ngx_http_sla_add_http_time (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t ms, ngx_uint_t status);
+
+/**
+ * Учет времени в интервалах, средних и квантилях
+ */
+static void ngx_http_sla_add_timing (const ngx_http_sla_pool_t* pool, ngx_http_sla_timing_t* series, ngx_uint_t ms);
+
+/**
+ * Обновление скользящего среднего с окном пула
+ */
+static void ngx_http_sla_set_avg_mov (const ngx_http_sla_pool_t* pool, double* avg, ngx_uint_t* count, ngx_msec_t ms);
+
+/**
+ * Учет запроса в скоростях запросов
+ */
+static void ngx_http_sla_set_rates (ngx_http_sla_rates_t* rates, ngx_uint_t status, ngx_uint_t ms);
+
+/**
+ * Пересчет скоростей за прошедшие интервалы
+ */
+static void ngx_http_sla_tick_rates (ngx_http_sla_rates_t* rates, ngx_msec_t now);
 
 /**
  * Вывод статистики пула
  */
-static void ngx_http_sla_print_pool (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool);
+static void ngx_http_sla_print_pool (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, ngx_uint_t since, const ngx_str_t* counter);
 
 /**
  * Вывод статистики счетчика
@@ -276,28 +837,147 @@ static void ngx_http_sla_print_pool (ngx_buf_t* buf, const ngx_http_sla_pool_t*
 static void ngx_http_sla_print_counter (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter);
 
 /**
- * Компаратор ngx_uint_t для сортировки массива
+ * Вывод средних, интервалов и процентилей счетчика (group - суффикс группы статусов или "")
  */
-static int ngx_libc_cdecl ngx_http_sla_compare_uint (const void* p1, const void* p2);
+static void ngx_http_sla_print_timing (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter, const char* group, const ngx_http_sla_timing_t* series);
 
 /**
- * Инициализация квантилей
+ * Вывод внутренней статистики модуля для пула
  */
-static void ngx_http_sla_init_quantiles (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter);
+static void ngx_http_sla_print_stats (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool);
 
 /**
- * Обновление квантилей
+ * Вывод медленных запросов пула, начиная с последнего
  */
-static void ngx_http_sla_update_quantiles (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter);
+static void ngx_http_sla_print_slow (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool);
 
+/**
+ * Запись ответов апстримов и запроса в целом в кольцевой буфер sla_events (без захвата мьютекса)
+ */
+static void ngx_http_sla_add_events (ngx_http_sla_events_t* events, const ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req);
 
 /**
- * Список команд
+ * Запись одного события в кольцевой буфер sla_events
  */
-static ngx_command_t ngx_http_sla_commands[] = {
-    { ngx_string("sla_pool"),
-      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
-      ngx_http_sla_pool,
+static void ngx_http_sla_add_event (ngx_http_sla_events_t* events, const ngx_http_sla_pool_t* pool, const ngx_str_t* counter, ngx_msec_int_t time, ngx_msec_int_t request, ngx_uint_t status);
+
+/**
+ * Запись медленного запроса в кольцевой буфер пула (мьютекс пула должен быть захвачен)
+ */
+static void ngx_http_sla_add_slow (ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req);
+
+/**
+ * Вывод счетчиков пула в двоичном формате (ngx_http_sla_binary.h)
+ */
+static void ngx_http_sla_dump_pool (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, const ngx_str_t* counter);
+
+/**
+ * Текущее время в микросекундах
+ */
+static ngx_uint_t ngx_http_sla_usec (void);
+
+/**
+ * Время в микросекундах, прошедшее с момента start (0, если время переведено назад)
+ */
+static ngx_uint_t ngx_http_sla_usec_since (ngx_uint_t start);
+
+/**
+ * Захват мьютекса пула с учетом времени ожидания
+ */
+static void ngx_http_sla_lock (ngx_http_sla_pool_t* pool);
+
+/**
+ * Освобождение мьютекса пула с учетом времени удержания
+ */
+static void ngx_http_sla_unlock (ngx_http_sla_pool_t* pool);
+
+/**
+ * Перенос накопленной процессом статистики модуля в shm (под мьютексом пула)
+ */
+static void ngx_http_sla_flush_stats (ngx_http_sla_pool_t* pool, ngx_uint_t force);
+
+/**
+ * Инициализация балансировки upstream
+ */
+static ngx_int_t ngx_http_sla_balance_init (ngx_conf_t* cf, ngx_http_upstream_srv_conf_t* us);
+
+/**
+ * Инициализация балансировки запроса
+ */
+static ngx_int_t ngx_http_sla_balance_init_peer (ngx_http_request_t* r, ngx_http_upstream_srv_conf_t* us);
+
+/**
+ * Выбор апстрима с учетом времени ответа
+ */
+static ngx_int_t ngx_http_sla_balance_get_peer (ngx_peer_connection_t* pc, void* data);
+
+/**
+ * Текущее значение метрики апстрима (без захвата мьютекса пула, 0 - нет данных)
+ */
+static double ngx_http_sla_balance_metric (const ngx_http_sla_balance_conf_t* conf, const ngx_str_t* name);
+
+#ifdef NGX_HTTP_SLA_EXPORT
+
+/**
+ * Обработчик таймера отправки статистики
+ */
+static void ngx_http_sla_export_handler (ngx_event_t* ev);
+
+/**
+ * Формирование данных для отправки по всем пулам
+ */
+static void ngx_http_sla_export_pools (ngx_http_sla_export_t* export);
+
+/**
+ * Формирование данных для отправки по счетчику пула
+ */
+static void ngx_http_sla_export_counter (ngx_http_sla_export_t* export, const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter, const ngx_http_sla_pool_shm_t* prev);
+
+/**
+ * Добавление значения в буфер отправки
+ */
+static void ngx_http_sla_export_value (ngx_http_sla_export_t* export, const ngx_http_sla_pool_t* pool, const ngx_str_t* counter, const u_char* key, const u_char* key_end, ngx_uint_t value, ngx_uint_t gauge);
+
+/**
+ * Приращение счетчика с прошлой отправки (с учетом обнуления)
+ */
+static ngx_uint_t ngx_http_sla_delta (ngx_uint_t current, ngx_uint_t previous);
+
+/**
+ * Отправка заполненной части буфера датаграммой udp
+ */
+static void ngx_http_sla_export_send_udp (ngx_http_sla_export_t* export);
+
+/**
+ * Установка соединения tcp для отправки буфера
+ */
+static void ngx_http_sla_export_connect (ngx_http_sla_export_t* export);
+
+/**
+ * Обработчик записи в соединение tcp
+ */
+static void ngx_http_sla_export_write_handler (ngx_event_t* wev);
+
+/**
+ * Обработчик чтения из соединения tcp (ответ игнорируется)
+ */
+static void ngx_http_sla_export_read_handler (ngx_event_t* rev);
+
+/**
+ * Закрытие соединения tcp
+ */
+static void ngx_http_sla_export_close (ngx_http_sla_export_t* export);
+
+#endif
+
+
+/**
+ * Список команд
+ */
+static ngx_command_t ngx_http_sla_commands[] = {
+    { ngx_string("sla_pool"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_sla_pool,
       NGX_HTTP_MAIN_CONF_OFFSET,
       0,
       NULL },
@@ -309,24 +989,80 @@ static ngx_command_t ngx_http_sla_commands[] = {
       0,
       NULL },
 
+    { ngx_string("sla_alias_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_http_sla_alias_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sla_alias_api"),
+      NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_sla_alias_api,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("sla_pass"),
-      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
       ngx_http_sla_pass,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
     { ngx_string("sla_status"),
-      NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_ANY,
       ngx_http_sla_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
+      NULL },
+
+    { ngx_string("sla_value"),
+      NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_sla_value,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
     { ngx_string("sla_purge"),
       NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
       ngx_http_sla_purge,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sla_export"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_sla_export,
+      NGX_HTTP_MAIN_CONF_OFFSET,
       0,
+      NULL },
+
+    { ngx_string("sla_events"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE12,
+      ngx_http_sla_events,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sla_stats"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_sla_main_conf_t, stats),
+      NULL },
+
+    { ngx_string("sla_balance"),
+      NGX_HTTP_UPS_CONF | NGX_CONF_1MORE,
+      ngx_http_sla_balance,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sla_shed"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+      ngx_http_sla_shed,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
@@ -337,13 +1073,13 @@ static ngx_command_t ngx_http_sla_commands[] = {
  * Методы инициализации модуля и конфигурации
  */
 static ngx_http_module_t ngx_http_sla_module_ctx = {
-    NULL,                            /* preconfiguration              */
+    ngx_http_sla_add_variables,      /* preconfiguration              */
     ngx_http_sla_init,               /* postconfiguration             */
 
     ngx_http_sla_create_main_conf,   /* create main configuration     */
-    NULL,                            /* init main configuration       */
+    ngx_http_sla_init_main_conf,     /* init main configuration       */
 
-    NULL,                            /* create server configuration   */
+    ngx_http_sla_create_srv_conf,    /* create server configuration   */
     NULL,                            /* merge server configuration    */
 
     ngx_http_sla_create_loc_conf,    /* create location configuration */
@@ -360,7 +1096,7 @@ ngx_module_t ngx_http_sla_module = {
     NGX_HTTP_MODULE,            /* module type       */
     NULL,                       /* init master       */
     NULL,                       /* init module       */
-    NULL,                       /* init process      */
+    ngx_http_sla_init_process,  /* init process      */
     NULL,                       /* init thread       */
     NULL,                       /* exit thread       */
     NULL,                       /* exit process      */
@@ -368,18 +1104,199 @@ ngx_module_t ngx_http_sla_module = {
     NGX_MODULE_V1_PADDING
 };
 
+#ifdef NGX_STREAM_SLA
+
+/* стандартные методы модуля nginx stream */
+static ngx_int_t ngx_stream_sla_init             (ngx_conf_t* cf);
+static void*     ngx_stream_sla_create_srv_conf  (ngx_conf_t* cf);
+static char*     ngx_stream_sla_merge_srv_conf   (ngx_conf_t* cf, void* parent, void* child);
+
+/**
+ * Обработчик конфигурации sla_pool в контексте stream
+ */
+static char* ngx_stream_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+/**
+ * Обработчик конфигурации sla_pass в контексте stream
+ */
+static char* ngx_stream_sla_pass (ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+/**
+ * Обработчик завершения сессии - сбор статистических данных
+ */
+static ngx_int_t ngx_stream_sla_processor (ngx_stream_session_t* s);
+
+/**
+ * Запись сессии в пул (под мьютексом пула)
+ */
+static void ngx_stream_sla_record (ngx_http_sla_pool_t* pool, ngx_stream_session_t* s, const ngx_array_t* aliases, ngx_msec_int_t ms);
+
+/**
+ * Учет времен соединения и объема данных сессии в счетчике
+ */
+static void ngx_stream_sla_set_state (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_msec_t connect, ngx_msec_t first_byte, off_t sent, off_t received);
+
+/**
+ * Список команд модуля stream
+ */
+static ngx_command_t ngx_stream_sla_commands[] = {
+    { ngx_string("sla_pool"),
+      NGX_STREAM_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_stream_sla_pool,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sla_alias"),
+      NGX_STREAM_MAIN_CONF | NGX_CONF_TAKE2,
+      ngx_http_sla_alias,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sla_pass"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_1MORE,
+      ngx_stream_sla_pass,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    ngx_null_command
+};
+
+/**
+ * Методы инициализации модуля stream и конфигурации
+ */
+static ngx_stream_module_t ngx_stream_sla_module_ctx = {
+    NULL,                             /* preconfiguration            */
+    ngx_stream_sla_init,              /* postconfiguration           */
+
+    ngx_http_sla_create_main_conf,    /* create main configuration   */
+    ngx_http_sla_init_main_conf,      /* init main configuration     */
+
+    ngx_stream_sla_create_srv_conf,   /* create server configuration */
+    ngx_stream_sla_merge_srv_conf     /* merge server configuration  */
+};
+
+/**
+ * Описание модуля stream
+ */
+ngx_module_t ngx_stream_sla_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_sla_module_ctx,   /* module context    */
+    ngx_stream_sla_commands,      /* module directives */
+    NGX_STREAM_MODULE,            /* module type       */
+    NULL,                         /* init master       */
+    NULL,                         /* init module       */
+    NULL,                         /* init process      */
+    NULL,                         /* init thread       */
+    NULL,                         /* exit thread       */
+    NULL,                         /* exit process      */
+    NULL,                         /* exit master       */
+    NGX_MODULE_V1_PADDING
+};
+
+#endif
+
+/**
+ * Коэффициенты затухания скоростей за интервал для 1, 5 и 15 минут
+ */
+static double ngx_http_sla_rate_decay[3];
+
+/**
+ * Счетчик полного времени запроса
+ */
+static ngx_str_t ngx_http_sla_request_counter = ngx_string("request");
+
+/**
+ * Счетчик запроса в целом для sla_events
+ */
+static ngx_str_t ngx_http_sla_all_counter = ngx_string("all");
+
+/**
+ * Переменные модуля
+ */
+static ngx_http_variable_t ngx_http_sla_variables[] = {
+    { ngx_string("sla_p99"), NULL, ngx_http_sla_variable, NGX_HTTP_SLA_VARIABLE_P99, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("sla_avg_mov"), NULL, ngx_http_sla_variable, NGX_HTTP_SLA_VARIABLE_AVG_MOV, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("sla_err_ratio"), NULL, ngx_http_sla_variable, NGX_HTTP_SLA_VARIABLE_ERR_RATIO, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    ngx_http_null_variable
+};
+
+#if (NGX_HTTP_CACHE)
+
 /**
- * Средний вес для обновления квантилей
+ * Счетчики статусов кэша (по значениям NGX_HTTP_CACHE_*)
  */
-static double ngx_http_sla_quantile_cc;
+static ngx_str_t ngx_http_sla_cache_status[] = {
+    ngx_null_string,
+    ngx_string("cache_miss"),
+    ngx_string("cache_bypass"),
+    ngx_string("cache_expired"),
+    ngx_string("cache_stale"),
+    ngx_string("cache_updating"),
+    ngx_string("cache_revalidated"),
+    ngx_string("cache_hit")
+};
+
+#endif
+
 
+static ngx_int_t ngx_http_sla_add_variables (ngx_conf_t* cf)
+{
+    ngx_http_variable_t* var;
+    ngx_http_variable_t* v;
+
+    for (v = ngx_http_sla_variables; v->name.len != 0; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data        = v->data;
+    }
+
+    return NGX_OK;
+}
 
 static ngx_int_t ngx_http_sla_init (ngx_conf_t* cf)
 {
+    ngx_uint_t                 i;
     ngx_http_handler_pt*       handler;
     ngx_http_core_main_conf_t* config;
+    ngx_http_sla_main_conf_t*  mconfig;
+    ngx_http_sla_pool_t*       pool;
+#if nginx_version >= 1011000
+    ngx_str_t                  name;
+#endif
+
+    config  = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    mconfig = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
+
+    /* $request_id нужен только пулам с медленными запросами */
+    mconfig->request_id = NGX_ERROR;
+
+    pool = mconfig->pools.elts;
+    for (i = 0; i < mconfig->pools.nelts; i++) {
+        if (pool[i].clients_var.len != 0) {
+            pool[i].clients_index = ngx_http_get_variable_index(cf, &pool[i].clients_var);
+            if (pool[i].clients_index == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
 
-    config = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+#if nginx_version >= 1011000
+        if (pool[i].slow != 0 && mconfig->request_id == NGX_ERROR) {
+            ngx_str_set(&name, "request_id");
+
+            mconfig->request_id = ngx_http_get_variable_index(cf, &name);
+            if (mconfig->request_id == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+#endif
+    }
 
     handler = ngx_array_push(&config->phases[NGX_HTTP_LOG_PHASE].handlers);
     if (handler == NULL) {
@@ -388,12 +1305,21 @@ static ngx_int_t ngx_http_sla_init (ngx_conf_t* cf)
 
     *handler = ngx_http_sla_processor;
 
+    /* сброс нагрузки - только если sla_shed где-то задана */
+    if (mconfig->shed) {
+        handler = ngx_array_push(&config->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+        if (handler == NULL) {
+            return NGX_ERROR;
+        }
+
+        *handler = ngx_http_sla_shed_handler;
+    }
+
     return NGX_OK;
 }
 
 static void* ngx_http_sla_create_main_conf (ngx_conf_t* cf)
 {
-    ngx_uint_t                i;
     ngx_http_sla_main_conf_t* config;
 
     config = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_main_conf_t));
@@ -407,14 +1333,47 @@ static void* ngx_http_sla_create_main_conf (ngx_conf_t* cf)
 
     ngx_str_null(&config->default_pool);
 
+    config->stats = NGX_CONF_UNSET;
+
     if (ngx_array_init(&config->aliases, cf->pool, 4, sizeof(ngx_http_sla_alias_t)) != NGX_OK) {
         return NULL;
     }
 
-    /* EWSA: Calculate average updating weight for next step */
-    ngx_http_sla_quantile_cc = 0;
-    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
-        ngx_http_sla_quantile_cc += (double)1 / sqrt(NGX_HTTP_SLA_QUANTILE_M + i + 1);
+    ngx_http_sla_rate_decay[0] = exp(-(double)NGX_HTTP_SLA_RATE_INTERVAL / 60000);
+    ngx_http_sla_rate_decay[1] = exp(-(double)NGX_HTTP_SLA_RATE_INTERVAL / 300000);
+    ngx_http_sla_rate_decay[2] = exp(-(double)NGX_HTTP_SLA_RATE_INTERVAL / 900000);
+
+    return config;
+}
+
+static char* ngx_http_sla_init_main_conf (ngx_conf_t* cf, void* conf)
+{
+    ngx_uint_t                i;
+    ngx_http_sla_pool_t*      pool;
+    ngx_http_sla_main_conf_t* config = conf;
+
+    ngx_conf_init_value(config->stats, 0);
+
+    if (config->alias_api && config->alias_table == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_alias_api requires sla_alias_zone");
+        return NGX_CONF_ERROR;
+    }
+
+    pool = config->pools.elts;
+    for (i = 0; i < config->pools.nelts; i++) {
+        pool[i].stats = config->stats;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static void* ngx_http_sla_create_srv_conf (ngx_conf_t* cf)
+{
+    ngx_http_sla_balance_conf_t* config;
+
+    config = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_balance_conf_t));
+    if (config == NULL) {
+        return NULL;
     }
 
     return config;
@@ -434,51 +1393,264 @@ static void* ngx_http_sla_create_loc_conf (ngx_conf_t* cf)
 
 static char* ngx_http_sla_merge_loc_conf (ngx_conf_t* cf, void* parent, void* child)
 {
-    ngx_http_sla_loc_conf_t*  prev    = parent;
-    ngx_http_sla_loc_conf_t*  current = child;
     ngx_http_sla_main_conf_t* config;
-
-    if (current->off != 0) {
-        return NGX_CONF_OK;
-    }
+    ngx_http_sla_loc_conf_t*  prev = parent;
+    ngx_http_sla_loc_conf_t*  conf = child;
 
     config = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
 
-    current->aliases = &config->aliases;
-
-    if (current->pool != NULL) {
-        return NGX_CONF_OK;
-    }
-
-    current->pool = prev->pool;
-
-    if (current->pool == NULL) {
-        current->pool = ngx_http_sla_get_pool(&config->pools, &config->default_pool);
+    /* sla_shed off на вложенном уровне отменяет унаследованный сброс */
+    if (!conf->shed_set) {
+        conf->shed = prev->shed;
     }
 
-    return NGX_CONF_OK;
+    return ngx_http_sla_merge_pass(cf, parent, child, config);
 }
 
-static char* ngx_http_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+static char* ngx_http_sla_events (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
-    ngx_uint_t                i;
     ngx_str_t*                value;
-    ngx_int_t                 ival;
-    ngx_uint_t*               pval;
-    size_t                    size;
-    ngx_shm_zone_t*           shm_zone;
-    ngx_http_sla_pool_t*      pool;
+    ngx_str_t                 param;
+    ssize_t                   size;
+    ngx_http_sla_events_t*    events;
     ngx_http_sla_main_conf_t* config = conf;
 
+    if (config->events != NULL) {
+        return "is duplicate";
+    }
+
+    /* head увеличивается атомарно как 64-битное значение */
+    if (sizeof(ngx_atomic_t) != sizeof(uint64_t)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_events requires 64-bit atomic operations");
+        return NGX_CONF_ERROR;
+    }
+
     value = cf->args->elts;
 
-    /* проверка off пула */
-    if (value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invaid sla_pool name \"%V\"", &value[1]);
+    events = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_events_t));
+    if (events == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    /* поиск среди имеющихся пулов */
+    events->path = value[1];
+    events->size = 16 * 1024 * 1024;
+
+    if (ngx_conf_full_name(cf->cycle, &events->path, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "size=", 5) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\" for sla_events", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        param.data = value[2].data + 5;
+        param.len  = value[2].len - 5;
+
+        size = ngx_parse_size(&param);
+        if (size == NGX_ERROR || size < 64 * 1024) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect size value \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        events->size = size;
+    }
+
+    /* целое число записей, заголовок занимает первую */
+    events->size -= events->size % NGX_HTTP_SLA_EVENTS_RECORD_SIZE;
+
+    if (ngx_http_sla_events_map(cf, events) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    config->events = events;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_http_sla_events_map (ngx_conf_t* cf, ngx_http_sla_events_t* events)
+{
+    ngx_fd_t                      fd;
+    u_char*                       addr;
+    uint64_t                      capacity;
+    ngx_file_info_t               fi;
+    ngx_pool_cleanup_t*           cln;
+    ngx_http_sla_events_header_t* header;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(events->path.data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_open_file_n " \"%V\" failed", &events->path);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_fd_info_n " \"%V\" failed", &events->path);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    /*
+     * файл другого размера пересоздается, а не усекается: рабочие процессы старой
+     * конфигурации продолжают писать в прежний файл и не получат SIGBUS
+     */
+    if ((size_t)ngx_file_size(&fi) != events->size) {
+        ngx_close_file(fd);
+
+        if (ngx_file_size(&fi) != 0 && ngx_delete_file(events->path.data) == NGX_FILE_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_delete_file_n " \"%V\" failed", &events->path);
+            return NGX_ERROR;
+        }
+
+        fd = ngx_open_file(events->path.data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+        if (fd == NGX_INVALID_FILE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_open_file_n " \"%V\" failed", &events->path);
+            return NGX_ERROR;
+        }
+
+        /* ftruncate() заполняет файл нулями */
+        if (ftruncate(fd, events->size) == -1) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, "ftruncate() \"%V\" failed", &events->path);
+            ngx_close_file(fd);
+            return NGX_ERROR;
+        }
+    }
+
+    addr = mmap(NULL, events->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    ngx_close_file(fd);
+
+    if (addr == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, "mmap() \"%V\" failed", &events->path);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_sla_events_unmap;
+    cln->data    = events;
+
+    header   = (ngx_http_sla_events_header_t*)addr;
+    capacity = events->size / NGX_HTTP_SLA_EVENTS_RECORD_SIZE - 1;
+
+    events->header  = header;
+    events->records = (ngx_http_sla_event_t*)(addr + NGX_HTTP_SLA_EVENTS_RECORD_SIZE);
+
+    /* при перезагрузке конфигурации с тем же размером записи и номера продолжаются */
+    if (ngx_memcmp(header->magic, NGX_HTTP_SLA_EVENTS_MAGIC, 4) == 0
+        && header->version == NGX_HTTP_SLA_EVENTS_VERSION
+        && header->record_size == NGX_HTTP_SLA_EVENTS_RECORD_SIZE
+        && header->capacity == capacity)
+    {
+        return NGX_OK;
+    }
+
+    ngx_memzero(addr, events->size);
+
+    header->version     = NGX_HTTP_SLA_EVENTS_VERSION;
+    header->record_size = NGX_HTTP_SLA_EVENTS_RECORD_SIZE;
+    header->capacity    = capacity;
+
+    ngx_memory_barrier();
+    ngx_memcpy(header->magic, NGX_HTTP_SLA_EVENTS_MAGIC, 4);
+
+    return NGX_OK;
+}
+
+static void ngx_http_sla_events_unmap (void* data)
+{
+    ngx_http_sla_events_t* events = data;
+
+    munmap((void*)events->header, events->size);
+}
+
+static ngx_int_t ngx_http_sla_init_process (ngx_cycle_t* cycle)
+{
+#ifdef NGX_HTTP_SLA_EXPORT
+    ngx_http_conf_ctx_t*      ctx;
+    ngx_http_sla_export_t*    export;
+    ngx_http_sla_main_conf_t* config;
+
+    ctx = (ngx_http_conf_ctx_t*)cycle->conf_ctx[ngx_http_module.index];
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    config = ctx->main_conf[ngx_http_sla_module.ctx_index];
+    export = config->export;
+
+    /* отправка статистики идет только из первого рабочего процесса */
+    if (export == NULL || (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) || ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    export->log      = cycle->log;
+    export->current  = ngx_palloc(cycle->pool, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
+    export->previous = ngx_pcalloc(cycle->pool, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN * export->pools->nelts);
+    export->start    = ngx_palloc(cycle->pool, export->type == SOCK_DGRAM ? NGX_HTTP_SLA_EXPORT_MTU : export->size);
+
+    if (export->current == NULL || export->previous == NULL || export->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    export->end  = export->start + (export->type == SOCK_DGRAM ? NGX_HTTP_SLA_EXPORT_MTU : export->size);
+    export->pos  = export->start;
+    export->last = export->start;
+    export->fd   = (ngx_socket_t)-1;
+
+    if (export->type == SOCK_DGRAM) {
+        export->fd = ngx_socket(export->addr->sockaddr->sa_family, SOCK_DGRAM, 0);
+        if (export->fd == (ngx_socket_t)-1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno, ngx_socket_n " failed for sla_export");
+            return NGX_ERROR;
+        }
+
+        if (ngx_nonblocking(export->fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno, ngx_nonblocking_n " failed for sla_export");
+            return NGX_ERROR;
+        }
+
+        if (connect(export->fd, export->addr->sockaddr, export->addr->socklen) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno, "connect() to %V failed for sla_export", &export->addr->name);
+            return NGX_ERROR;
+        }
+    }
+
+    export->event.handler    = ngx_http_sla_export_handler;
+    export->event.data       = export;
+    export->event.log        = cycle->log;
+    export->event.cancelable = 1;
+
+    ngx_add_timer(&export->event, export->interval);
+#endif
+
+    return NGX_OK;
+}
+
+static char* ngx_http_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    ngx_uint_t                i;
+    ngx_str_t*                value;
+    ngx_int_t                 ival;
+    ngx_uint_t*               pval;
+    size_t                    size;
+    ngx_shm_zone_t*           shm_zone;
+    ngx_http_sla_pool_t*      pool;
+    ngx_http_sla_main_conf_t* config = conf;
+
+    value = cf->args->elts;
+
+    /* проверка off пула и имен зон sla_alias_zone и sla_status cache= */
+    if ((value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) ||
+        (value[1].len == 9 && ngx_strncmp(value[1].data, "sla_alias", 9) == 0) ||
+        (value[1].len == 10 && ngx_strncmp(value[1].data, "sla_status", 10) == 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invaid sla_pool name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* поиск среди имеющихся пулов */
     pool = config->pools.elts;
     for (i = 0; i < config->pools.nelts; i++) {
         if (pool[i].name.len == value[1].len && ngx_strncmp(pool[i].name.data, value[1].data, value[1].len) == 0) {
@@ -523,11 +1695,34 @@ static char* ngx_http_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
     }
 
     /* значения по умолчанию */
-    pool->shm_pool   = NULL;
-    pool->shm_ctx    = NULL;
-    pool->avg_window = 1600;
-    pool->min_timing = 0;
-    pool->generation = 0;   /* установится при аллокации shm зоны */
+    pool->shm_pool       = NULL;
+    pool->shm_ctx        = NULL;
+    pool->avg_window     = 1600;
+    pool->min_timing     = 0;
+    pool->generation     = 0;   /* установится при аллокации shm зоны */
+    pool->stream         = 0;
+    pool->cache          = 0;
+    pool->request        = 0;
+    pool->status_timings = 0;
+    pool->retries        = 0;
+    pool->clients        = 0;
+    pool->clients_index  = NGX_ERROR;
+    pool->group_by       = NGX_HTTP_SLA_GROUP_PEER;
+    pool->slow           = 0;
+    pool->slow_timing    = 0;
+    pool->p99_index      = 0;
+    pool->shm_slow       = NULL;
+    pool->shm_timing_xxx = NULL;
+    pool->shm_clients    = NULL;
+    pool->stats          = 0;   /* установится при инициализации конфигурации */
+    pool->shm_stats      = NULL;
+
+    ngx_str_null(&pool->clients_var);
+
+    pool->stats_local = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_stats_t));
+    if (pool->stats_local == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
     /* парсинг параметров */
     for (i = 2; i < cf->args->nelts; i++) {
@@ -565,6 +1760,101 @@ static char* ngx_http_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "slow=", 5) == 0) {
+            ival = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (ival == NGX_ERROR || ival < 0 || ival > 65535) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect slow value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            pool->slow = ival;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slow_timing=", 12) == 0) {
+            ival = ngx_atoi(&value[i].data[12], value[i].len - 12);
+            if (ival == NGX_ERROR || ival < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect slow_timing value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            pool->slow_timing = ival;
+            continue;
+        }
+
+        if (value[i].len == 8 && ngx_strncmp(value[i].data, "cache=on", 8) == 0) {
+            pool->cache = 1;
+            continue;
+        }
+
+        if (value[i].len == 9 && ngx_strncmp(value[i].data, "cache=off", 9) == 0) {
+            pool->cache = 0;
+            continue;
+        }
+
+        if (value[i].len == 10 && ngx_strncmp(value[i].data, "request=on", 10) == 0) {
+            pool->request = 1;
+            continue;
+        }
+
+        if (value[i].len == 11 && ngx_strncmp(value[i].data, "request=off", 11) == 0) {
+            pool->request = 0;
+            continue;
+        }
+
+        if (value[i].len == 10 && ngx_strncmp(value[i].data, "clients=on", 10) == 0) {
+            pool->clients = 1;
+            ngx_str_null(&pool->clients_var);
+            continue;
+        }
+
+        if (value[i].len == 11 && ngx_strncmp(value[i].data, "clients=off", 11) == 0) {
+            pool->clients = 0;
+            ngx_str_null(&pool->clients_var);
+            continue;
+        }
+
+        /* индекс переменной - после разбора конфигурации (ngx_http_sla_init) */
+        if (value[i].len > 9 && ngx_strncmp(value[i].data, "clients=$", 9) == 0) {
+            pool->clients          = 1;
+            pool->clients_var.data = value[i].data + 9;
+            pool->clients_var.len  = value[i].len - 9;
+            continue;
+        }
+
+        if (value[i].len == 10 && ngx_strncmp(value[i].data, "retries=on", 10) == 0) {
+            pool->retries = 1;
+            continue;
+        }
+
+        if (value[i].len == 11 && ngx_strncmp(value[i].data, "retries=off", 11) == 0) {
+            pool->retries = 0;
+            continue;
+        }
+
+        if (value[i].len == 17 && ngx_strncmp(value[i].data, "status_timings=on", 17) == 0) {
+            pool->status_timings = 1;
+            continue;
+        }
+
+        if (value[i].len == 18 && ngx_strncmp(value[i].data, "status_timings=off", 18) == 0) {
+            pool->status_timings = 0;
+            continue;
+        }
+
+        if (value[i].len == 13 && ngx_strncmp(value[i].data, "group_by=peer", 13) == 0) {
+            pool->group_by = NGX_HTTP_SLA_GROUP_PEER;
+            continue;
+        }
+
+        if (value[i].len == 17 && ngx_strncmp(value[i].data, "group_by=upstream", 17) == 0) {
+            pool->group_by = NGX_HTTP_SLA_GROUP_UPSTREAM;
+            continue;
+        }
+
+        if (value[i].len == 22 && ngx_strncmp(value[i].data, "group_by=upstream:peer", 22) == 0) {
+            pool->group_by = NGX_HTTP_SLA_GROUP_UPSTREAM | NGX_HTTP_SLA_GROUP_PEER;
+            continue;
+        }
+
         if (value[i].len == 7 && ngx_strncmp(value[i].data, "default", 7) == 0) {
             if (config->default_pool.data != NULL) {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "default sla_pool \"%V\" already defined", &config->default_pool.data);
@@ -624,6 +1914,18 @@ static char* ngx_http_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
         pval[6] = 99;
     }
 
+    /* p99 или старший квантиль - порог медленных запросов по умолчанию и $sla_p99 */
+    pval = pool->quantiles.elts;
+    for (i = 0; i < pool->quantiles.nelts; i++) {
+        if (pval[i] == 99 || pval[i] > pval[pool->p99_index]) {
+            pool->p99_index = i;
+        }
+
+        if (pval[i] == 99) {
+            break;
+        }
+    }
+
     /* заполнение "хвостов" для учета общего числа */
     pval = ngx_array_push(&pool->timings);
     *pval = -1;
@@ -641,8 +1943,35 @@ static char* ngx_http_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
         return NGX_CONF_ERROR;
     }
 
+    /* списки больше не изменяются, ядро ссылается на их элементы */
+    pool->engine.timings       = pool->timings.elts;
+    pool->engine.timings_len   = pool->timings.nelts;
+    pool->engine.quantiles     = pool->quantiles.elts;
+    pool->engine.quantiles_len = pool->quantiles.nelts;
+    pool->engine.http          = pool->http.elts;
+    pool->engine.http_len      = pool->http.nelts;
+    pool->engine.avg_window    = pool->avg_window;
+
+    ngx_http_sla_engine_init(&pool->engine);
+
     /* создание зоны shred memory */
-    size = (sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN / ngx_pagesize + 4) * ngx_pagesize;
+    size = sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN + sizeof(ngx_http_sla_stats_t);
+
+    if (pool->slow != 0) {
+        size += sizeof(ngx_http_sla_slow_ring_t) + sizeof(ngx_http_sla_slow_t) * (pool->slow - 1);
+    }
+
+    /* времена по группам статусов - только для пулов с status_timings */
+    if (pool->status_timings) {
+        size += sizeof(ngx_http_sla_timing_t) * 4 * NGX_HTTP_SLA_MAX_COUNTERS_LEN;
+    }
+
+    /* регистры HyperLogLog - только для пулов с clients */
+    if (pool->clients) {
+        size += (1 << NGX_HTTP_SLA_CLIENTS_BITS) * NGX_HTTP_SLA_MAX_COUNTERS_LEN;
+    }
+
+    size = (size / ngx_pagesize + 4) * ngx_pagesize;
 
     shm_zone = ngx_shared_memory_add(cf, &pool->name, size, &ngx_http_sla_module);
     if (shm_zone == NULL) {
@@ -715,814 +2044,4094 @@ static char* ngx_http_sla_alias (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
     return NGX_CONF_OK;
 }
 
-static char* ngx_http_sla_pass (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+static char* ngx_http_sla_alias_zone (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
-    ngx_str_t*                value;
-    ngx_http_sla_pool_t*      pool;
-    ngx_http_sla_main_conf_t* mconfig;
-    ngx_http_sla_loc_conf_t*  config = conf;
+    ngx_int_t                   limit;
+    size_t                      size;
+    ngx_str_t*                  value;
+    ngx_str_t                   name;
+    ngx_shm_zone_t*             shm_zone;
+    ngx_http_sla_alias_table_t* table;
+    ngx_http_sla_main_conf_t*   config = conf;
+
+    if (config->alias_table != NULL) {
+        return "is duplicate";
+    }
 
     value = cf->args->elts;
 
-    /* пул отключен */
-    if (value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
-        config->pool = NULL;
-        config->off  = 1;
-        return NGX_CONF_OK;
+    limit = ngx_atoi(value[1].data, value[1].len);
+    if (limit == NGX_ERROR || limit < 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid sla_alias_zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    /* поиск пула */
-    mconfig = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
-    pool    = ngx_http_sla_get_pool(&mconfig->pools, &value[1]);
+    table = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_alias_table_t));
+    if (table == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    if (pool == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pool \"%V\" not found", &value[1]);
+    /* ячеек вдвое больше лимита, чтобы цепочки открытой адресации оставались короткими */
+    table->limit = limit;
+    table->size  = 2 * limit;
+
+    size = ((sizeof(ngx_http_sla_alias_shm_t) * table->size + sizeof(ngx_uint_t) * 2) / ngx_pagesize + 4) * ngx_pagesize;
+
+    ngx_str_set(&name, "sla_alias");
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_sla_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_alias_zone is already allocated");
         return NGX_CONF_ERROR;
     }
 
-    config->pool = pool;
+    shm_zone->data = table;
+    shm_zone->init = ngx_http_sla_init_alias_zone;
+
+    config->alias_table = table;
 
     return NGX_CONF_OK;
 }
 
-static char* ngx_http_sla_status (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+static char* ngx_http_sla_alias_api (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
     ngx_http_core_loc_conf_t* config;
+    ngx_http_sla_main_conf_t* mconfig;
+
+    /* наличие sla_alias_zone проверяется в ngx_http_sla_init_main_conf */
+    mconfig = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
+    mconfig->alias_api = 1;
 
     config = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
 
-    config->handler = ngx_http_sla_status_handler;
+    config->handler = ngx_http_sla_alias_api_handler;
 
     return NGX_CONF_OK;
 }
 
-static char* ngx_http_sla_purge (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+static char* ngx_http_sla_pass (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
-    ngx_http_core_loc_conf_t* config;
-
-    config = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    ngx_http_sla_main_conf_t* mconfig;
 
-    config->handler = ngx_http_sla_purge_handler;
+    mconfig = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
 
-    return NGX_CONF_OK;
+    return ngx_http_sla_parse_pass(cf, conf, mconfig, 0);
 }
 
-static ngx_int_t ngx_http_sla_status_handler (ngx_http_request_t* r)
+static char* ngx_http_sla_parse_pass (ngx_conf_t* cf, ngx_http_sla_loc_conf_t* config, ngx_http_sla_main_conf_t* mconfig, ngx_uint_t stream)
 {
-    ngx_uint_t                i;
-    size_t                    size;
-    ngx_buf_t*                buf;
-    ngx_chain_t               out;
-    ngx_int_t                 result;
-    ngx_http_sla_pool_t*      pool;
-    ngx_http_sla_main_conf_t* config;
+    ngx_uint_t                       i;
+    ngx_uint_t                       j;
+    ngx_str_t*                       value;
+    ngx_http_sla_pool_t*             pool;
+    ngx_http_sla_pool_t**            pools;
+    ngx_http_compile_complex_value_t ccv;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla handler");
+    value = cf->args->elts;
 
-    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
-        return NGX_HTTP_NOT_ALLOWED;
+    config->filter = NULL;
+
+    /* пул отключен */
+    if (value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+        if (cf->args->nelts != 2) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pass off can't be combined with pools");
+            return NGX_CONF_ERROR;
+        }
+
+        config->pools = NULL;
+        config->off   = 1;
+        return NGX_CONF_OK;
     }
 
-    result = ngx_http_discard_request_body(r);
-    if (result != NGX_OK) {
-        return result;
+    config->pools = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_http_sla_pool_t*));
+    if (config->pools == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    /* поиск пулов, порядок записи (и захвата мьютексов) - порядок в конфигурации */
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
+            if (stream) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pass parameter \"if=\" is not supported in stream");
+                return NGX_CONF_ERROR;
+            }
 
-    if (r->method == NGX_HTTP_HEAD) {
-        r->headers_out.status = NGX_HTTP_OK;
+            if (config->filter != NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate sla_pass parameter \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
 
-        result = ngx_http_send_header(r);
+            value[i].len  -= 3;
+            value[i].data += 3;
 
-        if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
-            return result;
-        }
-    }
+            config->filter = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if (config->filter == NULL) {
+                return NGX_CONF_ERROR;
+            }
 
-    config = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
+            ccv.cf            = cf;
+            ccv.value         = &value[i];
+            ccv.complex_value = config->filter;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        pool = ngx_http_sla_get_pool(&mconfig->pools, &value[i]);
+
+        if (pool == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pool \"%V\" not found", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        pools = config->pools->elts;
+        for (j = 0; j < config->pools->nelts; j++) {
+            if (pools[j] == pool) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate sla_pool \"%V\" in sla_pass", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        pools = ngx_array_push(config->pools);
+        if (pools == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *pools = pool;
+    }
+
+    if (config->pools->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pass requires pool name");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_sla_merge_pass (ngx_conf_t* cf, ngx_http_sla_loc_conf_t* prev, ngx_http_sla_loc_conf_t* current, ngx_http_sla_main_conf_t* mconfig)
+{
+    ngx_http_sla_pool_t*  pool;
+    ngx_http_sla_pool_t** pools;
+
+    if (current->off != 0) {
+        return NGX_CONF_OK;
+    }
+
+    current->aliases = &mconfig->aliases;
+
+    if (current->pools != NULL) {
+        return NGX_CONF_OK;
+    }
+
+    current->pools  = prev->pools;
+    current->filter = prev->filter;
+
+    if (current->pools != NULL) {
+        return NGX_CONF_OK;
+    }
+
+    pool = ngx_http_sla_get_pool(&mconfig->pools, &mconfig->default_pool);
+    if (pool == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    current->pools = ngx_array_create(cf->pool, 1, sizeof(ngx_http_sla_pool_t*));
+    if (current->pools == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    pools = ngx_array_push(current->pools);
+    if (pools == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *pools = pool;
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_sla_export (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+#ifdef NGX_HTTP_SLA_EXPORT
+    ngx_uint_t                i;
+    ngx_str_t*                value;
+    ngx_str_t                 param;
+    ngx_url_t                 url;
+    ngx_int_t                 ival;
+    ssize_t                   size;
+    ngx_http_sla_export_t*    export;
+    ngx_http_sla_main_conf_t* config = conf;
+
+    if (config->export != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    export = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_export_t));
+    if (export == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    export->format   = NGX_HTTP_SLA_EXPORT_STATSD;
+    export->interval = 10000;
+    export->size     = 1024 * 1024;
+    export->pools    = &config->pools;
+
+    /* параметры */
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "format=", 7) == 0) {
+            if (value[i].len == 13 && ngx_strncmp(value[i].data + 7, "statsd", 6) == 0) {
+                export->format = NGX_HTTP_SLA_EXPORT_STATSD;
+            } else if (value[i].len == 15 && ngx_strncmp(value[i].data + 7, "graphite", 8) == 0) {
+                export->format = NGX_HTTP_SLA_EXPORT_GRAPHITE;
+            } else if (value[i].len == 13 && ngx_strncmp(value[i].data + 7, "zabbix", 6) == 0) {
+                export->format = NGX_HTTP_SLA_EXPORT_ZABBIX;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect format value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            param.data = value[i].data + 9;
+            param.len  = value[i].len - 9;
+
+            ival = ngx_parse_time(&param, 0);
+            if (ival == NGX_ERROR || ival < 1000) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            export->interval = ival;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+            param.data = value[i].data + 7;
+            param.len  = value[i].len - 7;
+
+            size = ngx_parse_size(&param);
+            if (size == NGX_ERROR || size < 4096) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect buffer value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            export->size = size;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "prefix=", 7) == 0) {
+            export->prefix.data = value[i].data + 7;
+            export->prefix.len  = value[i].len - 7;
+
+            if (export->prefix.len >= NGX_HTTP_SLA_MAX_NAME_LEN) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "prefix too long \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "host=", 5) == 0) {
+            export->host.data = value[i].data + 5;
+            export->host.len  = value[i].len - 5;
+
+            if (export->host.len < 1 || export->host.len >= NGX_HTTP_SLA_MAX_NAME_LEN) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect host value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\" for sla_export", &value[i]);
+
+        return NGX_CONF_ERROR;
+    }
+
+    /* адрес получателя */
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    if (ngx_strncmp(value[1].data, "udp://", 6) == 0) {
+        export->type = SOCK_DGRAM;
+    } else if (ngx_strncmp(value[1].data, "tcp://", 6) == 0) {
+        export->type = SOCK_STREAM;
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_export address \"%V\" must start with udp:// or tcp://", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    url.url.data = value[1].data + 6;
+    url.url.len  = value[1].len - 6;
+
+    switch (export->format) {
+        case NGX_HTTP_SLA_EXPORT_GRAPHITE:
+            url.default_port = 2003;
+            break;
+        case NGX_HTTP_SLA_EXPORT_ZABBIX:
+            url.default_port = 10051;
+            break;
+        default:
+            url.default_port = 8125;
+    }
+
+    if (ngx_parse_url(cf->pool, &url) != NGX_OK) {
+        if (url.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in sla_export \"%V\"", url.err, &value[1]);
+        }
+        return NGX_CONF_ERROR;
+    }
+
+    if (url.naddrs == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no address in sla_export \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    export->addr = &url.addrs[0];
+
+    if (export->format == NGX_HTTP_SLA_EXPORT_ZABBIX) {
+        if (export->type != SOCK_STREAM) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zabbix sender protocol requires tcp:// address");
+            return NGX_CONF_ERROR;
+        }
+
+        if (export->host.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zabbix sender protocol requires host= parameter");
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    config->export = export;
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_export requires nginx 1.12.0 or newer");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+static char* ngx_http_sla_status (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    ngx_uint_t                i;
+    ngx_int_t                 ival;
+    ngx_str_t*                value;
+    ngx_str_t                 param;
+    ngx_str_t                 name;
+    ngx_shm_zone_t*           shm_zone;
+    ngx_http_core_loc_conf_t* config;
+    ngx_http_sla_main_conf_t* mconfig;
+    ngx_http_sla_loc_conf_t*  lconfig = conf;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (value[i].len == 8 && ngx_strncmp(value[i].data, "reset=on", 8) == 0) {
+            lconfig->reset = 1;
+            continue;
+        }
+
+        if (value[i].len == 9 && ngx_strncmp(value[i].data, "reset=off", 9) == 0) {
+            lconfig->reset = 0;
+            continue;
+        }
+
+        if (value[i].len == 11 && ngx_strncmp(value[i].data, "format=text", 11) == 0) {
+            lconfig->binary = 0;
+            lconfig->slow   = 0;
+            continue;
+        }
+
+        if (value[i].len == 13 && ngx_strncmp(value[i].data, "format=binary", 13) == 0) {
+            lconfig->binary = 1;
+            lconfig->slow   = 0;
+            continue;
+        }
+
+        if (value[i].len == 11 && ngx_strncmp(value[i].data, "format=slow", 11) == 0) {
+            lconfig->binary = 0;
+            lconfig->slow   = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "cache=", 6) == 0) {
+            param.data = value[i].data + 6;
+            param.len  = value[i].len - 6;
+
+            ival = ngx_parse_time(&param, 0);
+            if (ival == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect cache value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            lconfig->cache = ival;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\" for sla_status", &value[i]);
+
+        return NGX_CONF_ERROR;
+    }
+
+    /* общий результат вывода - одна зона на все location */
+    if (lconfig->cache != 0) {
+        if (lconfig->reset) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_status cache= can not be used with reset=on");
+            return NGX_CONF_ERROR;
+        }
+
+        mconfig = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
+
+        if (mconfig->render_cache == NULL) {
+            mconfig->render_cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_render_cache_t));
+            if (mconfig->render_cache == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_str_set(&name, "sla_status");
+
+            shm_zone = ngx_shared_memory_add(cf, &name, NGX_HTTP_SLA_RENDER_CACHE_SIZE, &ngx_http_sla_module);
+            if (shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            shm_zone->data = mconfig->render_cache;
+            shm_zone->init = ngx_http_sla_init_render_zone;
+        }
+
+        lconfig->slot = mconfig->render_cache->n++;
+    }
+
+    config = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    config->handler = ngx_http_sla_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_sla_value (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    ngx_http_core_loc_conf_t* config;
+
+    config = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    config->handler = ngx_http_sla_value_handler;
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_sla_purge (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    ngx_http_core_loc_conf_t* config;
+
+    config = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    config->handler = ngx_http_sla_purge_handler;
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_sla_balance (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    ngx_uint_t                    i;
+    ngx_int_t                     ival;
+    ngx_str_t*                    value;
+    ngx_http_upstream_srv_conf_t* uscf;
+    ngx_http_sla_balance_conf_t*  config = conf;
+
+    if (config->name.data != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "pool=", 5) == 0 && value[i].len > 5) {
+            config->name.data = &value[i].data[5];
+            config->name.len  = value[i].len - 5;
+            continue;
+        }
+
+        if (value[i].len == 10 && ngx_strncmp(value[i].data, "metric=avg", 10) == 0) {
+            config->quantile = 0;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "metric=p", 8) == 0) {
+            ival = ngx_atoi(&value[i].data[8], value[i].len - 8);
+            if (ival == NGX_ERROR || ival < 1 || ival > 99) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect metric value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            config->quantile = ival;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\" for sla_balance", &value[i]);
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (config->name.data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_balance requires pool parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_sla_balance_init;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                | NGX_HTTP_UPSTREAM_WEIGHT
+#if nginx_version >= 1011005
+                | NGX_HTTP_UPSTREAM_MAX_CONNS
+#endif
+                | NGX_HTTP_UPSTREAM_MAX_FAILS
+                | NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                | NGX_HTTP_UPSTREAM_DOWN
+                | NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_sla_shed (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    ngx_uint_t                i;
+    ngx_uint_t                quantile;
+    ngx_int_t                 ival;
+    ngx_str_t*                value;
+    ngx_str_t                 param;
+    ngx_uint_t*               pval;
+    ngx_http_sla_shed_t*      shed;
+    ngx_http_sla_main_conf_t* mconfig;
+    ngx_http_sla_loc_conf_t*  lconfig = conf;
+
+    if (lconfig->shed_set) {
+        return "is duplicate";
+    }
+
+    lconfig->shed_set = 1;
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+        lconfig->shed = NULL;
+        return NGX_CONF_OK;
+    }
+
+    shed = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_shed_t));
+    if (shed == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mconfig  = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
+    quantile = 99;
+
+    shed->share  = 50;
+    shed->status = NGX_HTTP_SERVICE_UNAVAILABLE;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        /* пулы должны быть описаны до sla_shed, как и для sla_pass */
+        if (ngx_strncmp(value[i].data, "pool=", 5) == 0 && value[i].len > 5) {
+            param.data = &value[i].data[5];
+            param.len  = value[i].len - 5;
+
+            shed->pool = ngx_http_sla_get_pool(&mconfig->pools, &param);
+            if (shed->pool == NULL || shed->pool->stream) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pool \"%V\" not found", &param);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (value[i].len == 10 && ngx_strncmp(value[i].data, "metric=avg", 10) == 0) {
+            quantile = 0;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "metric=p", 8) == 0) {
+            ival = ngx_atoi(&value[i].data[8], value[i].len - 8);
+            if (ival == NGX_ERROR || ival < 1 || ival > 99) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect metric value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            quantile = ival;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "target=", 7) == 0) {
+            param.data = value[i].data + 7;
+            param.len  = value[i].len - 7;
+
+            ival = ngx_parse_time(&param, 0);
+            if (ival == NGX_ERROR || ival < 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect target value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            shed->target = ival;
+            continue;
+        }
+
+        /* при 100% ответы апстримов перестают поступать и метрика пула не сможет снизиться */
+        if (ngx_strncmp(value[i].data, "share=", 6) == 0) {
+            param.data = value[i].data + 6;
+            param.len  = value[i].len - 6;
+
+            if (param.len > 0 && param.data[param.len - 1] == '%') {
+                param.len--;
+            }
+
+            ival = ngx_atoi(param.data, param.len);
+            if (ival == NGX_ERROR || ival < 1 || ival > 99) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect share value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            shed->share = ival;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+            ival = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (ival == NGX_ERROR || ival < 400 || ival > 599) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect status value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            shed->status = ival;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\" for sla_shed", &value[i]);
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (shed->pool == NULL || shed->target == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_shed requires pool and target parameters");
+        return NGX_CONF_ERROR;
+    }
+
+    shed->index = -1;
+
+    if (quantile != 0) {
+        pval = shed->pool->quantiles.elts;
+        for (i = 0; i < shed->pool->quantiles.nelts; i++) {
+            if (pval[i] == quantile) {
+                shed->index = i;
+                break;
+            }
+        }
+
+        if (shed->index < 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pool \"%V\" has no %ui%% quantile", &shed->pool->name, quantile);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    lconfig->shed = shed;
+    mconfig->shed = 1;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_http_sla_variable (ngx_http_request_t* r, ngx_http_variable_value_t* v, uintptr_t data)
+{
+    u_char*                        p;
+    ngx_http_sla_rates_t           rates;
+    ngx_http_sla_pool_t*           pool;
+    ngx_http_sla_pool_t**          pools;
+    ngx_http_sla_loc_conf_t*       config;
+    ngx_http_sla_main_conf_t*      mconf;
+    const ngx_http_sla_pool_shm_t* counter;
+
+    config = ngx_http_get_module_loc_conf(r, ngx_http_sla_module);
+
+    if (config->pools == NULL || config->pools->nelts == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    pools = config->pools->elts;
+    pool  = pools[0];
+
+    if (pool->shm_ctx == NULL) {
+        mconf = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+        pool  = ngx_http_sla_get_pool(&mconf->pools, &pool->name);
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* значения счетчика all читаются без мьютекса, как и для sla_balance: в худшем случае - неточные */
+    counter = pool->shm_ctx;
+
+    switch (data) {
+        case NGX_HTTP_SLA_VARIABLE_P99:
+            v->len = ngx_sprintf(p, "%uA", (ngx_uint_t)counter->timing.quantiles[pool->p99_index]) - p;
+            break;
+
+        case NGX_HTTP_SLA_VARIABLE_AVG_MOV:
+            v->len = ngx_sprintf(p, "%uA", (ngx_uint_t)counter->timing.time_avg_mov) - p;
+            break;
+
+        default:
+            /* скорости - на текущий момент, как в sla_status, без изменения данных в shm */
+            rates = counter->rates;
+            ngx_http_sla_tick_rates(&rates, ngx_current_msec);
+
+            v->len = ngx_sprintf(p, "%.2f", rates.rps[0] > 0 ? rates.eps[0] * 100 / rates.rps[0] : (double)0) - p;
+            break;
+    }
+
+    v->valid        = 1;
+    v->no_cacheable = 1;
+    v->not_found    = 0;
+    v->data         = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_sla_shed_handler (ngx_http_request_t* r)
+{
+    double                    metric;
+    ngx_pool_cleanup_t*       cln;
+    ngx_http_sla_shed_t*      shed;
+    ngx_http_sla_loc_conf_t*  config;
+    ngx_http_sla_main_conf_t* mconf;
+
+    /* решение принимается один раз для основного запроса */
+    if (r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    config = ngx_http_get_module_loc_conf(r, ngx_http_sla_module);
+    shed   = config->shed;
+
+    if (shed == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (shed->pool->shm_ctx == NULL) {
+        mconf      = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+        shed->pool = ngx_http_sla_get_pool(&mconf->pools, &shed->pool->name);
+    }
+
+    /* метрика читается без мьютекса, как и для sla_balance */
+    metric = shed->index < 0 ? shed->pool->shm_ctx->timing.time_avg_mov : shed->pool->shm_ctx->timing.quantiles[shed->index];
+
+    if (metric <= (double)shed->target || (ngx_uint_t)(ngx_random() % 100) >= shed->share) {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_sla_shed_cleanup;
+    cln->data    = NULL;
+
+    if (shed->pool->stats) {
+        shed->pool->stats_local->shed++;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "sla_shed: pool \"%V\" metric %uA exceeds target %uA",
+                  &shed->pool->name, (ngx_uint_t)metric, shed->target);
+
+    return shed->status;
+}
+
+static void ngx_http_sla_shed_cleanup (void* data)
+{
+    /* только метка */
+}
+
+static ngx_uint_t ngx_http_sla_is_shed (ngx_http_request_t* r)
+{
+    ngx_pool_cleanup_t* cln;
+
+    for (cln = r->main->pool->cleanup; cln != NULL; cln = cln->next) {
+        if (cln->handler == ngx_http_sla_shed_cleanup) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static ngx_int_t ngx_http_sla_status_handler (ngx_http_request_t* r)
+{
+    ngx_uint_t                i;
+    ngx_uint_t                n;
+    ngx_uint_t                dumped;
+    ngx_uint_t                start;
+    ngx_uint_t*               cursor;
+    size_t                    size;
+    u_char*                   last;
+    ngx_str_t                 since;
+    ngx_str_t                 select_pool;
+    ngx_str_t                 select_counter;
+    ngx_buf_t*                buf;
+    ngx_chain_t               out;
+    ngx_int_t                 result;
+    ngx_uint_t                cached;
+    ngx_http_sla_pool_t*      pool;
+    ngx_http_sla_pool_t**     pools;
+    ngx_http_sla_loc_conf_t*  lconfig;
+    ngx_http_sla_main_conf_t* mconfig;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla handler");
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    result = ngx_http_discard_request_body(r);
+    if (result != NGX_OK) {
+        return result;
+    }
+
+    lconfig = ngx_http_get_module_loc_conf(r, ngx_http_sla_module);
+
+    if (lconfig->binary) {
+        ngx_str_set(&r->headers_out.content_type, "application/octet-stream");
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+    }
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        result = ngx_http_send_header(r);
+
+        if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+            return result;
+        }
+    }
+
+    pools = ngx_http_sla_get_all_pools(r, &n);
+    if (pools == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_sla_get_selector(r, &select_pool, &select_counter) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* курсор для выдачи только изменившихся счетчиков */
+    cursor = NULL;
+
+    if (ngx_http_arg(r, (u_char*)"since", 5, &since) == NGX_OK) {
+        /* двоичный вывод предназначен для суммирования, выборка изменений в нем не имеет смысла */
+        if (lconfig->binary || lconfig->slow) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        cursor = ngx_pcalloc(r->pool, sizeof(ngx_uint_t) * ngx_max(n, 1));
+        if (cursor == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (ngx_http_sla_parse_cursor(&since, cursor, n) != NGX_OK) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    /* общий для всех рабочих процессов результат - только для полного вывода */
+    cached  = lconfig->cache != 0 && cursor == NULL && select_pool.len == 0 && select_counter.len == 0;
+    mconfig = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+
+    if (cached) {
+        result = ngx_http_sla_get_render(mconfig->render_cache, lconfig, r, &buf);
+        if (result == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (result == NGX_OK) {
+            out.buf  = buf;
+            out.next = NULL;
+
+            r->headers_out.status           = NGX_HTTP_OK;
+            r->headers_out.content_length_n = buf->last - buf->pos;
+
+            buf->last_buf = (r == r->main) ? 1 : 0;
+
+            result = ngx_http_send_header(r);
+            if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+                return result;
+            }
+
+            return ngx_http_output_filter(r, &out);
+        }
+    }
+
+    size =
+        ngx_http_sla_counter_size() * NGX_HTTP_SLA_MAX_COUNTERS_LEN * n +
+        (sizeof("sla..render.bytes = ") + NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * 11 * n +
+        sizeof("sla.cursor = ") + (NGX_ATOMIC_T_LEN + 1) * n + 1;
+
+    /* медленные запросы: "пул.slow.N = время статус апстрим запрос peer id uri" */
+    if (lconfig->slow) {
+        size = 1;
+
+        for (i = 0; i < n; i++) {
+            size += (NGX_HTTP_SLA_MAX_NAME_LEN + sizeof(".slow. = . \n") + NGX_ATOMIC_T_LEN * 6 +
+                     NGX_HTTP_SLA_MAX_PEER_LEN + NGX_HTTP_SLA_REQUEST_ID_LEN + NGX_HTTP_SLA_SLOW_URI_LEN + 6) * pools[i]->slow;
+        }
+    }
+
+    if (lconfig->binary) {
+        size = 8 +
+            (
+                2 + NGX_HTTP_SLA_MAX_NAME_LEN +
+                2 + 4 * NGX_HTTP_SLA_MAX_TIMINGS_LEN +
+                2 + 4 * NGX_HTTP_SLA_MAX_HTTP_LEN +
+                2 + 2 * NGX_HTTP_SLA_MAX_QUANTILES_LEN +
+                2 + (2 + NGX_HTTP_SLA_MAX_NAME_LEN + 8 * (NGX_HTTP_SLA_MAX_HTTP_LEN + 6 + NGX_HTTP_SLA_MAX_TIMINGS_LEN + 2)) * NGX_HTTP_SLA_MAX_COUNTERS_LEN
+            ) * n;
+    }
+
+    buf = ngx_create_temp_buf(r->pool, size);
+    if (buf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf  = buf;
+    out.next = NULL;
+
+    /* заголовок двоичного формата, количество пулов - после вывода */
+    dumped = 0;
+
+    if (lconfig->binary) {
+        buf->last = ngx_cpymem(buf->last, NGX_HTTP_SLA_BINARY_MAGIC, 4);
+        buf->last = ngx_http_sla_binary_put16(buf->last, NGX_HTTP_SLA_BINARY_VERSION);
+        buf->last = ngx_http_sla_binary_put16(buf->last, 0);
+    }
+
+    /* формирование результата */
+    for (i = 0; i < n; i++) {
+        pool = pools[i];
+
+        if (pool->shm_ctx != NULL && ngx_http_sla_match(&select_pool, pool->name.data, pool->name.len)) {
+            start = pool->stats ? ngx_http_sla_usec() : 0;
+            last  = buf->last;
+
+            ngx_http_sla_lock(pool);
+
+            if (pool->generation == pool->shm_ctx->generation) {
+                ngx_http_sla_flush_stats(pool, 1);
+
+                if (lconfig->binary) {
+                    ngx_http_sla_dump_pool(buf, pool, &select_counter);
+                    dumped++;
+                } else if (lconfig->slow) {
+                    ngx_http_sla_print_slow(buf, pool);
+                } else {
+                    ngx_http_sla_print_pool(buf, pool, cursor != NULL ? cursor[i] : 0, &select_counter);
+                }
+
+                /* вывод и обнуление под одним захватом мьютекса - ни один запрос не теряется */
+                if (lconfig->reset && lconfig->slow) {
+                    if (pool->shm_slow != NULL) {
+                        pool->shm_slow->head = 0;
+                    }
+                } else if (lconfig->reset) {
+                    ngx_http_sla_reset_pool(pool, &select_counter);
+                }
+
+                if (cursor != NULL) {
+                    cursor[i] = pool->shm_ctx->sequence;
+                }
+            }
+
+            ngx_http_sla_unlock(pool);
+
+            if (pool->stats) {
+                pool->stats_local->render_count++;
+                pool->stats_local->render_bytes += buf->last - last;
+                pool->stats_local->render_time  += ngx_http_sla_usec_since(start);
+            }
+        }
+    }
+
+    if (lconfig->binary) {
+        ngx_http_sla_binary_put16(buf->pos + 6, (uint16_t)dumped);
+    }
+
+    if (cached) {
+        ngx_http_sla_set_render(mconfig->render_cache, lconfig, buf);
+    }
+
+    /* новый курсор */
+    if (cursor != NULL) {
+        buf->last = ngx_sprintf(buf->last, "sla.cursor = ");
+
+        for (i = 0; i < n; i++) {
+            buf->last = ngx_sprintf(buf->last, i == 0 ? "%uA" : "-%uA", cursor[i]);
+        }
+
+        *buf->last++ = LF;
+    }
+
+    /* отправка результата */
+    r->headers_out.status           = NGX_HTTP_OK;
+    r->headers_out.content_length_n = buf->last - buf->pos;
+
+    buf->last_buf = (r == r->main) ? 1 : 0;
+
+    result = ngx_http_send_header(r);
+    if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+        return result;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t ngx_http_sla_value_handler (ngx_http_request_t* r)
+{
+    ngx_uint_t                i;
+    ngx_uint_t                n;
+    size_t                    len;
+    u_char*                   p;
+    u_char*                   end;
+    ngx_buf_t*                buf;
+    ngx_chain_t               out;
+    ngx_int_t                 result;
+    ngx_str_t                 key;
+    ngx_str_t                 rest;
+    ngx_http_sla_pool_t*      pool;
+    ngx_http_sla_pool_t**     pools;
+    ngx_http_sla_pool_shm_t*  counter;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla_value handler");
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    result = ngx_http_discard_request_body(r);
+    if (result != NGX_OK) {
+        return result;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        result = ngx_http_send_header(r);
+
+        if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+            return result;
+        }
+    }
+
+    /* ключ в формате sla_status: пул.счетчик.значение, например, main.backend1.99% */
+    if (ngx_http_sla_get_arg(r, "key", &key) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (key.len == 0) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    pools = ngx_http_sla_get_all_pools(r, &n);
+    if (pools == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* имена пулов и счетчиков могут содержать точки - выбирается самое длинное совпадение */
+    pool = NULL;
+
+    for (i = 0; i < n; i++) {
+        len = pools[i]->name.len;
+
+        if (pools[i]->shm_ctx != NULL && key.len > len + 1 && key.data[len] == '.' && ngx_strncmp(key.data, pools[i]->name.data, len) == 0
+            && (pool == NULL || len > pool->name.len))
+        {
+            pool = pools[i];
+        }
+    }
+
+    if (pool == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    rest.data = key.data + pool->name.len + 1;
+    rest.len  = key.len - pool->name.len - 1;
+
+    buf = ngx_create_temp_buf(r->pool, ngx_http_sla_counter_size());
+    if (buf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* выводится только найденный счетчик */
+    ngx_http_sla_lock(pool);
+
+    counter = NULL;
+
+    if (pool->generation == pool->shm_ctx->generation) {
+        for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+            len = pool->shm_ctx[i].name_len;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (rest.len > len + 1 && rest.data[len] == '.' && ngx_strncmp(rest.data, pool->shm_ctx[i].name, len) == 0
+                && (counter == NULL || len > counter->name_len))
+            {
+                counter = &pool->shm_ctx[i];
+            }
+        }
+
+        if (counter != NULL) {
+            ngx_http_sla_print_counter(buf, pool, counter);
+        }
+    }
+
+    ngx_http_sla_unlock(pool);
+
+    /* поиск строки "ключ = значение" */
+    p   = buf->pos;
+    end = NULL;
+
+    while (p < buf->last) {
+        end = ngx_strlchr(p, buf->last, LF);
+        if (end == NULL) {
+            end = buf->last;
+        }
+
+        if ((size_t)(end - p) > key.len + 3 && ngx_strncmp(p, key.data, key.len) == 0 && ngx_strncmp(p + key.len, " = ", 3) == 0) {
+            break;
+        }
+
+        p   = end + 1;
+        end = NULL;
+    }
+
+    if (end == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    /* только значение, без перевода строки */
+    buf->pos  = p + key.len + 3;
+    buf->last = end;
+
+    out.buf  = buf;
+    out.next = NULL;
+
+    r->headers_out.status           = NGX_HTTP_OK;
+    r->headers_out.content_length_n = buf->last - buf->pos;
+
+    buf->last_buf = (r == r->main) ? 1 : 0;
+
+    result = ngx_http_send_header(r);
+    if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+        return result;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t ngx_http_sla_get_render (ngx_http_sla_render_cache_t* cache, const ngx_http_sla_loc_conf_t* config, ngx_http_request_t* r, ngx_buf_t** buf)
+{
+    ngx_msec_t             now;
+    ngx_http_sla_render_t* render;
+
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&cache->shm_pool->mutex);
+
+    /* процесс старой конфигурации: его массив освобожден при перезагрузке, результат формируется без кэша */
+    if (cache->generation != *cache->shm_generation) {
+        ngx_shmtx_unlock(&cache->shm_pool->mutex);
+        return NGX_DECLINED;
+    }
+
+    render = &cache->renders[config->slot];
+
+    /* свежий результат или устаревший, пока новый формирует другой процесс */
+    if (render->body != NULL && ((ngx_msec_int_t)(render->expires - now) > 0 || (ngx_msec_int_t)(render->updating - now) > 0)) {
+        *buf = ngx_create_temp_buf(r->pool, ngx_max(render->len, 1));
+        if (*buf == NULL) {
+            ngx_shmtx_unlock(&cache->shm_pool->mutex);
+            return NGX_ERROR;
+        }
+
+        (*buf)->last = ngx_cpymem((*buf)->pos, render->body, render->len);
+
+        ngx_shmtx_unlock(&cache->shm_pool->mutex);
+
+        return NGX_OK;
+    }
+
+    /* результат формирует этот процесс, остальные в это время отдают старый */
+    render->updating = now + config->cache;
+
+    ngx_shmtx_unlock(&cache->shm_pool->mutex);
+
+    return NGX_DECLINED;
+}
+
+static void ngx_http_sla_set_render (ngx_http_sla_render_cache_t* cache, const ngx_http_sla_loc_conf_t* config, const ngx_buf_t* buf)
+{
+    size_t                 len;
+    u_char*                body;
+    ngx_http_sla_render_t* render;
+
+    len = buf->last - buf->pos;
+
+    ngx_shmtx_lock(&cache->shm_pool->mutex);
+
+    if (cache->generation != *cache->shm_generation) {
+        ngx_shmtx_unlock(&cache->shm_pool->mutex);
+        return;
+    }
+
+    render = &cache->renders[config->slot];
+
+    if (render->body != NULL) {
+        ngx_slab_free_locked(cache->shm_pool, render->body);
+        render->body = NULL;
+    }
+
+    /* при нехватке памяти результат не сохраняется и формируется каждым запросом */
+    body = ngx_slab_alloc_locked(cache->shm_pool, ngx_max(len, 1));
+    if (body != NULL) {
+        ngx_memcpy(body, buf->pos, len);
+
+        render->body    = body;
+        render->len     = len;
+        render->expires = ngx_current_msec + config->cache;
+    }
+
+    render->updating = ngx_current_msec;
+
+    ngx_shmtx_unlock(&cache->shm_pool->mutex);
+}
+
+static ngx_int_t ngx_http_sla_purge_handler (ngx_http_request_t* r)
+{
+    ngx_uint_t                i;
+    ngx_uint_t                n;
+    ngx_uint_t                sequence;
+    size_t                    size;
+    ngx_buf_t*                buf;
+    ngx_chain_t               out;
+    ngx_int_t                 result;
+    ngx_str_t                 name;
+    ngx_str_t                 select_pool;
+    ngx_str_t                 select_counter;
+    ngx_http_sla_pool_t*      pool;
+    ngx_http_sla_pool_t**     pools;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla_purge handler");
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    result = ngx_http_discard_request_body(r);
+    if (result != NGX_OK) {
+        return result;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        result = ngx_http_send_header(r);
+
+        if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+            return result;
+        }
+    }
+
+    /* OK */
+    size = 4 * sizeof(u_char);
+
+    buf = ngx_create_temp_buf(r->pool, size);
+    if (buf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf  = buf;
+    out.next = NULL;
+
+    buf->last = ngx_sprintf(buf->last, "OK\n");
+
+    pools = ngx_http_sla_get_all_pools(r, &n);
+    if (pools == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_sla_get_selector(r, &select_pool, &select_counter) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* сброс данных */
+    ngx_str_set(&name, "all");
+
+    for (i = 0; i < n; i++) {
+        pool = pools[i];
+
+        if (pool->shm_ctx != NULL && ngx_http_sla_match(&select_pool, pool->name.data, pool->name.len)) {
+            ngx_http_sla_lock(pool);
+
+            if (pool->generation == pool->shm_ctx->generation && select_counter.len != 0) {
+                /* обнуление отдельного счетчика */
+                ngx_http_sla_reset_pool(pool, &select_counter);
+            } else if (pool->generation == pool->shm_ctx->generation) {
+                sequence = pool->shm_ctx->sequence;
+
+                ngx_memzero(pool->shm_ctx, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
+                pool->shm_ctx->generation = pool->generation;
+
+                if (pool->shm_timing_xxx != NULL) {
+                    ngx_memzero(pool->shm_timing_xxx, sizeof(ngx_http_sla_timing_t) * 4 * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
+                }
+
+                if (pool->shm_clients != NULL) {
+                    ngx_memzero(pool->shm_clients, (1 << NGX_HTTP_SLA_CLIENTS_BITS) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
+                }
+
+                pool->shm_ctx->sequence   = sequence;
+                ngx_http_sla_add_counter(pool, &name, 0);
+                ngx_http_sla_touch_counter(pool, pool->shm_ctx);
+
+                ngx_memzero(pool->shm_stats, sizeof(ngx_http_sla_stats_t));
+                ngx_memzero(pool->stats_local, sizeof(ngx_http_sla_stats_t));
+
+                if (pool->shm_slow != NULL) {
+                    pool->shm_slow->head = 0;
+                }
+            }
+
+            ngx_http_sla_unlock(pool);
+        }
+    }
+
+    /* отправка результата */
+    r->headers_out.status           = NGX_HTTP_OK;
+    r->headers_out.content_length_n = buf->last - buf->pos;
+
+    buf->last_buf = (r == r->main) ? 1 : 0;
+
+    result = ngx_http_send_header(r);
+    if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+        return result;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t ngx_http_sla_alias_api_handler (ngx_http_request_t* r)
+{
+    ngx_uint_t                  i;
+    size_t                      size;
+    ngx_buf_t*                  buf;
+    ngx_chain_t                 out;
+    ngx_int_t                   result;
+    ngx_str_t                   name;
+    ngx_str_t                   alias;
+    ngx_str_t                   remove;
+    ngx_http_sla_alias_shm_t*   entry;
+    ngx_http_sla_alias_table_t* table;
+    ngx_http_sla_main_conf_t*   config;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla_alias_api handler");
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    result = ngx_http_discard_request_body(r);
+    if (result != NGX_OK) {
+        return result;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        result = ngx_http_send_header(r);
+
+        if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+            return result;
+        }
+    }
+
+    config = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+    table  = config->alias_table;
+
+    if (ngx_http_sla_get_arg(r, "name", &name) != NGX_OK
+        || ngx_http_sla_get_arg(r, "alias", &alias) != NGX_OK
+        || ngx_http_sla_get_arg(r, "remove", &remove) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* удаление алиаса: дальше используется алиас из sla_alias или имя апстрима */
+    if (remove.len != 0) {
+        if (ngx_http_sla_set_runtime_alias(table, &remove, NULL) != NGX_OK) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0, "sla_alias_api: removed alias for \"%V\"", &remove);
+    }
+
+    /* добавление или изменение алиаса */
+    if (name.len != 0) {
+        if (name.len > NGX_HTTP_SLA_MAX_PEER_LEN || alias.len < 1 || alias.len >= NGX_HTTP_SLA_MAX_NAME_LEN - 1) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        if (ngx_http_sla_set_runtime_alias(table, &name, &alias) != NGX_OK) {
+            return NGX_HTTP_INSUFFICIENT_STORAGE;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0, "sla_alias_api: alias for \"%V\" set to \"%V\"", &name, &alias);
+    }
+
+    /* без аргументов - список алиасов, заданных через sla_alias_api */
+    ngx_shmtx_lock(&table->shm_pool->mutex);
+
+    size = 4 * sizeof(u_char);
+
+    if (remove.len == 0 && name.len == 0) {
+        size += (sizeof(" = \n") + NGX_HTTP_SLA_MAX_PEER_LEN + NGX_HTTP_SLA_MAX_NAME_LEN) * (*table->count);
+    }
+
+    buf = ngx_create_temp_buf(r->pool, size);
+    if (buf == NULL) {
+        ngx_shmtx_unlock(&table->shm_pool->mutex);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf  = buf;
+    out.next = NULL;
+
+    if (remove.len == 0 && name.len == 0) {
+        entry = table->entries;
+        for (i = 0; i < table->size; i++) {
+            if (entry[i].state == NGX_HTTP_SLA_ALIAS_USED) {
+                buf->last = ngx_sprintf(buf->last, "%*s = %*s\n", entry[i].name_len, entry[i].name, entry[i].alias_len, entry[i].alias);
+            }
+        }
+    } else {
+        buf->last = ngx_sprintf(buf->last, "OK\n");
+    }
+
+    ngx_shmtx_unlock(&table->shm_pool->mutex);
+
+    /* отправка результата */
+    r->headers_out.status           = NGX_HTTP_OK;
+    r->headers_out.content_length_n = buf->last - buf->pos;
+
+    if (buf->last == buf->pos) {
+        r->header_only = 1;
+    }
+
+    buf->last_buf = (r == r->main) ? 1 : 0;
+
+    result = ngx_http_send_header(r);
+    if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
+        return result;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static ngx_http_sla_pool_t** ngx_http_sla_get_all_pools (ngx_http_request_t* r, ngx_uint_t* n)
+{
+    ngx_uint_t                i;
+    ngx_uint_t                count;
+    ngx_http_sla_pool_t*      pool;
+    ngx_http_sla_pool_t**     result;
+    ngx_http_sla_main_conf_t* config;
+    ngx_http_sla_main_conf_t* sconfig;
+
+    config  = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+    sconfig = NULL;
+
+#ifdef NGX_STREAM_SLA
+    sconfig = ngx_stream_cycle_get_module_main_conf(ngx_cycle, ngx_stream_sla_module);
+#endif
+
+    count = config->pools.nelts + (sconfig != NULL ? sconfig->pools.nelts : 0);
+
+    result = ngx_palloc(r->pool, sizeof(ngx_http_sla_pool_t*) * ngx_max(count, 1));
+    if (result == NULL) {
+        return NULL;
+    }
+
+    *n = 0;
+
+    pool = config->pools.elts;
+    for (i = 0; i < config->pools.nelts; i++) {
+        result[(*n)++] = &pool[i];
+    }
+
+    if (sconfig != NULL) {
+        pool = sconfig->pools.elts;
+        for (i = 0; i < sconfig->pools.nelts; i++) {
+            result[(*n)++] = &pool[i];
+        }
+    }
+
+    return result;
+}
+
+static ngx_int_t ngx_http_sla_get_selector (ngx_http_request_t* r, ngx_str_t* pool, ngx_str_t* counter)
+{
+    if (ngx_http_sla_get_arg(r, "pool", pool) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_sla_get_arg(r, "counter", counter);
+}
+
+static ngx_int_t ngx_http_sla_get_arg (ngx_http_request_t* r, const char* name, ngx_str_t* value)
+{
+    u_char*   dst;
+    u_char*   src;
+    ngx_str_t arg;
+
+    if (ngx_http_arg(r, (u_char*)name, ngx_strlen(name), &arg) != NGX_OK || arg.len == 0) {
+        ngx_str_null(value);
+        return NGX_OK;
+    }
+
+    /* имена апстримов вида "host:port" могут прийти в виде "host%3Aport" */
+    value->data = ngx_pnalloc(r->pool, arg.len);
+    if (value->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst = value->data;
+    src = arg.data;
+
+    ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+static ngx_uint_t ngx_http_sla_match (const ngx_str_t* selector, const u_char* name, size_t len)
+{
+    if (selector->len == 0) {
+        return 1;
+    }
+
+    return selector->len == len && ngx_strncmp(selector->data, name, len) == 0;
+}
+
+static void ngx_http_sla_reset_counter (ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter)
+{
+    ngx_uint_t generation;
+    ngx_uint_t sequence;
+
+    /* поколение и номер изменений пула хранятся в первом счетчике */
+    generation = counter->generation;
+    sequence   = counter->sequence;
+
+    ngx_memzero((u_char*)counter + offsetof(ngx_http_sla_pool_shm_t, http), sizeof(ngx_http_sla_pool_shm_t) - offsetof(ngx_http_sla_pool_shm_t, http));
+
+    counter->generation = generation;
+    counter->sequence   = sequence;
+
+    if (pool->shm_timing_xxx != NULL) {
+        ngx_memzero(ngx_http_sla_get_timing_xxx(pool, counter), sizeof(ngx_http_sla_timing_t) * 4);
+    }
+
+    if (pool->shm_clients != NULL) {
+        ngx_memzero(ngx_http_sla_get_clients(pool, counter), 1 << NGX_HTTP_SLA_CLIENTS_BITS);
+    }
+
+    ngx_http_sla_touch_counter(pool, counter);
+
+    /* для sla_export - значения начинаются заново */
+    counter->created = counter->modified;
+}
+
+static void ngx_http_sla_reset_pool (ngx_http_sla_pool_t* pool, const ngx_str_t* counter)
+{
+    ngx_uint_t i;
+
+    for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+        if (pool->shm_ctx[i].name_len == 0) {
+            break;
+        }
+
+        if (ngx_http_sla_match(counter, pool->shm_ctx[i].name, pool->shm_ctx[i].name_len)) {
+            ngx_http_sla_reset_counter(pool, &pool->shm_ctx[i]);
+        }
+    }
+
+    if (counter->len == 0) {
+        ngx_memzero(pool->shm_stats, sizeof(ngx_http_sla_stats_t));
+        ngx_memzero(pool->stats_local, sizeof(ngx_http_sla_stats_t));
+
+        if (pool->shm_slow != NULL) {
+            pool->shm_slow->head = 0;
+        }
+    }
+}
+
+static ngx_int_t ngx_http_sla_processor (ngx_http_request_t* r)
+{
+    ngx_uint_t                 i;
+    ngx_uint_t                 peers;
+    ngx_uint_t                 groups;
+    ngx_uint_t                 slow;
+    ngx_msec_int_t             ms;
+    ngx_str_t                  filter;
+    ngx_str_t                  runtime;
+    ngx_str_t*                 alias;
+    ngx_str_t*                 group;
+    ngx_time_t*                tp;
+    u_char*                    p;
+    u_char                     buf[NGX_HTTP_SLA_MAX_NAME_LEN];
+    ngx_http_sla_request_t     req;
+    ngx_http_sla_pool_t**      pools;
+    ngx_http_sla_loc_conf_t*   config;
+    ngx_http_sla_main_conf_t*  mconf;
+    ngx_http_upstream_state_t* state;
+    ngx_http_variable_value_t* vv;
+
+    config = ngx_http_get_module_loc_conf(r, ngx_http_sla_module);
+    mconf = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+
+    if (config->off != 0 || config->pools == NULL || config->pools->nelts == 0) {
+        return NGX_OK;
+    }
+
+    if (mconf->shed && ngx_http_sla_is_shed(r)) {
+        return NGX_OK;
+    }
+
+    /* условие записи - до любой работы с пулами */
+    if (config->filter != NULL) {
+        if (ngx_http_complex_value(r, config->filter, &filter) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (filter.len == 0 || (filter.len == 1 && filter.data[0] == '0')) {
+            return NGX_OK;
+        }
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla processor");
+
+    /* ответы апстримов и алиасы - один раз для всех пулов и до захвата мьютексов */
+    ngx_memzero(&req, sizeof(ngx_http_sla_request_t));
+
+    pools  = config->pools->elts;
+    peers  = 0;
+    groups = 0;
+    slow   = 0;
+
+    for (i = 0; i < config->pools->nelts; i++) {
+        if (pools[i]->shm_ctx == NULL) {
+            pools[i] = ngx_http_sla_get_pool(&mconf->pools, &pools[i]->name);
+        }
+
+        peers  |= pools[i]->group_by & NGX_HTTP_SLA_GROUP_PEER;
+        groups |= pools[i]->group_by == (NGX_HTTP_SLA_GROUP_UPSTREAM | NGX_HTTP_SLA_GROUP_PEER);
+        slow   |= pools[i]->slow != 0;
+    }
+
+    /* данные медленного запроса - только ссылки, копируются в shm лишь при превышении порога */
+    if (slow) {
+        req.uri = r->unparsed_uri;
+
+        if (mconf->request_id != NGX_ERROR) {
+            vv = ngx_http_get_indexed_variable(r, mconf->request_id);
+            if (vv != NULL && !vv->not_found) {
+                req.id.data = vv->data;
+                req.id.len  = vv->len;
+            }
+        }
+    }
+
+    /* группа - блок upstream {} или имя из proxy_pass с переменными */
+    if (r->upstream != NULL && r->upstream->upstream != NULL) {
+        req.upstream = &r->upstream->upstream->host;
+    } else if (r->upstream != NULL && r->upstream->resolved != NULL && r->upstream->resolved->host.len != 0) {
+        req.upstream = &r->upstream->resolved->host;
+    }
+
+    /* пулам group_by=upstream алиасы не нужны */
+    if (req.upstream == NULL) {
+        peers  = 1;
+        groups = 0;
+    }
+
+    if (r->upstream_states != NULL && r->upstream_states->nelts > 0) {
+        state = r->upstream_states->elts;
+
+        req.states = ngx_palloc(r->pool, sizeof(ngx_http_sla_state_t) * r->upstream_states->nelts);
+        if (req.states == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < r->upstream_states->nelts; i++) {
+            if (state[i].peer == NULL || state[i].status < 100 || state[i].status > 599) {
+                continue;
+            }
+
+           #if nginx_version <= 1009000
+            ms = (ngx_msec_int_t)(state[i].response_sec * 1000 + state[i].response_msec);
+            ms = ngx_max(ms, 0);
+           #else
+            ms = (ngx_msec_int_t)(state[i].response_time);
+            ms = ngx_max(ms, 0);
+           #endif
+            req.time += ms;
+
+            runtime.data = buf;
+
+            alias = peers ? ngx_http_sla_find_alias(mconf->alias_table, config->aliases, state[i].peer, &runtime) : NULL;
+            if (alias == NULL) {
+                alias = state[i].peer;
+            } else if (alias == &runtime) {
+                /* алиас из sla_alias_zone прочитан во временный буфер */
+                alias = ngx_palloc(r->pool, sizeof(ngx_str_t) + runtime.len);
+                if (alias == NULL) {
+                    return NGX_ERROR;
+                }
+
+                alias->len  = runtime.len;
+                alias->data = (u_char*)(alias + 1);
+
+                ngx_memcpy(alias->data, runtime.data, runtime.len);
+            }
+
+            /* имя счетчика второго уровня "группа/апстрим" */
+            group = alias;
+
+            if (groups) {
+                group = ngx_palloc(r->pool, sizeof(ngx_str_t) + req.upstream->len + 1 + alias->len);
+                if (group == NULL) {
+                    return NGX_ERROR;
+                }
+
+                group->data = (u_char*)(group + 1);
+
+                p = ngx_cpymem(group->data, req.upstream->data, req.upstream->len);
+                *p++ = '/';
+                p = ngx_cpymem(p, alias->data, alias->len);
+
+                group->len = p - group->data;
+            }
+
+            req.states[req.n].name   = alias;
+            req.states[req.n].group  = group;
+            req.states[req.n].ms     = ms;
+            req.states[req.n].status = state[i].status;
+            req.n++;
+        }
+    }
+
+    /* пул и счетчик по умолчанию */
+    if (r->err_status) {
+        req.status = r->err_status;
+    } else if (r->headers_out.status) {
+        req.status = r->headers_out.status;
+    } else {
+        req.status = 0;
+    }
+
+    /* полное время обработки запроса */
+    tp = ngx_timeofday();
+
+    req.request = (ngx_msec_int_t)((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    req.request = ngx_max(req.request, 0);
+
+#if (NGX_HTTP_CACHE)
+    /* статус кэша, из кэша отдаются HIT, STALE, UPDATING и REVALIDATED */
+    if (r->upstream != NULL && r->upstream->cache_status != 0 && r->upstream->cache_status <= NGX_HTTP_CACHE_HIT) {
+        req.cache     = &ngx_http_sla_cache_status[r->upstream->cache_status];
+        req.cache_hit = r->upstream->cache_status >= NGX_HTTP_CACHE_STALE;
+    }
+#endif
+
+    /* мьютексы пулов захватываются по одному в порядке конфигурации, хэш клиента - до захвата */
+    for (i = 0; i < config->pools->nelts; i++) {
+        req.client = pools[i]->clients && ngx_http_sla_get_client(r, pools[i], &req.hash) == NGX_OK;
+
+        ngx_http_sla_record(pools[i], &req);
+
+        if (mconf->events != NULL) {
+            ngx_http_sla_add_events(mconf->events, pools[i], &req);
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void ngx_http_sla_record (ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req)
+{
+    ngx_uint_t                  i;
+    ngx_int_t                   rc;
+    const ngx_str_t*            name;
+    ngx_http_sla_pool_shm_t*    counter;
+    ngx_http_sla_pool_shm_t*    upstream;
+    ngx_http_sla_pool_shm_t*    prev;
+    const ngx_http_sla_state_t* states = req->states;
+
+    ngx_http_sla_lock(pool);
+
+    if (pool->generation != pool->shm_ctx->generation) {
+        pool->stats_local->drop_generation++;
+        ngx_http_sla_unlock(pool);
+        return;
+    }
+
+    prev = NULL;
+
+    for (i = 0; i < req->n; i++) {
+        rc       = NGX_OK;
+        counter  = NULL;
+        upstream = NULL;
+        name     = states[i].name;
+
+        /* group_by=upstream: ответы всех серверов группы в одном счетчике */
+        if ((pool->group_by & NGX_HTTP_SLA_GROUP_UPSTREAM) && req->upstream != NULL) {
+            rc   = ngx_http_sla_record_state(pool, req->upstream, &states[i], &upstream);
+            name = (pool->group_by & NGX_HTTP_SLA_GROUP_PEER) ? states[i].group : NULL;
+        }
+
+        if (rc == NGX_OK && name != NULL) {
+            rc = ngx_http_sla_record_state(pool, name, &states[i], &counter);
+        }
+
+        if (rc != NGX_OK) {
+            pool->stats_local->drop_counter++;
+            ngx_http_sla_flush_stats(pool, 0);
+            ngx_http_sla_unlock(pool);
+            return;
+        }
+
+        /* переход к следующему серверу (proxy_next_upstream) по индексу счетчика: обнуление отдельного счетчика
+           (reset=on с counter=) сохраняет его имя и место, а освобождаются места только все сразу (sla_purge,
+           изменение пула), поэтому индекс до следующего полного сброса указывает на тот же счетчик */
+        if (pool->retries && prev != NULL && counter != NULL) {
+            prev->next[counter - pool->shm_ctx]++;
+        }
+
+        prev = counter;
+
+        /* повторный учет того же клиента в регистрах ничего не меняет */
+        if (req->client) {
+            if (upstream != NULL) {
+                ngx_http_sla_add_client(pool, upstream, req->hash);
+            }
+
+            if (counter != NULL) {
+                ngx_http_sla_add_client(pool, counter, req->hash);
+            }
+        }
+    }
+
+    if (req->client) {
+        ngx_http_sla_add_client(pool, pool->shm_ctx, req->hash);
+    }
+
+    if (pool->retries && req->n > 0) {
+        ngx_http_sla_record_tries(pool, req);
+    }
+
+    ngx_http_sla_set_http_time(pool, pool->shm_ctx, req->time, req->status);
+    ngx_http_sla_set_http_status(pool, pool->shm_ctx, req->status);
+    ngx_http_sla_set_rates(&pool->shm_ctx->rates, req->status, req->time);
+
+    /* полное время запроса, включая статику, ответы из кэша и отправку клиенту */
+    if (pool->request) {
+        counter = ngx_http_sla_get_counter(pool, &ngx_http_sla_request_counter);
+        if (counter != NULL) {
+            ngx_http_sla_add_http_time(pool, counter, req->request, req->status);
+            ngx_http_sla_set_http_status(pool, counter, req->status);
+            ngx_http_sla_set_rates(&counter->rates, req->status, req->request);
+            ngx_http_sla_touch_counter(pool, counter);
+
+            if (req->client) {
+                ngx_http_sla_add_client(pool, counter, req->hash);
+            }
+        } else {
+            pool->stats_local->drop_counter++;
+        }
+    }
+
+    /* статус кэша - полное время запроса, т.к. у HIT нет времени апстрима */
+    if (pool->cache && req->cache != NULL) {
+        pool->shm_ctx->cache_lookup++;
+        pool->shm_ctx->cache_hit += req->cache_hit;
+
+        counter = ngx_http_sla_get_counter(pool, req->cache);
+        if (counter != NULL) {
+            ngx_http_sla_add_http_time(pool, counter, req->request, req->status);
+            ngx_http_sla_set_http_status(pool, counter, req->status);
+            ngx_http_sla_set_rates(&counter->rates, req->status, req->request);
+            ngx_http_sla_touch_counter(pool, counter);
+
+            if (req->client) {
+                ngx_http_sla_add_client(pool, counter, req->hash);
+            }
+        } else {
+            pool->stats_local->drop_counter++;
+        }
+    }
+
+    /* самые медленные запросы */
+    if (pool->slow != 0) {
+        ngx_http_sla_add_slow(pool, req);
+    }
+
+    ngx_http_sla_touch_counter(pool, pool->shm_ctx);
+
+    ngx_http_sla_flush_stats(pool, 0);
+    ngx_http_sla_unlock(pool);
+}
+
+static void ngx_http_sla_add_events (ngx_http_sla_events_t* events, const ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req)
+{
+    ngx_uint_t i;
+
+    for (i = 0; i < req->n; i++) {
+        ngx_http_sla_add_event(events, pool, req->states[i].name, req->states[i].ms, 0, req->states[i].status);
+    }
+
+    ngx_http_sla_add_event(events, pool, &ngx_http_sla_all_counter, req->time, req->request, req->status);
+}
+
+static void ngx_http_sla_add_event (ngx_http_sla_events_t* events, const ngx_http_sla_pool_t* pool, const ngx_str_t* counter, ngx_msec_int_t time, ngx_msec_int_t request, ngx_uint_t status)
+{
+    uint64_t              n;
+    ngx_time_t*           tp;
+    ngx_http_sla_event_t* event;
+
+    /* ячейка резервируется атомарно, seq = 0 на время заполнения - читатель пропустит запись */
+    n     = ngx_atomic_fetch_add((ngx_atomic_t*)&events->header->head, 1);
+    event = &events->records[n % events->header->capacity];
+
+    event->seq = 0;
+    ngx_memory_barrier();
+
+    tp = ngx_timeofday();
+
+    event->msec        = (uint64_t)tp->sec * 1000 + tp->msec;
+    event->time        = (uint32_t)time;
+    event->request     = (uint32_t)request;
+    event->status      = (uint16_t)status;
+    event->pool_len    = (uint8_t)ngx_min(pool->name.len, NGX_HTTP_SLA_EVENTS_POOL_LEN);
+    event->counter_len = (uint8_t)ngx_min(counter->len, NGX_HTTP_SLA_EVENTS_COUNTER_LEN);
+
+    ngx_memcpy(event->pool, pool->name.data, event->pool_len);
+    ngx_memcpy(event->counter, counter->data, event->counter_len);
+
+    ngx_memory_barrier();
+    event->seq = n + 1;
+}
+
+static void ngx_http_sla_add_slow (ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req)
+{
+    ngx_uint_t           threshold;
+    ngx_time_t*          tp;
+    const ngx_str_t*     peer;
+    ngx_http_sla_slow_t* slow;
+
+    /* порог - slow_timing или текущая оценка p99 счетчика all (уже с учетом этого запроса) */
+    threshold = pool->slow_timing != 0 ? pool->slow_timing : (ngx_uint_t)pool->shm_ctx->timing.quantiles[pool->p99_index];
+
+    /* до заполнения FIFO оценки квантиля еще нет */
+    if (threshold == 0 || req->time <= 0 || (ngx_uint_t)req->time <= threshold) {
+        return;
+    }
+
+    slow = &pool->shm_slow->entries[pool->shm_slow->head % pool->slow];
+    pool->shm_slow->head++;
+
+    tp   = ngx_timeofday();
+    peer = req->n > 0 ? req->states[req->n - 1].name : NULL;
+
+    slow->sec      = tp->sec;
+    slow->msec     = tp->msec;
+    slow->time     = req->time;
+    slow->request  = req->request;
+    slow->status   = req->status;
+    slow->uri_len  = ngx_min(req->uri.len, NGX_HTTP_SLA_SLOW_URI_LEN);
+    slow->peer_len = peer != NULL ? ngx_min(peer->len, NGX_HTTP_SLA_MAX_PEER_LEN) : 0;
+    slow->id_len   = ngx_min(req->id.len, NGX_HTTP_SLA_REQUEST_ID_LEN);
+
+    ngx_memcpy(slow->uri, req->uri.data, slow->uri_len);
+    ngx_memcpy(slow->id, req->id.data, slow->id_len);
+
+    if (peer != NULL) {
+        ngx_memcpy(slow->peer, peer->data, slow->peer_len);
+    }
+}
+
+static ngx_int_t ngx_http_sla_record_state (ngx_http_sla_pool_t* pool, const ngx_str_t* name, const ngx_http_sla_state_t* state, ngx_http_sla_pool_shm_t** counter)
+{
+    ngx_http_sla_pool_shm_t* shm;
+
+    shm = ngx_http_sla_get_counter(pool, name);
+    if (shm == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_sla_set_http_time(pool, shm, state->ms, state->status);
+    ngx_http_sla_set_http_status(pool, shm, state->status);
+    ngx_http_sla_set_rates(&shm->rates, state->status, state->ms);
+    ngx_http_sla_touch_counter(pool, shm);
+
+    if (counter != NULL) {
+        *counter = shm;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_sla_get_client (ngx_http_request_t* r, const ngx_http_sla_pool_t* pool, uint32_t* hash)
+{
+    ngx_http_variable_value_t* vv;
+
+    if (pool->clients_index == NGX_ERROR) {
+        *hash = ngx_murmur_hash2(r->connection->addr_text.data, r->connection->addr_text.len);
+        return NGX_OK;
+    }
+
+    vv = ngx_http_get_indexed_variable(r, pool->clients_index);
+    if (vv == NULL || vv->not_found || vv->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    *hash = ngx_murmur_hash2(vv->data, vv->len);
+
+    return NGX_OK;
+}
+
+static u_char* ngx_http_sla_get_clients (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter)
+{
+    return pool->shm_clients + (counter - pool->shm_ctx) * (1 << NGX_HTTP_SLA_CLIENTS_BITS);
+}
+
+static void ngx_http_sla_add_client (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter, uint32_t hash)
+{
+    uint32_t   rest;
+    ngx_uint_t index;
+    u_char     rank;
+    u_char*    clients;
+
+    /* старшие биты - номер регистра, в регистре - максимальная позиция первой единицы остатка */
+    index = hash >> (32 - NGX_HTTP_SLA_CLIENTS_BITS);
+    rest  = hash << NGX_HTTP_SLA_CLIENTS_BITS;
+
+    for (rank = 1; rank <= 32 - NGX_HTTP_SLA_CLIENTS_BITS && (rest & 0x80000000) == 0; rank++) {
+        rest <<= 1;
+    }
+
+    clients = ngx_http_sla_get_clients(pool, counter);
+
+    if (clients[index] < rank) {
+        clients[index] = rank;
+    }
+}
+
+static ngx_uint_t ngx_http_sla_count_clients (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter)
+{
+    double        m;
+    double        sum;
+    double        estimate;
+    ngx_uint_t    i;
+    ngx_uint_t    zeros;
+    const u_char* clients;
+
+    m       = (double)(1 << NGX_HTTP_SLA_CLIENTS_BITS);
+    sum     = 0;
+    zeros   = 0;
+    clients = ngx_http_sla_get_clients(pool, counter);
+
+    for (i = 0; i < (1 << NGX_HTTP_SLA_CLIENTS_BITS); i++) {
+        sum += ldexp(1, -(int)clients[i]);
+        zeros += clients[i] == 0;
+    }
+
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    /* поправки Flajolet et al. для малых значений (linear counting) и для 32-битного хэша */
+    if (estimate <= 2.5 * m && zeros != 0) {
+        estimate = m * log(m / (double)zeros);
+    } else if (estimate > 4294967296.0 / 30) {
+        estimate = -4294967296.0 * log(1 - estimate / 4294967296.0);
+    }
+
+    return (ngx_uint_t)(estimate + 0.5);
+}
+
+static void ngx_http_sla_record_tries (ngx_http_sla_pool_t* pool, const ngx_http_sla_request_t* req)
+{
+    ngx_uint_t i;
+
+    pool->shm_ctx->tries[ngx_min(req->n, 3) - 1]++;
+
+    /* все попытки, кроме последней, добавили задержку к ответу */
+    for (i = 0; i + 1 < req->n; i++) {
+        pool->shm_ctx->retry_time += req->states[i].ms;
+    }
+}
+
+static ngx_int_t ngx_http_sla_init_zone (ngx_shm_zone_t* shm_zone, void* data)
+{
+    size_t               size;
+    ngx_uint_t           sequence;
+    ngx_str_t            name;
+    ngx_http_sla_pool_t* pool;
+    ngx_http_sla_pool_t* old = NULL;
+
+    pool = ngx_http_sla_get_pool(shm_zone->data, &shm_zone->shm.name);
+
+    if (data != NULL) {
+        old = ngx_http_sla_get_pool(data, &shm_zone->shm.name);
+    }
+
+    if (old != NULL) {
+        /* идет перезагрузка потомков, пытаемся сохранить старые данные, если пул не менялся */
+        pool->shm_pool  = old->shm_pool;
+        pool->shm_ctx   = old->shm_ctx;
+        pool->shm_stats = old->shm_stats;
+        pool->shm_slow  = old->shm_slow;
+
+        pool->shm_timing_xxx = old->shm_timing_xxx;
+        pool->shm_clients    = old->shm_clients;
+
+        ngx_shmtx_lock(&pool->shm_pool->mutex);
+        pool->generation = pool->shm_ctx->generation;
+        sequence         = pool->shm_ctx->sequence;
+
+        if (ngx_http_sla_compare_pools(pool, old) == NGX_OK) {
+            /* если пул не менялся, поколение не меняется */
+            ngx_shmtx_unlock(&pool->shm_pool->mutex);
+            return NGX_OK;
+        }
+    } else {
+        /* первый запуск, аллокация shm */
+        pool->shm_pool = (ngx_slab_pool_t*)shm_zone->shm.addr;
+        pool->shm_ctx  = ngx_slab_alloc(pool->shm_pool, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
+        if (pool->shm_ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        pool->shm_stats = ngx_slab_alloc(pool->shm_pool, sizeof(ngx_http_sla_stats_t));
+        if (pool->shm_stats == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_shmtx_lock(&pool->shm_pool->mutex);
+
+        sequence = 0;
+    }
+
+    /* пул изменился или первый запуск */
+    ngx_memzero(pool->shm_ctx, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
+    ngx_memzero(pool->shm_stats, sizeof(ngx_http_sla_stats_t));
+
+    /* буфер медленных запросов - под новый размер */
+    if (old != NULL && old->slow != pool->slow && pool->shm_slow != NULL) {
+        ngx_slab_free_locked(pool->shm_pool, pool->shm_slow);
+        pool->shm_slow = NULL;
+    }
+
+    if (pool->slow != 0) {
+        size = sizeof(ngx_http_sla_slow_ring_t) + sizeof(ngx_http_sla_slow_t) * (pool->slow - 1);
+
+        if (pool->shm_slow == NULL) {
+            pool->shm_slow = ngx_slab_alloc_locked(pool->shm_pool, size);
+            if (pool->shm_slow == NULL) {
+                ngx_shmtx_unlock(&pool->shm_pool->mutex);
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_memzero(pool->shm_slow, size);
+    }
+
+    /* времена по группам статусов - только при включенном status_timings */
+    if (old != NULL && old->status_timings != pool->status_timings && pool->shm_timing_xxx != NULL) {
+        ngx_slab_free_locked(pool->shm_pool, pool->shm_timing_xxx);
+        pool->shm_timing_xxx = NULL;
+    }
+
+    if (pool->status_timings) {
+        size = sizeof(ngx_http_sla_timing_t) * 4 * NGX_HTTP_SLA_MAX_COUNTERS_LEN;
+
+        if (pool->shm_timing_xxx == NULL) {
+            pool->shm_timing_xxx = ngx_slab_alloc_locked(pool->shm_pool, size);
+            if (pool->shm_timing_xxx == NULL) {
+                ngx_shmtx_unlock(&pool->shm_pool->mutex);
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_memzero(pool->shm_timing_xxx, size);
+    }
+
+    /* регистры HyperLogLog - только при включенном clients */
+    if (old != NULL && old->clients != pool->clients && pool->shm_clients != NULL) {
+        ngx_slab_free_locked(pool->shm_pool, pool->shm_clients);
+        pool->shm_clients = NULL;
+    }
+
+    if (pool->clients) {
+        size = (1 << NGX_HTTP_SLA_CLIENTS_BITS) * NGX_HTTP_SLA_MAX_COUNTERS_LEN;
+
+        if (pool->shm_clients == NULL) {
+            pool->shm_clients = ngx_slab_alloc_locked(pool->shm_pool, size);
+            if (pool->shm_clients == NULL) {
+                ngx_shmtx_unlock(&pool->shm_pool->mutex);
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_memzero(pool->shm_clients, size);
+    }
+
+    ngx_str_set(&name, "all");
+    ngx_http_sla_add_counter(pool, &name, 0);
+
+    pool->generation++;
+    pool->shm_ctx->generation = pool->generation;
+    pool->shm_ctx->sequence   = ngx_max(sequence, ngx_http_sla_sequence_seed());
+
+    ngx_shmtx_unlock(&pool->shm_pool->mutex);
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_sla_init_alias_zone (ngx_shm_zone_t* shm_zone, void* data)
+{
+    ngx_http_sla_alias_table_t* table = shm_zone->data;
+    ngx_http_sla_alias_table_t* old   = data;
+
+    if (old != NULL) {
+        /* перезагрузка с тем же размером зоны: алиасы, заданные через sla_alias_api, сохраняются */
+        table->shm_pool = old->shm_pool;
+        table->count    = old->count;
+        table->probe    = old->probe;
+        table->entries  = old->entries;
+        table->size     = old->size;
+        table->limit    = ngx_min(table->limit, old->size / 2);
+
+        return NGX_OK;
+    }
+
+    table->shm_pool = (ngx_slab_pool_t*)shm_zone->shm.addr;
+
+    table->count = ngx_slab_alloc(table->shm_pool, sizeof(ngx_uint_t));
+    if (table->count == NULL) {
+        return NGX_ERROR;
+    }
+
+    table->probe = ngx_slab_alloc(table->shm_pool, sizeof(ngx_uint_t));
+    if (table->probe == NULL) {
+        return NGX_ERROR;
+    }
+
+    table->entries = ngx_slab_alloc(table->shm_pool, sizeof(ngx_http_sla_alias_shm_t) * table->size);
+    if (table->entries == NULL) {
+        return NGX_ERROR;
+    }
+
+    *table->count = 0;
+    *table->probe = 0;
+    ngx_memzero(table->entries, sizeof(ngx_http_sla_alias_shm_t) * table->size);
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_sla_init_render_zone (ngx_shm_zone_t* shm_zone, void* data)
+{
+    ngx_uint_t                   i;
+    ngx_http_sla_render_cache_t* cache = shm_zone->data;
+    ngx_http_sla_render_cache_t* old   = data;
+
+    cache->shm_pool = (ngx_slab_pool_t*)shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&cache->shm_pool->mutex);
+
+    if (old != NULL) {
+        cache->shm_generation = old->shm_generation;
+    } else {
+        cache->shm_generation = ngx_slab_alloc_locked(cache->shm_pool, sizeof(ngx_uint_t));
+        if (cache->shm_generation == NULL) {
+            ngx_shmtx_unlock(&cache->shm_pool->mutex);
+            return NGX_ERROR;
+        }
+
+        *cache->shm_generation = 0;
+    }
+
+    /* перезагрузка: старые результаты могут не соответствовать новой конфигурации;
+       завершающиеся процессы сверяют поколение под мьютексом и к освобожденному массиву не обращаются */
+    if (old != NULL && old->renders != NULL) {
+        for (i = 0; i < old->n; i++) {
+            if (old->renders[i].body != NULL) {
+                ngx_slab_free_locked(cache->shm_pool, old->renders[i].body);
+            }
+        }
+
+        ngx_slab_free_locked(cache->shm_pool, old->renders);
+        old->renders = NULL;
+    }
+
+    cache->generation = ++*cache->shm_generation;
+
+    cache->renders = ngx_slab_alloc_locked(cache->shm_pool, sizeof(ngx_http_sla_render_t) * ngx_max(cache->n, 1));
+    if (cache->renders != NULL) {
+        ngx_memzero(cache->renders, sizeof(ngx_http_sla_render_t) * ngx_max(cache->n, 1));
+    }
+
+    ngx_shmtx_unlock(&cache->shm_pool->mutex);
+
+    return cache->renders != NULL ? NGX_OK : NGX_ERROR;
+}
+
+static size_t ngx_http_sla_counter_size (void)
+{
 #ifndef NGX_HTTP_SLA_AIRBUG
     #define NGX_HTTP_SLA_AIRBUG 1024
 #endif
 
-    size =
-        (
-            (sizeof("..http_xxx = ")     + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * (NGX_HTTP_SLA_MAX_HTTP_LEN + 1 /* http_xxx */ + 6 /* http_2xx */) +
-            (sizeof("..time.avg = ")     + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) +
-            (sizeof("..time.avg.mov = ") + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) +
-            (sizeof(".. = ")             + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + 2 * NGX_ATOMIC_T_LEN + 1) * NGX_HTTP_SLA_MAX_TIMINGS_LEN +
-            (sizeof("...agg = ")         + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + 2 * NGX_ATOMIC_T_LEN + 1) * NGX_HTTP_SLA_MAX_TIMINGS_LEN +
-            (sizeof("..xx% = ")          + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * NGX_HTTP_SLA_MAX_QUANTILES_LEN +
-            4 * NGX_HTTP_SLA_AIRBUG    /* add two parachute, swiss knife and kit */
-        ) * NGX_HTTP_SLA_MAX_COUNTERS_LEN * config->pools.nelts;
+    return
+        (sizeof("..http_xxx = ")     + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * (NGX_HTTP_SLA_MAX_HTTP_LEN + 1 /* http_xxx */ + 6 /* http_2xx */) +
+        (
+            (sizeof("..2xx.time.avg = ")     + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) +
+            (sizeof("..2xx.time.avg.mov = ") + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) +
+            (sizeof("..2xx. = ")             + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + 2 * NGX_ATOMIC_T_LEN + 1) * NGX_HTTP_SLA_MAX_TIMINGS_LEN +
+            (sizeof("..2xx..agg = ")         + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + 2 * NGX_ATOMIC_T_LEN + 1) * NGX_HTTP_SLA_MAX_TIMINGS_LEN +
+            (sizeof("..2xx.xx% = ")          + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * NGX_HTTP_SLA_MAX_QUANTILES_LEN
+        ) * 5 /* все ответы и status_timings */ +
+        (sizeof("..first_byte.avg.mov = ") + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * 4 /* stream */ +
+        (sizeof("..rate_5xx.15m = ") + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 4) * 9 /* rates */ +
+        (sizeof("..cache.hit.ratio = ") + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 4) * 3 /* cache */ +
+        (sizeof("..retry.time.avg = ") + 2 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * 6 /* tries, clients */ +
+        (sizeof("..next. = ")          + 3 * NGX_HTTP_SLA_MAX_NAME_LEN + NGX_ATOMIC_T_LEN + 1) * NGX_HTTP_SLA_MAX_COUNTERS_LEN +
+        4 * NGX_HTTP_SLA_AIRBUG;   /* add two parachute, swiss knife and kit */
+}
+
+static ngx_int_t ngx_http_sla_push_value (ngx_conf_t* cf, const ngx_str_t* orig, ngx_int_t value, ngx_array_t* to, ngx_uint_t is_http)
+{
+    ngx_uint_t* p;
+
+    if (value == NGX_ERROR || value < 1 || value > 300000 /* 5 min */) {
+        if (is_http == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect timings values \"%V\" in sla_pool", orig);
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect http values \"%V\" in sla_pool", orig);
+        }
+        return NGX_ERROR;
+    }
+
+    if (is_http != 0 && (value < 100 || value > 599)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect http values \"%V\" in sla_pool", orig);
+        return NGX_ERROR;
+    }
+
+    if (is_http == 0 && to->nelts > 0) {
+        p = to->elts;
+        if (p[to->nelts - 1] >= (ngx_uint_t)value) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "timings must be in asc order but desc or equal found in \"%V\"", orig);
+            return NGX_ERROR;
+        }
+    }
+
+    p = ngx_array_push(to);
+
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    *p = value;
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_sla_parse_list (ngx_conf_t* cf, const ngx_str_t* orig, ngx_uint_t offset, ngx_array_t* to, ngx_uint_t is_http)
+{
+    u_char*   p1;
+    u_char*   p2;
+    ngx_int_t part;
+
+    p1 = orig->data + offset;
+    p2 = p1;
+
+    while (p2 < orig->data + orig->len) {
+        if (*p2 == ':') {
+            part = ngx_atoi(p1, p2 - p1);
+
+            if (ngx_http_sla_push_value(cf, orig, part, to, is_http) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            p1 = p2 + 1;
+        }
+
+        p2++;
+    }
+
+    if (p1 != p2) {
+        part = ngx_atoi(p1, p2 - p1);
+        if (ngx_http_sla_push_value(cf, orig, part, to, is_http) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    } else {
+        ngx_http_sla_push_value(cf, orig, -1, to, is_http);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_http_sla_pool_t* ngx_http_sla_get_pool (const ngx_array_t* pools, const ngx_str_t* name)
+{
+    ngx_uint_t           i;
+    ngx_http_sla_pool_t* pool;
+
+    pool = pools->elts;
+    for (i = 0; i < pools->nelts; i++) {
+        if (pool->name.len == name->len && ngx_strncmp(pool->name.data, name->data, name->len) == 0) {
+            return pool;
+        }
+        pool++;
+    }
+
+    return NULL;
+}
+
+static ngx_int_t ngx_http_sla_compare_pools (const ngx_http_sla_pool_t* pool1, const ngx_http_sla_pool_t* pool2)
+{
+    ngx_uint_t        i;
+    const ngx_uint_t* value1;
+    const ngx_uint_t* value2;
+
+    if (pool1->name.len != pool2->name.len || ngx_strncmp(pool1->name.data, pool2->name.data, pool2->name.len) != 0) {
+        return NGX_ERROR;
+    }
+
+    if (pool1->http.nelts      != pool2->http.nelts      ||
+        pool1->timings.nelts   != pool2->timings.nelts   ||
+        pool1->quantiles.nelts != pool2->quantiles.nelts ||
+        pool1->avg_window      != pool2->avg_window      ||
+        pool1->group_by        != pool2->group_by        ||
+        pool1->status_timings  != pool2->status_timings  ||
+        pool1->clients         != pool2->clients         ||
+        pool1->slow            != pool2->slow) {
+        return NGX_ERROR;
+    }
+
+    value1 = pool1->http.elts;
+    value2 = pool2->http.elts;
+    for (i = 0; i < pool1->http.nelts; i++) {
+        if (value1[i] != value2[i]) {
+            return NGX_ERROR;
+        }
+    }
+
+    value1 = pool1->timings.elts;
+    value2 = pool2->timings.elts;
+    for (i = 0; i < pool1->timings.nelts; i++) {
+        if (value1[i] != value2[i]) {
+            return NGX_ERROR;
+        }
+    }
+
+    value1 = pool1->quantiles.elts;
+    value2 = pool2->quantiles.elts;
+    for (i = 0; i < pool1->quantiles.nelts; i++) {
+        if (value1[i] != value2[i]) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_str_t* ngx_http_sla_get_alias (const ngx_array_t* aliases, const ngx_str_t* name)
+{
+    ngx_uint_t            i;
+    ngx_http_sla_alias_t* alias;
+
+    alias = aliases->elts;
+    for (i = 0; i < aliases->nelts; i++) {
+        if (alias->name.len == name->len && ngx_strncmp(alias->name.data, name->data, name->len) == 0) {
+            return &alias->alias;
+        }
+        alias++;
+    }
+
+    return NULL;
+}
+
+static ngx_str_t* ngx_http_sla_find_alias (const ngx_http_sla_alias_table_t* table, const ngx_array_t* aliases, const ngx_str_t* name, ngx_str_t* buf)
+{
+    if (table != NULL && ngx_http_sla_get_runtime_alias(table, name, buf) == NGX_OK) {
+        return buf;
+    }
+
+    return ngx_http_sla_get_alias(aliases, name);
+}
+
+static ngx_int_t ngx_http_sla_get_runtime_alias (const ngx_http_sla_alias_table_t* table, const ngx_str_t* name, ngx_str_t* alias)
+{
+    ngx_uint_t                      i;
+    ngx_uint_t                      n;
+    ngx_uint_t                      hash;
+    ngx_uint_t                      state;
+    ngx_uint_t                      found;
+    ngx_uint_t                      probe;
+    ngx_atomic_uint_t               version;
+    const ngx_http_sla_alias_shm_t* entry;
+
+    if (table->entries == NULL || name->len == 0 || name->len > NGX_HTTP_SLA_MAX_PEER_LEN) {
+        return NGX_DECLINED;
+    }
+
+    hash = ngx_hash_key(name->data, name->len);
+
+    /* дальше наибольшего смещения алиаса искать нечего, даже если цепочка не оборвана пустой ячейкой */
+    probe = ngx_min(*table->probe + 1, table->size);
+
+    for (i = 0; i < probe; i++) {
+        entry = &table->entries[(hash + i) % table->size];
+
+        /* seqlock: если ячейка изменялась во время чтения, она читается заново */
+        for (n = 0; n < NGX_HTTP_SLA_ALIAS_TRIES; n++) {
+            version = entry->version;
+            ngx_memory_barrier();
+
+            state = entry->state;
+            found = state == NGX_HTTP_SLA_ALIAS_USED
+                    && entry->hash == hash
+                    && entry->name_len == name->len
+                    && ngx_strncmp(entry->name, name->data, name->len) == 0;
+
+            if (found) {
+                alias->len = ngx_min(entry->alias_len, NGX_HTTP_SLA_MAX_NAME_LEN - 1);
+                ngx_memcpy(alias->data, entry->alias, alias->len);
+            }
+
+            ngx_memory_barrier();
+
+            if ((version & 1) == 0 && entry->version == version) {
+                break;
+            }
+        }
+
+        /* ячейка так и не прочиталась целиком - используется алиас из конфигурации */
+        if (n == NGX_HTTP_SLA_ALIAS_TRIES) {
+            return NGX_DECLINED;
+        }
+
+        if (found) {
+            return NGX_OK;
+        }
+
+        if (state == NGX_HTTP_SLA_ALIAS_EMPTY) {
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t ngx_http_sla_set_runtime_alias (ngx_http_sla_alias_table_t* table, const ngx_str_t* name, const ngx_str_t* alias)
+{
+    ngx_uint_t                i;
+    ngx_uint_t                hash;
+    ngx_uint_t                offset;
+    ngx_http_sla_alias_shm_t* entry;
+    ngx_http_sla_alias_shm_t* found;
+    ngx_http_sla_alias_shm_t* empty;
+
+    hash   = ngx_hash_key(name->data, name->len);
+    found  = NULL;
+    empty  = NULL;
+    offset = 0;
+
+    ngx_shmtx_lock(&table->shm_pool->mutex);
+
+    for (i = 0; i < ngx_min(*table->probe + 1, table->size); i++) {
+        entry = &table->entries[(hash + i) % table->size];
+
+        if (entry->state == NGX_HTTP_SLA_ALIAS_EMPTY) {
+            break;
+        }
+
+        if (entry->state == NGX_HTTP_SLA_ALIAS_REMOVED) {
+            if (empty == NULL) {
+                empty  = entry;
+                offset = i;
+            }
+            continue;
+        }
+
+        if (entry->hash == hash && entry->name_len == name->len && ngx_strncmp(entry->name, name->data, name->len) == 0) {
+            found = entry;
+            break;
+        }
+    }
+
+    if (found == NULL && (alias == NULL || *table->count >= table->limit)) {
+        ngx_shmtx_unlock(&table->shm_pool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /* новый алиас - в первую удаленную ячейку цепочки или в первую пустую */
+    if (found == NULL && empty == NULL) {
+        for (i = 0; i < table->size; i++) {
+            entry = &table->entries[(hash + i) % table->size];
+
+            if (entry->state != NGX_HTTP_SLA_ALIAS_USED) {
+                empty  = entry;
+                offset = i;
+                break;
+            }
+        }
+    }
+
+    if (found == NULL && empty == NULL) {
+        ngx_shmtx_unlock(&table->shm_pool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /* граница поиска расширяется до записи ячейки, чтобы читатель не пропустил новый алиас */
+    if (found == NULL && offset > *table->probe) {
+        *table->probe = offset;
+        ngx_memory_barrier();
+    }
+
+    entry = found != NULL ? found : empty;
+
+    /* нечетная версия - ячейка изменяется (| 1 на случай, если изменявший процесс умер) */
+    entry->version = (entry->version + 1) | 1;
+    ngx_memory_barrier();
+
+    if (alias == NULL) {
+        /* удаленная ячейка не обрывает цепочку поиска */
+        entry->state = NGX_HTTP_SLA_ALIAS_REMOVED;
+        (*table->count)--;
+    } else {
+        if (found == NULL) {
+            (*table->count)++;
+        }
+
+        entry->state     = NGX_HTTP_SLA_ALIAS_USED;
+        entry->hash      = hash;
+        entry->name_len  = name->len;
+        entry->alias_len = alias->len;
+
+        ngx_memcpy(entry->name,  name->data,  name->len);
+        ngx_memcpy(entry->alias, alias->data, alias->len);
+    }
+
+    ngx_memory_barrier();
+    entry->version++;
+
+    if (alias == NULL) {
+        ngx_http_sla_clear_removed_aliases(table, entry - table->entries);
+    }
+
+    ngx_shmtx_unlock(&table->shm_pool->mutex);
+
+    return NGX_OK;
+}
+
+static void ngx_http_sla_clear_removed_aliases (ngx_http_sla_alias_table_t* table, ngx_uint_t index)
+{
+    ngx_http_sla_alias_shm_t* entry;
+
+    /* удаленная ячейка перед пустой ни одной цепочки не продолжает - она тоже становится пустой,
+       и так назад по цепочке, пока идут удаленные ячейки; при постоянной смене апстримов
+       иначе пустых ячеек не останется и каждый промах будет проходить всю таблицу */
+    if (table->entries[(index + 1) % table->size].state != NGX_HTTP_SLA_ALIAS_EMPTY) {
+        return;
+    }
+
+    for ( ;; ) {
+        entry = &table->entries[index];
+
+        if (entry->state != NGX_HTTP_SLA_ALIAS_REMOVED) {
+            break;
+        }
+
+        entry->version = (entry->version + 1) | 1;
+        ngx_memory_barrier();
+
+        entry->state = NGX_HTTP_SLA_ALIAS_EMPTY;
+
+        ngx_memory_barrier();
+        entry->version++;
+
+        index = (index + table->size - 1) % table->size;
+    }
+}
+
+static ngx_http_sla_pool_shm_t* ngx_http_sla_get_counter (ngx_http_sla_pool_t* pool, const ngx_str_t* name)
+{
+    ngx_uint_t               i;
+    ngx_http_sla_pool_shm_t* counter;
+
+    counter = pool->shm_ctx;
+    for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+        if (counter->name_len == name->len && ngx_strncmp(counter->name, name->data, name->len) == 0) {
+            return counter;
+        } else if (counter->name_len == 0) {
+            return ngx_http_sla_add_counter(pool, name, i);
+        }
+        counter++;
+    }
+
+    return NULL;
+}
+
+static ngx_http_sla_pool_shm_t* ngx_http_sla_add_counter (ngx_http_sla_pool_t* pool, const ngx_str_t* name, ngx_uint_t hint)
+{
+    ngx_uint_t               i;
+    ngx_http_sla_pool_shm_t* result;
+
+    result = pool->shm_ctx;
+    for (i = hint; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+        if (result->name_len == 0) {
+            break;
+        }
+        result++;
+    }
+
+    if (i >= NGX_HTTP_SLA_MAX_COUNTERS_LEN) {
+        return NULL;
+    }
+
+    if (name->len >= NGX_HTTP_SLA_MAX_NAME_LEN) {
+        return NULL;
+    }
+
+    ngx_memcpy(result->name, name->data, name->len);
+    result->name_len = name->len;
+    result->created  = ++pool->shm_ctx->sequence;
+
+    return result;
+}
+
+static void ngx_http_sla_touch_counter (ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter)
+{
+    counter->modified = ++pool->shm_ctx->sequence;
+}
+
+static ngx_uint_t ngx_http_sla_sequence_seed (void)
+{
+    /* курсоры, выданные до перезапуска, должны оказаться меньше новых номеров */
+#if (NGX_PTR_SIZE == 8)
+    return (ngx_uint_t)ngx_time() << 24;
+#else
+    return (ngx_uint_t)ngx_time();
+#endif
+}
+
+static ngx_int_t ngx_http_sla_parse_cursor (const ngx_str_t* value, ngx_uint_t* cursor, ngx_uint_t n)
+{
+    u_char*    p1;
+    u_char*    p2;
+    ngx_int_t  part;
+    ngx_uint_t i;
+
+    p1 = value->data;
+    p2 = p1;
+    i  = 0;
+
+    /* пулов могло стать больше или меньше - лишнее отбрасывается, недостающее выдается целиком */
+    while (p2 <= value->data + value->len) {
+        if (p2 == value->data + value->len || *p2 == '-') {
+            part = ngx_atoi(p1, p2 - p1);
+            if (part == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (i < n) {
+                cursor[i++] = part;
+            }
+
+            p1 = p2 + 1;
+        }
+
+        p2++;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_sla_set_http_status (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t status)
+{
+    return ngx_http_sla_engine_add_status(&pool->engine, counter->http, counter->http_xxx, status) == 0 ? NGX_OK : NGX_ERROR;
+}
+
+static ngx_int_t ngx_http_sla_set_http_time (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t ms, ngx_uint_t status)
+{
+    /* нулевой тайминг (статика) и тайминг меньше времени отсечки не учитывается */
+    if (ms == 0 || ms < pool->min_timing) {
+        return NGX_OK;
+    }
+
+    ngx_http_sla_add_http_time(pool, counter, ms, status);
+
+    return NGX_OK;
+}
+
+static ngx_http_sla_timing_t* ngx_http_sla_get_timing_xxx (const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter)
+{
+    /* блок выделяется отдельно от счетчиков, по 4 группы на каждый слот */
+    return &pool->shm_timing_xxx[(counter - pool->shm_ctx) * 4];
+}
+
+static void ngx_http_sla_add_http_time (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t ms, ngx_uint_t status)
+{
+    ngx_http_sla_add_timing(pool, &counter->timing, ms);
+
+    /* отдельные распределения 2xx-5xx: быстрые 502 и 499 не занижают процентили успешных ответов */
+    if (pool->status_timings && status >= 200 && status < 600) {
+        ngx_http_sla_add_timing(pool, &ngx_http_sla_get_timing_xxx(pool, counter)[status / 100 - 2], ms);
+    }
+}
+
+static void ngx_http_sla_add_timing (const ngx_http_sla_pool_t* pool, ngx_http_sla_timing_t* series, ngx_uint_t ms)
+{
+    ngx_uint_t start;
+
+    if (!ngx_http_sla_engine_add_timing(&pool->engine, series, ms)) {
+        return;
+    }
+
+    start = pool->stats ? ngx_http_sla_usec() : 0;
+
+    ngx_http_sla_engine_quantiles(&pool->engine, series);
+
+    if (pool->stats) {
+        pool->stats_local->ewsa_count++;
+        pool->stats_local->ewsa_time += ngx_http_sla_usec_since(start);
+    }
+}
+
+static void ngx_http_sla_set_avg_mov (const ngx_http_sla_pool_t* pool, double* avg, ngx_uint_t* count, ngx_msec_t ms)
+{
+    ngx_uint_t window;
+
+    (*count)++;
+
+    window = ngx_min(*count, pool->avg_window);
+
+    *avg = (double)(window - 1) / (double)window * *avg + (double)ms / (double)window;
+}
+
+static void ngx_http_sla_set_rates (ngx_http_sla_rates_t* rates, ngx_uint_t status, ngx_uint_t ms)
+{
+    ngx_http_sla_tick_rates(rates, ngx_current_msec);
+
+    rates->requests++;
+    rates->time += ms;
+
+    if (status >= 500 && status < 600) {
+        rates->errors++;
+    }
+}
+
+static void ngx_http_sla_tick_rates (ngx_http_sla_rates_t* rates, ngx_msec_t now)
+{
+    ngx_uint_t i;
+    ngx_uint_t n;
+    double     decay;
+    double     idle;
+    double     rps;
+    double     eps;
+
+    /* первый запрос счетчика */
+    if (rates->tick == 0) {
+        rates->tick = now;
+        return;
+    }
+
+    n = (ngx_msec_int_t)(now - rates->tick) > 0 ? (now - rates->tick) / NGX_HTTP_SLA_RATE_INTERVAL : 0;
+    if (n == 0) {
+        return;
+    }
+
+    rps = (double)rates->requests * 1000 / NGX_HTTP_SLA_RATE_INTERVAL;
+    eps = (double)rates->errors   * 1000 / NGX_HTTP_SLA_RATE_INTERVAL;
+
+    for (i = 0; i < 3; i++) {
+        decay = ngx_http_sla_rate_decay[i];
+
+        /* завершившийся интервал, затем n - 1 интервалов без запросов */
+        idle = n > 1 ? pow(decay, (double)(n - 1)) : 1;
+
+        rates->rps[i] = (rates->rps[i] * decay + rps * (1 - decay)) * idle;
+        rates->eps[i] = (rates->eps[i] * decay + eps * (1 - decay)) * idle;
+
+        /* время ответа без запросов не меняется */
+        if (rates->requests > 0) {
+            if (rates->time_avg[i] == 0) {
+                rates->time_avg[i] = (double)rates->time / rates->requests;
+            } else {
+                rates->time_avg[i] = rates->time_avg[i] * decay + (double)rates->time / rates->requests * (1 - decay);
+            }
+        }
+    }
+
+    rates->requests = 0;
+    rates->errors   = 0;
+    rates->time     = 0;
+    rates->tick    += n * NGX_HTTP_SLA_RATE_INTERVAL;
+}
+
+static void ngx_http_sla_print_pool (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, ngx_uint_t since, const ngx_str_t* counter)
+{
+    ngx_uint_t i;
+
+    /* курсор из будущего (пул очищен при перезагрузке) - выдается все */
+    if (since > pool->shm_ctx->sequence) {
+        since = 0;
+    }
+
+    for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+        if (pool->shm_ctx[i].name_len == 0) {
+            break;
+        }
+
+        if (since != 0 && pool->shm_ctx[i].modified <= since) {
+            continue;
+        }
+
+        if (!ngx_http_sla_match(counter, pool->shm_ctx[i].name, pool->shm_ctx[i].name_len)) {
+            continue;
+        }
+
+        ngx_http_sla_print_counter(buf, pool, &pool->shm_ctx[i]);
+    }
+
+    if (pool->stats && counter->len == 0) {
+        ngx_http_sla_print_stats(buf, pool);
+    }
+}
+
+static void ngx_http_sla_print_counter (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter)
+{
+    ngx_uint_t                   i;
+    ngx_uint_t                   http_count;
+    ngx_uint_t                   http_xxx_count;
+    ngx_uint_t                   retried;
+    const ngx_uint_t*            http;
+    const ngx_http_sla_timing_t* timing_xxx;
+    ngx_http_sla_rates_t         rates;
+
+    static const char* rate_names[3] = { "1m", "5m", "15m" };
+    static const char* group_names[4] = { ".2xx", ".3xx", ".4xx", ".5xx" };
+
+    http           = pool->http.elts;
+    http_count     = counter->http[pool->http.nelts - 1];
+    http_xxx_count = counter->http_xxx[5];
+
+    /* коды http */
+    buf->last = ngx_sprintf(buf->last, "%V.%s.http = %uA\n", &pool->name, counter->name, http_count);
+
+    for (i = 0; i < pool->http.nelts - 1; i++) {
+        buf->last = ngx_sprintf(buf->last, "%V.%s.http_%uA = %uA\n", &pool->name, counter->name, http[i], counter->http[i]);
+    }
+
+    /* группы кодов http */
+    buf->last = ngx_sprintf(buf->last, "%V.%s.http_xxx = %uA\n", &pool->name, counter->name, http_xxx_count);
+
+    for (i = 0; i < 5; i++) {
+        buf->last = ngx_sprintf(buf->last, "%V.%s.http_%uAxx = %uA\n", &pool->name, counter->name,  i + 1, counter->http_xxx[i]);
+    }
+
+    /* средние, тайминги и процентили */
+    ngx_http_sla_print_timing(buf, pool, counter, "", &counter->timing);
+
+    if (pool->status_timings) {
+        timing_xxx = ngx_http_sla_get_timing_xxx(pool, counter);
+
+        for (i = 0; i < 4; i++) {
+            ngx_http_sla_print_timing(buf, pool, counter, group_names[i], &timing_xxx[i]);
+        }
+    }
+
+    /* скорости - на текущий момент, без изменения данных в shm */
+    rates = counter->rates;
+    ngx_http_sla_tick_rates(&rates, ngx_current_msec);
+
+    for (i = 0; i < 3; i++) {
+        buf->last = ngx_sprintf(buf->last, "%V.%s.rate.%s = %.2f\n", &pool->name, counter->name, rate_names[i], rates.rps[i]);
+        buf->last = ngx_sprintf(buf->last, "%V.%s.rate_5xx.%s = %.2f\n", &pool->name, counter->name, rate_names[i], rates.eps[i]);
+        buf->last = ngx_sprintf(buf->last, "%V.%s.time.avg.%s = %uA\n", &pool->name, counter->name, rate_names[i], (ngx_uint_t)rates.time_avg[i]);
+    }
+
+    /* обращения к кэшу - в счетчике по умолчанию */
+    if (pool->cache && counter == pool->shm_ctx) {
+        buf->last = ngx_sprintf(buf->last, "%V.%s.cache.lookup = %uA\n", &pool->name, counter->name, counter->cache_lookup);
+        buf->last = ngx_sprintf(buf->last, "%V.%s.cache.hit = %uA\n", &pool->name, counter->name, counter->cache_hit);
+        buf->last = ngx_sprintf(buf->last, "%V.%s.cache.hit.ratio = %.2f\n", &pool->name, counter->name,
+                                counter->cache_lookup > 0 ? (double)counter->cache_hit * 100 / counter->cache_lookup : (double)0);
+    }
+
+    /* уникальные клиенты с момента последнего обнуления счетчика */
+    if (pool->clients) {
+        buf->last = ngx_sprintf(buf->last, "%V.%s.clients.uniq = %uA\n", &pool->name, counter->name, ngx_http_sla_count_clients(pool, counter));
+    }
+
+    /* повторные попытки: количество и задержка - в счетчике по умолчанию, переходы - в счетчике неудачного сервера */
+    if (pool->retries) {
+        if (counter == pool->shm_ctx) {
+            retried = counter->tries[1] + counter->tries[2];
+
+            for (i = 0; i < 3; i++) {
+                buf->last = ngx_sprintf(buf->last, "%V.%s.tries.%uA = %uA\n", &pool->name, counter->name, i + 1, counter->tries[i]);
+            }
+
+            buf->last = ngx_sprintf(buf->last, "%V.%s.retry.time = %uA\n", &pool->name, counter->name, counter->retry_time);
+            buf->last = ngx_sprintf(buf->last, "%V.%s.retry.time.avg = %uA\n", &pool->name, counter->name, retried > 0 ? counter->retry_time / retried : 0);
+        }
+
+        for (i = 1; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+            if (counter->next[i] != 0) {
+                buf->last = ngx_sprintf(buf->last, "%V.%s.next.%s = %uA\n", &pool->name, counter->name, pool->shm_ctx[i].name, counter->next[i]);
+            }
+        }
+    }
+
+    /* соединения модуля stream */
+    if (pool->stream) {
+        buf->last = ngx_sprintf(buf->last, "%V.%s.connect.avg.mov = %uA\n", &pool->name, counter->name, (ngx_uint_t)counter->connect_avg_mov);
+        buf->last = ngx_sprintf(buf->last, "%V.%s.first_byte.avg.mov = %uA\n", &pool->name, counter->name, (ngx_uint_t)counter->first_byte_avg_mov);
+        buf->last = ngx_sprintf(buf->last, "%V.%s.bytes.sent = %uA\n", &pool->name, counter->name, counter->bytes_sent);
+        buf->last = ngx_sprintf(buf->last, "%V.%s.bytes.received = %uA\n", &pool->name, counter->name, counter->bytes_received);
+    }
+}
+
+static void ngx_http_sla_print_timing (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter, const char* group, const ngx_http_sla_timing_t* series)
+{
+    ngx_uint_t        i;
+    ngx_uint_t        timings_count;
+    const ngx_uint_t* timing;
+    const ngx_uint_t* quantile;
+
+    timing        = pool->timings.elts;
+    timings_count = series->timings_agg[pool->timings.nelts - 1];
+    quantile      = pool->quantiles.elts;
+
+    /* среднее */
+    buf->last = ngx_sprintf(buf->last, "%V.%s%s.time.avg = %uA\n", &pool->name, counter->name, group, (ngx_uint_t)series->time_avg);
+    buf->last = ngx_sprintf(buf->last, "%V.%s%s.time.avg.mov = %uA\n", &pool->name, counter->name, group, (ngx_uint_t)series->time_avg_mov);
+
+    /* тайминги */
+    for (i = 0; i < pool->timings.nelts; i++) {
+        if (timing[i] != (ngx_uint_t)-1) {
+            buf->last = ngx_sprintf(buf->last, "%V.%s%s.%uA = %uA\n", &pool->name, counter->name, group, timing[i], series->timings[i]);
+            buf->last = ngx_sprintf(buf->last, "%V.%s%s.%uA.agg = %uA\n", &pool->name, counter->name, group, timing[i], series->timings_agg[i]);
+        } else {
+            buf->last = ngx_sprintf(buf->last, "%V.%s%s.inf = %uA\n", &pool->name, counter->name, group, series->timings[i]);
+            buf->last = ngx_sprintf(buf->last, "%V.%s%s.inf.agg = %uA\n", &pool->name, counter->name, group, timings_count);
+        }
+    }
+
+    /* процентили */
+    for (i = 0; i < pool->quantiles.nelts; i++) {
+        buf->last = ngx_sprintf(buf->last, "%V.%s%s.%uA%% = %uA\n", &pool->name, counter->name, group, quantile[i], (ngx_uint_t)series->quantiles[i]);
+    }
+}
+
+static void ngx_http_sla_print_stats (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool)
+{
+    const ngx_http_sla_stats_t* stats = pool->shm_stats;
+
+    buf->last = ngx_sprintf(buf->last, "sla.%V.lock.count = %uA\n", &pool->name, stats->lock_count);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.lock.wait = %uA\n", &pool->name, stats->lock_wait);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.lock.hold = %uA\n", &pool->name, stats->lock_hold);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.drop.counter = %uA\n", &pool->name, stats->drop_counter);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.drop.generation = %uA\n", &pool->name, stats->drop_generation);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.shed = %uA\n", &pool->name, stats->shed);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.ewsa.count = %uA\n", &pool->name, stats->ewsa_count);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.ewsa.time = %uA\n", &pool->name, stats->ewsa_time);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.render.count = %uA\n", &pool->name, stats->render_count);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.render.bytes = %uA\n", &pool->name, stats->render_bytes);
+    buf->last = ngx_sprintf(buf->last, "sla.%V.render.time = %uA\n", &pool->name, stats->render_time);
+}
+
+static void ngx_http_sla_print_slow (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool)
+{
+    ngx_uint_t                 i;
+    ngx_uint_t                 n;
+    const ngx_http_sla_slow_t* slow;
+
+    if (pool->shm_slow == NULL) {
+        return;
+    }
+
+    n = ngx_min(pool->shm_slow->head, pool->slow);
+
+    for (i = 0; i < n; i++) {
+        slow = &pool->shm_slow->entries[(pool->shm_slow->head - 1 - i) % pool->slow];
+
+        buf->last = ngx_sprintf(buf->last, "%V.slow.%uA = %T.%03M %uA %M %M %*s %*s %*s\n",
+                                &pool->name, i + 1, slow->sec, slow->msec, slow->status, slow->time, slow->request,
+                                slow->peer_len != 0 ? slow->peer_len : 1, slow->peer_len != 0 ? slow->peer : (u_char*)"-",
+                                slow->id_len != 0 ? slow->id_len : 1, slow->id_len != 0 ? slow->id : (u_char*)"-",
+                                slow->uri_len, slow->uri);
+    }
+}
+
+static void ngx_http_sla_dump_pool (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, const ngx_str_t* counter)
+{
+    ngx_uint_t                     i;
+    ngx_uint_t                     j;
+    ngx_uint_t                     dumped;
+    u_char*                        count;
+    const ngx_uint_t*              value;
+    const ngx_http_sla_pool_shm_t* shm;
+
+    /* описание пула */
+    buf->last = ngx_http_sla_binary_put16(buf->last, (uint16_t)pool->name.len);
+    buf->last = ngx_cpymem(buf->last, pool->name.data, pool->name.len);
+
+    value     = pool->timings.elts;
+    buf->last = ngx_http_sla_binary_put16(buf->last, (uint16_t)pool->timings.nelts);
+    for (i = 0; i < pool->timings.nelts; i++) {
+        buf->last = ngx_http_sla_binary_put32(buf->last, value[i] != (ngx_uint_t)-1 ? (uint32_t)value[i] : NGX_HTTP_SLA_BINARY_INF);
+    }
+
+    value     = pool->http.elts;
+    buf->last = ngx_http_sla_binary_put16(buf->last, (uint16_t)pool->http.nelts);
+    for (i = 0; i < pool->http.nelts; i++) {
+        buf->last = ngx_http_sla_binary_put32(buf->last, value[i] != (ngx_uint_t)-1 ? (uint32_t)value[i] : NGX_HTTP_SLA_BINARY_INF);
+    }
+
+    value     = pool->quantiles.elts;
+    buf->last = ngx_http_sla_binary_put16(buf->last, (uint16_t)pool->quantiles.nelts);
+    for (i = 0; i < pool->quantiles.nelts; i++) {
+        buf->last = ngx_http_sla_binary_put16(buf->last, (uint16_t)value[i]);
+    }
+
+    /* счетчики, количество - после вывода */
+    count     = buf->last;
+    buf->last = ngx_http_sla_binary_put16(buf->last, 0);
+    dumped    = 0;
+
+    for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+        shm = &pool->shm_ctx[i];
+
+        if (shm->name_len == 0) {
+            break;
+        }
+
+        if (!ngx_http_sla_match(counter, shm->name, shm->name_len)) {
+            continue;
+        }
+
+        buf->last = ngx_http_sla_binary_put16(buf->last, (uint16_t)shm->name_len);
+        buf->last = ngx_cpymem(buf->last, shm->name, shm->name_len);
+
+        for (j = 0; j < pool->http.nelts; j++) {
+            buf->last = ngx_http_sla_binary_put64(buf->last, shm->http[j]);
+        }
+
+        for (j = 0; j < 6; j++) {
+            buf->last = ngx_http_sla_binary_put64(buf->last, shm->http_xxx[j]);
+        }
+
+        for (j = 0; j < pool->timings.nelts; j++) {
+            buf->last = ngx_http_sla_binary_put64(buf->last, shm->timing.timings[j]);
+        }
+
+        buf->last = ngx_http_sla_binary_put64(buf->last, shm->timing.timings_agg[pool->timings.nelts - 1]);
+        buf->last = ngx_http_sla_binary_put64(buf->last, shm->timing.time_sum);
+
+        dumped++;
+    }
+
+    ngx_http_sla_binary_put16(count, (uint16_t)dumped);
+}
+
+static ngx_uint_t ngx_http_sla_usec (void)
+{
+    struct timeval tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_uint_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static ngx_uint_t ngx_http_sla_usec_since (ngx_uint_t start)
+{
+    ngx_uint_t now;
+
+    now = ngx_http_sla_usec();
 
-    buf = ngx_create_temp_buf(r->pool, size);
-    if (buf == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    return now > start ? now - start : 0;
+}
 
-    out.buf  = buf;
-    out.next = NULL;
+static void ngx_http_sla_lock (ngx_http_sla_pool_t* pool)
+{
+    ngx_uint_t start;
 
-    /* формирование результата */
-    pool = config->pools.elts;
+    if (pool->stats == 0) {
+        ngx_shmtx_lock(&pool->shm_pool->mutex);
+        return;
+    }
 
-    for (i = 0; i < config->pools.nelts; i++) {
-        if (pool->shm_ctx != NULL) {
-            ngx_shmtx_lock(&pool->shm_pool->mutex);
+    start = ngx_http_sla_usec();
 
-            if (pool->generation == pool->shm_ctx->generation) {
-                ngx_http_sla_print_pool(buf, pool);
-            }
+    ngx_shmtx_lock(&pool->shm_pool->mutex);
 
-            ngx_shmtx_unlock(&pool->shm_pool->mutex);
-        }
+    pool->lock_time = ngx_http_sla_usec();
 
-        pool++;
+    pool->stats_local->lock_count++;
+    pool->stats_local->lock_wait += pool->lock_time > start ? pool->lock_time - start : 0;
+}
+
+static void ngx_http_sla_unlock (ngx_http_sla_pool_t* pool)
+{
+    if (pool->stats != 0) {
+        pool->stats_local->lock_hold += ngx_http_sla_usec_since(pool->lock_time);
     }
 
-    /* отправка результата */
-    r->headers_out.status           = NGX_HTTP_OK;
-    r->headers_out.content_length_n = buf->last - buf->pos;
+    ngx_shmtx_unlock(&pool->shm_pool->mutex);
+}
 
-    buf->last_buf = (r == r->main) ? 1 : 0;
+static void ngx_http_sla_flush_stats (ngx_http_sla_pool_t* pool, ngx_uint_t force)
+{
+    ngx_http_sla_stats_t* local;
+    ngx_http_sla_stats_t* shm;
 
-    result = ngx_http_send_header(r);
-    if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
-        return result;
+    /* сброс в shm не чаще раза в секунду, чтобы не трогать лишние кэш-линии */
+    if (pool->stats == 0 || (force == 0 && ngx_current_msec - pool->stats_flush < 1000)) {
+        return;
     }
 
-    return ngx_http_output_filter(r, &out);
+    local = pool->stats_local;
+    shm   = pool->shm_stats;
+
+    shm->lock_count      += local->lock_count;
+    shm->lock_wait       += local->lock_wait;
+    shm->lock_hold       += local->lock_hold;
+    shm->drop_counter    += local->drop_counter;
+    shm->drop_generation += local->drop_generation;
+    shm->shed            += local->shed;
+    shm->ewsa_count      += local->ewsa_count;
+    shm->ewsa_time       += local->ewsa_time;
+    shm->render_count    += local->render_count;
+    shm->render_bytes    += local->render_bytes;
+    shm->render_time     += local->render_time;
+
+    ngx_memzero(local, sizeof(ngx_http_sla_stats_t));
+
+    pool->stats_flush = ngx_current_msec;
 }
 
-static ngx_int_t ngx_http_sla_purge_handler (ngx_http_request_t* r)
-{
-    ngx_uint_t                i;
-    size_t                    size;
-    ngx_buf_t*                buf;
-    ngx_chain_t               out;
-    ngx_int_t                 result;
-    ngx_str_t                 name;
-    ngx_http_sla_pool_t*      pool;
-    ngx_http_sla_main_conf_t* config;
+#ifdef NGX_HTTP_SLA_EXPORT
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla_purge handler");
+static void ngx_http_sla_export_handler (ngx_event_t* ev)
+{
+    ngx_http_sla_export_t* export = ev->data;
 
-    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
-        return NGX_HTTP_NOT_ALLOWED;
+    if (ngx_exiting) {
+        return;
     }
 
-    result = ngx_http_discard_request_body(r);
-    if (result != NGX_OK) {
-        return result;
+    if (export->type == SOCK_STREAM && export->peer.connection != NULL) {
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0, "sla_export to %V is still in progress, skipped", &export->addr->name);
+    } else {
+        ngx_http_sla_export_pools(export);
     }
 
-    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    ngx_add_timer(ev, export->interval);
+}
 
-    if (r->method == NGX_HTTP_HEAD) {
-        r->headers_out.status = NGX_HTTP_OK;
+static void ngx_http_sla_export_pools (ngx_http_sla_export_t* export)
+{
+    ngx_uint_t               i;
+    ngx_uint_t               j;
+    size_t                   len;
+    ngx_uint_t               primed;
+    ngx_http_sla_pool_t*     pool;
+    ngx_http_sla_pool_shm_t* counter;
+    ngx_http_sla_pool_shm_t* prev;
+
+    export->pos      = export->start;
+    export->last     = export->start;
+    export->items    = 0;
+    export->overflow = 0;
+
+    /* заголовок zabbix sender: сигнатура, версия и длина данных (заполняется в конце) */
+    if (export->format == NGX_HTTP_SLA_EXPORT_ZABBIX) {
+        export->last = ngx_cpymem(export->last, "ZBXD\1", 5);
+        ngx_memzero(export->last, 8);
+        export->last += 8;
+        export->last = ngx_sprintf(export->last, "{\"request\":\"sender data\",\"data\":[");
+    }
 
-        result = ngx_http_send_header(r);
+    pool = export->pools->elts;
 
-        if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
-            return result;
+    for (i = 0; i < export->pools->nelts; i++) {
+        if (pool[i].shm_ctx == NULL) {
+            continue;
         }
-    }
 
-    /* OK */
-    size = 4 * sizeof(u_char);
-
-    buf = ngx_create_temp_buf(r->pool, size);
-    if (buf == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+        /* снимок счетчиков под мьютексом, все остальное без него */
+        ngx_http_sla_lock(&pool[i]);
 
-    out.buf  = buf;
-    out.next = NULL;
+        if (pool[i].generation != pool[i].shm_ctx->generation) {
+            ngx_http_sla_unlock(&pool[i]);
+            continue;
+        }
 
-    buf->last = ngx_sprintf(buf->last, "OK\n");
+        ngx_memcpy(export->current, pool[i].shm_ctx, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
 
-    config = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+        ngx_http_sla_unlock(&pool[i]);
 
-    /* сброс данных */
-    ngx_str_set(&name, "all");
+        prev   = export->previous + i * NGX_HTTP_SLA_MAX_COUNTERS_LEN;
+        primed = prev->name_len != 0;   /* счетчик all есть всегда, кроме первого снимка */
 
-    pool = config->pools.elts;
+        for (j = 0; j < NGX_HTTP_SLA_MAX_COUNTERS_LEN; j++) {
+            counter = &export->current[j];
 
-    for (i = 0; i < config->pools.nelts; i++) {
-        if (pool->shm_ctx != NULL) {
-            ngx_shmtx_lock(&pool->shm_pool->mutex);
+            if (counter->name_len == 0) {
+                break;
+            }
 
-            if (pool->generation == pool->shm_ctx->generation) {
-                ngx_memzero(pool->shm_ctx, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
-                pool->shm_ctx->generation = pool->generation;
-                ngx_http_sla_add_counter(pool, &name, 0);
+            /* слот занят другим счетчиком или счетчик обнулен (sla_purge, reset=on) - разность от нуля */
+            if (prev[j].created != counter->created
+                || prev[j].name_len != counter->name_len || ngx_strncmp(prev[j].name, counter->name, counter->name_len) != 0)
+            {
+                ngx_memzero(&prev[j], sizeof(ngx_http_sla_pool_shm_t));
             }
 
-            ngx_shmtx_unlock(&pool->shm_pool->mutex);
+            /* первый снимок только запоминается, чтобы не отправлять накопленное с момента старта */
+            if (primed) {
+                ngx_http_sla_export_counter(export, &pool[i], counter, &prev[j]);
+            }
         }
 
-        pool++;
+        ngx_memcpy(prev, export->current, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
     }
 
-    /* отправка результата */
-    r->headers_out.status           = NGX_HTTP_OK;
-    r->headers_out.content_length_n = buf->last - buf->pos;
+    if (export->overflow) {
+        ngx_log_error(NGX_LOG_WARN, export->log, 0, "sla_export buffer is too small, some values were not sent");
+    }
 
-    buf->last_buf = (r == r->main) ? 1 : 0;
+    if (export->type == SOCK_DGRAM) {
+        if (export->last != export->start) {
+            ngx_http_sla_export_send_udp(export);
+        }
+        return;
+    }
 
-    result = ngx_http_send_header(r);
-    if (result == NGX_ERROR || result > NGX_OK || r->header_only) {
-        return result;
+    if (export->items == 0) {
+        return;
     }
 
-    return ngx_http_output_filter(r, &out);
+    if (export->format == NGX_HTTP_SLA_EXPORT_ZABBIX) {
+        export->last = ngx_cpymem(export->last, "]}", 2);
+
+        len = export->last - export->start - 13;
+        for (i = 0; i < 8; i++) {
+            export->start[5 + i] = (u_char)((uint64_t)len >> (8 * i));
+        }
+    }
+
+    ngx_http_sla_export_connect(export);
 }
 
-static ngx_int_t ngx_http_sla_processor (ngx_http_request_t* r)
+static void ngx_http_sla_export_counter (ngx_http_sla_export_t* export, const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter, const ngx_http_sla_pool_shm_t* prev)
 {
-    ngx_uint_t                 i;
-    ngx_msec_int_t             ms;
-    ngx_msec_int_t             time;
-    ngx_uint_t                 status;
-    ngx_str_t*                 alias;
-    ngx_http_sla_pool_shm_t*   counter;
-    ngx_http_sla_loc_conf_t*   config;
-    ngx_http_sla_main_conf_t*  mconf;
-    ngx_http_upstream_state_t* state;
+    ngx_uint_t        i;
+    ngx_str_t         name;
+    u_char            name_buf[NGX_HTTP_SLA_MAX_NAME_LEN];
+    u_char            key[sizeof("time.avg.mov") + NGX_ATOMIC_T_LEN];
+    u_char*           end;
+    const ngx_uint_t* http;
+    const ngx_uint_t* timing;
+    const ngx_uint_t* quantile;
 
-    config = ngx_http_get_module_loc_conf(r, ngx_http_sla_module);
-    mconf = ngx_http_get_module_main_conf(r, ngx_http_sla_module);
+    /* точки и двоеточия в именах апстримов ломают ключи statsd, graphite и zabbix */
+    for (i = 0; i < counter->name_len; i++) {
+        name_buf[i] = counter->name[i];
 
-    if (config->off != 0 || config->pool == NULL || config->pool->name.len == 0) {
-	return NGX_OK;
+        if (!((name_buf[i] >= 'a' && name_buf[i] <= 'z') || (name_buf[i] >= 'A' && name_buf[i] <= 'Z') || (name_buf[i] >= '0' && name_buf[i] <= '9') || name_buf[i] == '-')) {
+            name_buf[i] = '_';
+        }
     }
 
-    if (config->pool->shm_ctx == NULL) {
-	config->pool = ngx_http_sla_get_pool(&mconf->pools, &config->pool->name);
-    }
+    name.data = name_buf;
+    name.len  = counter->name_len;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sla processor");
+    http     = pool->http.elts;
+    timing   = pool->timings.elts;
+    quantile = pool->quantiles.elts;
 
-    ngx_shmtx_lock(&config->pool->shm_pool->mutex);
+    /* коды http */
+    end = ngx_sprintf(key, "http");
+    ngx_http_sla_export_value(export, pool, &name, key, end, ngx_http_sla_delta(counter->http[pool->http.nelts - 1], prev->http[pool->http.nelts - 1]), 0);
 
-    if (config->pool->generation != config->pool->shm_ctx->generation) {
-        ngx_shmtx_unlock(&config->pool->shm_pool->mutex);
-        return NGX_OK;
+    for (i = 0; i < pool->http.nelts - 1; i++) {
+        end = ngx_sprintf(key, "http_%uA", http[i]);
+        ngx_http_sla_export_value(export, pool, &name, key, end, ngx_http_sla_delta(counter->http[i], prev->http[i]), 0);
     }
 
-    /* суммарное время ответов апстримов */
-    time = 0;
+    /* группы кодов http */
+    end = ngx_sprintf(key, "http_xxx");
+    ngx_http_sla_export_value(export, pool, &name, key, end, ngx_http_sla_delta(counter->http_xxx[5], prev->http_xxx[5]), 0);
 
-    if (r->upstream_states != NULL && r->upstream_states->nelts > 0) {
-        state = r->upstream_states->elts;
+    for (i = 0; i < 5; i++) {
+        end = ngx_sprintf(key, "http_%uAxx", i + 1);
+        ngx_http_sla_export_value(export, pool, &name, key, end, ngx_http_sla_delta(counter->http_xxx[i], prev->http_xxx[i]), 0);
+    }
 
-        for (i = 0; i < r->upstream_states->nelts; i++) {
-            if (state[i].peer == NULL || state[i].status < 100 || state[i].status > 599) {
-                continue;
-            }
+    /* тайминги */
+    for (i = 0; i < pool->timings.nelts; i++) {
+        if (timing[i] != (ngx_uint_t)-1) {
+            end = ngx_sprintf(key, "%uA", timing[i]);
+        } else {
+            end = ngx_sprintf(key, "inf");
+        }
+        ngx_http_sla_export_value(export, pool, &name, key, end, ngx_http_sla_delta(counter->timing.timings[i], prev->timing.timings[i]), 0);
+    }
 
-           #if nginx_version <= 1009000
-            ms = (ngx_msec_int_t)(state[i].response_sec * 1000 + state[i].response_msec);
-            ms = ngx_max(ms, 0);
-           #else
-            ms = (ngx_msec_int_t)(state[i].response_time);
-            ms = ngx_max(ms, 0);
-           #endif
-            time += ms;
+    /* средние и процентили - текущие значения */
+    end = ngx_sprintf(key, "time.avg");
+    ngx_http_sla_export_value(export, pool, &name, key, end, (ngx_uint_t)counter->timing.time_avg, 1);
 
-            alias = ngx_http_sla_get_alias(config->aliases, state[i].peer);
-            if (alias == NULL) {
-                alias = state[i].peer;
-            }
+    end = ngx_sprintf(key, "time.avg.mov");
+    ngx_http_sla_export_value(export, pool, &name, key, end, (ngx_uint_t)counter->timing.time_avg_mov, 1);
 
-            counter = ngx_http_sla_get_counter(config->pool, alias);
-            if (counter == NULL) {
-                ngx_shmtx_unlock(&config->pool->shm_pool->mutex);
-                return NGX_ERROR;
-            }
+    for (i = 0; i < pool->quantiles.nelts; i++) {
+        end = ngx_sprintf(key, "p%uA", quantile[i]);
+        ngx_http_sla_export_value(export, pool, &name, key, end, (ngx_uint_t)counter->timing.quantiles[i], 1);
+    }
+}
 
-            ngx_http_sla_set_http_time(config->pool, counter, ms);
-            ngx_http_sla_set_http_status(config->pool, counter, state[i].status);
-        }
+static void ngx_http_sla_export_value (ngx_http_sla_export_t* export, const ngx_http_sla_pool_t* pool, const ngx_str_t* counter, const u_char* key, const u_char* key_end, ngx_uint_t value, ngx_uint_t gauge)
+{
+    size_t  len;
+    size_t  reserve;
+    u_char* last;
+    u_char  line[4 * NGX_HTTP_SLA_MAX_NAME_LEN + 2 * NGX_ATOMIC_T_LEN + 64];
+
+    switch (export->format) {
+        case NGX_HTTP_SLA_EXPORT_GRAPHITE:
+            last = ngx_sprintf(line, "%V%V.%V.%*s %uA %T\n", &export->prefix, &pool->name, counter, key_end - key, key, value, ngx_time());
+            break;
+
+        case NGX_HTTP_SLA_EXPORT_ZABBIX:
+            last = ngx_sprintf(line, "%s{\"host\":\"%V\",\"key\":\"%V%V.%V.%*s\",\"value\":\"%uA\",\"clock\":%T}",
+                               export->items ? "," : "", &export->host, &export->prefix, &pool->name, counter, key_end - key, key, value, ngx_time());
+            break;
+
+        default:
+            last = ngx_sprintf(line, "%V%V.%V.%*s:%uA|%s\n", &export->prefix, &pool->name, counter, key_end - key, key, value, gauge ? "g" : "c");
     }
 
-    /* пул и счетчик по умолчанию */
-    if (r->err_status) {
-        status = r->err_status;
-    } else if (r->headers_out.status) {
-        status = r->headers_out.status;
-    } else {
-        status = 0;
+    len = last - line;
+
+    /* по udp данные уходят датаграммами по мере заполнения буфера */
+    if (export->type == SOCK_DGRAM && export->last + len > export->end) {
+        ngx_http_sla_export_send_udp(export);
     }
 
-    ngx_http_sla_set_http_time(config->pool, config->pool->shm_ctx, time);
-    ngx_http_sla_set_http_status(config->pool, config->pool->shm_ctx, status);
+    /* место под завершение json для zabbix */
+    reserve = export->format == NGX_HTTP_SLA_EXPORT_ZABBIX ? 2 : 0;
 
-    ngx_shmtx_unlock(&config->pool->shm_pool->mutex);
+    if (export->last + len + reserve > export->end) {
+        export->overflow = 1;
+        return;
+    }
 
-    return NGX_OK;
+    export->last = ngx_cpymem(export->last, line, len);
+    export->items++;
 }
 
-static ngx_int_t ngx_http_sla_init_zone (ngx_shm_zone_t* shm_zone, void* data)
+static ngx_uint_t ngx_http_sla_delta (ngx_uint_t current, ngx_uint_t previous)
 {
-    ngx_str_t            name;
-    ngx_http_sla_pool_t* pool;
-    ngx_http_sla_pool_t* old = NULL;
+    return current >= previous ? current - previous : current;
+}
 
-    pool = ngx_http_sla_get_pool(shm_zone->data, &shm_zone->shm.name);
+static void ngx_http_sla_export_send_udp (ngx_http_sla_export_t* export)
+{
+    ssize_t n;
 
-    if (data != NULL) {
-        old = ngx_http_sla_get_pool(data, &shm_zone->shm.name);
+    n = send(export->fd, export->start, export->last - export->start, 0);
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ERR, export->log, ngx_socket_errno, "send() to %V failed for sla_export", &export->addr->name);
     }
 
-    if (old != NULL) {
-        /* идет перезагрузка потомков, пытаемся сохранить старые данные, если пул не менялся */
-        pool->shm_pool = old->shm_pool;
-        pool->shm_ctx  = old->shm_ctx;
+    export->last = export->start;
+}
 
-        ngx_shmtx_lock(&pool->shm_pool->mutex);
-        pool->generation = pool->shm_ctx->generation;
+static void ngx_http_sla_export_connect (ngx_http_sla_export_t* export)
+{
+    ngx_int_t         rc;
+    ngx_connection_t* c;
 
-        if (ngx_http_sla_compare_pools(pool, old) == NGX_OK) {
-            /* если пул не менялся, поколение не меняется */
-            ngx_shmtx_unlock(&pool->shm_pool->mutex);
-            return NGX_OK;
-        }
-    } else {
-        /* первый запуск, аллокация shm */
-        pool->shm_pool = (ngx_slab_pool_t*)shm_zone->shm.addr;
-        pool->shm_ctx  = ngx_slab_alloc(pool->shm_pool, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
-        if (pool->shm_ctx == NULL) {
-            return NGX_ERROR;
-        }
+    ngx_memzero(&export->peer, sizeof(ngx_peer_connection_t));
 
-        ngx_shmtx_lock(&pool->shm_pool->mutex);
+    export->peer.sockaddr  = export->addr->sockaddr;
+    export->peer.socklen   = export->addr->socklen;
+    export->peer.name      = &export->addr->name;
+    export->peer.get       = ngx_event_get_peer;
+    export->peer.log       = export->log;
+    export->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&export->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, export->log, 0, "sla_export could not connect to %V", &export->addr->name);
+        export->peer.connection = NULL;
+        return;
     }
 
-    /* пул изменился или первый запуск */
-    ngx_memzero(pool->shm_ctx, sizeof(ngx_http_sla_pool_shm_t) * NGX_HTTP_SLA_MAX_COUNTERS_LEN);
+    c = export->peer.connection;
 
-    ngx_str_set(&name, "all");
-    ngx_http_sla_add_counter(pool, &name, 0);
+    c->data           = export;
+    c->write->handler = ngx_http_sla_export_write_handler;
+    c->read->handler  = ngx_http_sla_export_read_handler;
 
-    pool->generation++;
-    pool->shm_ctx->generation = pool->generation;
+    /* вся отправка должна уложиться в интервал */
+    ngx_add_timer(c->write, export->interval);
 
-    ngx_shmtx_unlock(&pool->shm_pool->mutex);
+    if (rc == NGX_AGAIN) {
+        return;
+    }
 
-    return NGX_OK;
+    ngx_http_sla_export_write_handler(c->write);
 }
 
-static ngx_int_t ngx_http_sla_push_value (ngx_conf_t* cf, const ngx_str_t* orig, ngx_int_t value, ngx_array_t* to, ngx_uint_t is_http)
+static void ngx_http_sla_export_write_handler (ngx_event_t* wev)
 {
-    ngx_uint_t* p;
-
-    if (value == NGX_ERROR || value < 1 || value > 300000 /* 5 min */) {
-        if (is_http == 0) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect timings values \"%V\" in sla_pool", orig);
-        } else {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect http values \"%V\" in sla_pool", orig);
-        }
-        return NGX_ERROR;
+    ssize_t                n;
+    ngx_connection_t*      c      = wev->data;
+    ngx_http_sla_export_t* export = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT, "sla_export to %V timed out", &export->addr->name);
+        ngx_http_sla_export_close(export);
+        return;
     }
 
-    if (is_http != 0 && (value < 100 || value > 599)) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "incorrect http values \"%V\" in sla_pool", orig);
-        return NGX_ERROR;
-    }
+    while (export->pos < export->last) {
+        n = c->send(c, export->pos, export->last - export->pos);
 
-    if (is_http == 0 && to->nelts > 0) {
-        p = to->elts;
-        if (p[to->nelts - 1] >= (ngx_uint_t)value) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "timings must be in asc order but desc or equal found in \"%V\"", orig);
-            return NGX_ERROR;
+        if (n == NGX_ERROR) {
+            ngx_http_sla_export_close(export);
+            return;
         }
-    }
 
-    p = ngx_array_push(to);
+        if (n == NGX_AGAIN || n == 0) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_sla_export_close(export);
+            }
+            return;
+        }
 
-    if (p == NULL) {
-        return NGX_ERROR;
+        export->pos += n;
     }
 
-    *p = value;
+    ngx_http_sla_export_close(export);
+}
 
-    return NGX_OK;
+static void ngx_http_sla_export_read_handler (ngx_event_t* rev)
+{
+    /* ответ получателя не анализируется, соединение закрывается после отправки */
 }
 
-static ngx_int_t ngx_http_sla_parse_list (ngx_conf_t* cf, const ngx_str_t* orig, ngx_uint_t offset, ngx_array_t* to, ngx_uint_t is_http)
+static void ngx_http_sla_export_close (ngx_http_sla_export_t* export)
 {
-    u_char*   p1;
-    u_char*   p2;
-    ngx_int_t part;
+    if (export->peer.connection != NULL) {
+        ngx_close_connection(export->peer.connection);
+        export->peer.connection = NULL;
+    }
+}
 
-    p1 = orig->data + offset;
-    p2 = p1;
+#endif
 
-    while (p2 < orig->data + orig->len) {
-        if (*p2 == ':') {
-            part = ngx_atoi(p1, p2 - p1);
+static ngx_int_t ngx_http_sla_balance_init (ngx_conf_t* cf, ngx_http_upstream_srv_conf_t* us)
+{
+    ngx_uint_t                   i;
+    ngx_uint_t*                  quantile;
+    ngx_http_sla_main_conf_t*    mconfig;
+    ngx_http_sla_balance_conf_t* config;
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-            if (ngx_http_sla_push_value(cf, orig, part, to, is_http) != NGX_OK) {
-                return NGX_ERROR;
-            }
+    us->peer.init = ngx_http_sla_balance_init_peer;
 
-            p1 = p2 + 1;
-        }
+    /* пулы могут быть описаны после upstream, поэтому поиск - после разбора конфигурации */
+    config  = ngx_http_conf_upstream_srv_conf(us, ngx_http_sla_module);
+    mconfig = ngx_http_conf_get_module_main_conf(cf, ngx_http_sla_module);
 
-        p2++;
+    config->pool = ngx_http_sla_get_pool(&mconfig->pools, &config->name);
+    if (config->pool == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pool \"%V\" not found for upstream \"%V\"", &config->name, &us->host);
+        return NGX_ERROR;
     }
 
-    if (p1 != p2) {
-        part = ngx_atoi(p1, p2 - p1);
-        if (ngx_http_sla_push_value(cf, orig, part, to, is_http) != NGX_OK) {
-            return NGX_ERROR;
-        }
-    } else {
-        ngx_http_sla_push_value(cf, orig, -1, to, is_http);
+    if (config->pool->group_by == NGX_HTTP_SLA_GROUP_UPSTREAM) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pool \"%V\" with group_by=upstream has no per-server counters for upstream \"%V\"", &config->name, &us->host);
         return NGX_ERROR;
     }
 
-    return NGX_OK;
-}
+    config->upstream    = us->host;
+    config->aliases     = &mconfig->aliases;
+    config->alias_table = mconfig->alias_table;
+    config->index       = -1;
 
-static ngx_http_sla_pool_t* ngx_http_sla_get_pool (const ngx_array_t* pools, const ngx_str_t* name)
-{
-    ngx_uint_t           i;
-    ngx_http_sla_pool_t* pool;
+    if (config->quantile == 0) {
+        return NGX_OK;
+    }
 
-    pool = pools->elts;
-    for (i = 0; i < pools->nelts; i++) {
-        if (pool->name.len == name->len && ngx_strncmp(pool->name.data, name->data, name->len) == 0) {
-            return pool;
+    quantile = config->pool->quantiles.elts;
+    for (i = 0; i < config->pool->quantiles.nelts; i++) {
+        if (quantile[i] == config->quantile) {
+            config->index = i;
+            return NGX_OK;
         }
-        pool++;
     }
 
-    return NULL;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "sla_pool \"%V\" has no %ui%% quantile for upstream \"%V\"", &config->name, config->quantile, &us->host);
+
+    return NGX_ERROR;
 }
 
-static ngx_int_t ngx_http_sla_compare_pools (const ngx_http_sla_pool_t* pool1, const ngx_http_sla_pool_t* pool2)
+static ngx_int_t ngx_http_sla_balance_init_peer (ngx_http_request_t* r, ngx_http_upstream_srv_conf_t* us)
 {
-    ngx_uint_t        i;
-    const ngx_uint_t* value1;
-    const ngx_uint_t* value2;
+    ngx_http_sla_balance_peer_data_t* bp;
 
-    if (pool1->name.len != pool2->name.len || ngx_strncmp(pool1->name.data, pool2->name.data, pool2->name.len) != 0) {
+    bp = ngx_palloc(r->pool, sizeof(ngx_http_sla_balance_peer_data_t));
+    if (bp == NULL) {
         return NGX_ERROR;
     }
 
-    if (pool1->http.nelts      != pool2->http.nelts      ||
-        pool1->timings.nelts   != pool2->timings.nelts   ||
-        pool1->quantiles.nelts != pool2->quantiles.nelts ||
-        pool1->avg_window      != pool2->avg_window) {
-        return NGX_ERROR;
-    }
+    bp->conf = ngx_http_conf_upstream_srv_conf(us, ngx_http_sla_module);
 
-    value1 = pool1->http.elts;
-    value2 = pool2->http.elts;
-    for (i = 0; i < pool1->http.nelts; i++) {
-        if (value1[i] != value2[i]) {
-            return NGX_ERROR;
-        }
-    }
+    r->upstream->peer.data = &bp->rrp;
 
-    value1 = pool1->timings.elts;
-    value2 = pool2->timings.elts;
-    for (i = 0; i < pool1->timings.nelts; i++) {
-        if (value1[i] != value2[i]) {
-            return NGX_ERROR;
-        }
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    value1 = pool1->quantiles.elts;
-    value2 = pool2->quantiles.elts;
-    for (i = 0; i < pool1->quantiles.nelts; i++) {
-        if (value1[i] != value2[i]) {
-            return NGX_ERROR;
-        }
+    bp->number  = bp->rrp.peers->number;
+    bp->metrics = ngx_palloc(r->pool, sizeof(double) * ngx_max(bp->number, 1));
+    if (bp->metrics == NULL) {
+        return NGX_ERROR;
     }
 
+    r->upstream->peer.get = ngx_http_sla_balance_get_peer;
+
     return NGX_OK;
 }
 
-static ngx_str_t* ngx_http_sla_get_alias (const ngx_array_t* aliases, const ngx_str_t* name)
+static ngx_int_t ngx_http_sla_balance_get_peer (ngx_peer_connection_t* pc, void* data)
 {
-    ngx_uint_t            i;
-    ngx_http_sla_alias_t* alias;
+    ngx_http_sla_balance_peer_data_t* bp = data;
+
+    time_t                            now;
+    uintptr_t                         m;
+    ngx_uint_t                        i, n, p, known;
+    ngx_int_t                         total, weight;
+    double                            metric, best_metric;
+    ngx_http_upstream_rr_peer_t*      peer;
+    ngx_http_upstream_rr_peer_t*      best;
+    ngx_http_upstream_rr_peers_t*     peers;
+    ngx_http_upstream_rr_peer_data_t* rrp;
+
+    rrp   = &bp->rrp;
+    peers = rrp->peers;
+
+    if (peers->single || bp->conf->pool->shm_ctx == NULL) {
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
 
-    alias = aliases->elts;
-    for (i = 0; i < aliases->nelts; i++) {
-        if (alias->name.len == name->len && ngx_strncmp(alias->name.data, name->data, name->len) == 0) {
-            return &alias->alias;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "sla balance get peer, try: %ui", pc->tries);
+
+    pc->cached     = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    /* метрики - один поиск счетчика на сервер и до захвата блокировки на запись, которую ждут все процессы;
+       лучшее из известных значений - для апстримов без данных */
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    best_metric = 0;
+    for (peer = peers->peer, i = 0; peer && i < bp->number; peer = peer->next, i++) {
+        metric = ngx_http_sla_balance_metric(bp->conf, &peer->name);
+        if (metric > 0 && (best_metric == 0 || metric < best_metric)) {
+            best_metric = metric;
         }
-        alias++;
+
+        bp->metrics[i] = metric;
     }
 
-    return NULL;
-}
+    known = i;
 
-static ngx_http_sla_pool_shm_t* ngx_http_sla_get_counter (ngx_http_sla_pool_t* pool, const ngx_str_t* name)
-{
-    ngx_uint_t               i;
-    ngx_http_sla_pool_shm_t* counter;
+    ngx_http_upstream_rr_peers_unlock(peers);
 
-    counter = pool->shm_ctx;
-    for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
-        if (counter->name_len == name->len && ngx_strncmp(counter->name, name->data, name->len) == 0) {
-            return counter;
-        } else if (counter->name_len == 0) {
-            return ngx_http_sla_add_counter(pool, name, i);
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    /* smooth weighted round robin с весом, обратно пропорциональным метрике */
+    best  = NULL;
+    total = 0;
+    p     = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t)1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
         }
-        counter++;
-    }
 
-    return NULL;
-}
+        if (peer->down) {
+            continue;
+        }
 
-static ngx_http_sla_pool_shm_t* ngx_http_sla_add_counter (ngx_http_sla_pool_t* pool, const ngx_str_t* name, ngx_uint_t hint)
-{
-    ngx_uint_t               i;
-    ngx_http_sla_pool_shm_t* result;
+        if (peer->max_fails && peer->fails >= peer->max_fails && now - peer->checked <= peer->fail_timeout) {
+            continue;
+        }
 
-    result = pool->shm_ctx;
-    for (i = hint; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
-        if (result->name_len == 0) {
-            break;
+#if nginx_version >= 1011005
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
         }
-        result++;
-    }
+#endif
 
-    if (i >= NGX_HTTP_SLA_MAX_COUNTERS_LEN) {
-        return NULL;
+        /* список мог измениться между блокировками (resolve в зоне upstream) - тогда метрика неизвестна */
+        metric = i < known ? bp->metrics[i] : 0;
+        if (metric <= 0) {
+            metric = best_metric;
+        }
+
+        weight = (ngx_int_t)(peer->effective_weight * 100 * (best_metric + 1) / (metric + 1));
+        weight = ngx_max(weight, 1);
+
+        peer->current_weight += weight;
+        total                += weight;
+
+        if (peer->effective_weight < peer->weight) {
+            peer->effective_weight++;
+        }
+
+        if (best == NULL || peer->current_weight > best->current_weight) {
+            best = peer;
+            p    = i;
+        }
     }
 
-    if (name->len >= NGX_HTTP_SLA_MAX_NAME_LEN) {
-        return NULL;
+    /* нет доступных основных апстримов - round robin перейдет к backup */
+    if (best == NULL) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
     }
 
-    ngx_memcpy(result->name, name->data, name->len);
-    result->name_len = name->len;
+    best->current_weight -= total;
 
-    return result;
-}
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
 
-static ngx_int_t ngx_http_sla_set_http_status (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t status)
-{
-    ngx_uint_t        i;
-    const ngx_uint_t* http;
+    pc->sockaddr = best->sockaddr;
+    pc->socklen  = best->socklen;
+    pc->name     = &best->name;
 
-    if (status < 100 || status > 599) {
-        return NGX_ERROR;
-    }
+    best->conns++;
 
-    /* HTTP-xxx */
-    counter->http_xxx[status / 100 - 1]++;
-    counter->http_xxx[5]++;
+    rrp->current = best;
 
-    /* HTTP */
-    http = pool->http.elts;
-    for (i = 0; i < pool->http.nelts; i++) {
-        if (*http == status) {
-            counter->http[i]++;
-            counter->http[pool->http.nelts - 1]++;
-            break;
-        }
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t)1 << p % (8 * sizeof(uintptr_t));
 
-        http++;
-    }
+    rrp->tried[n] |= m;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
 
     return NGX_OK;
 }
 
-static ngx_int_t ngx_http_sla_set_http_time (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_uint_t ms)
+static double ngx_http_sla_balance_metric (const ngx_http_sla_balance_conf_t* conf, const ngx_str_t* name)
 {
-    ngx_uint_t        i;
-    ngx_uint_t        index;
-    const ngx_uint_t* timing;
-
-    /* нулевой тайминг (статика) и тайминг меньше времени отсечки не учитывается */
-    if (ms == 0 || ms < pool->min_timing) {
-        return NGX_OK;
+    ngx_uint_t                     i;
+    ngx_str_t                      runtime;
+    ngx_str_t                      group;
+    ngx_str_t*                     alias;
+    const ngx_http_sla_pool_shm_t* counter;
+    u_char*                        p;
+    u_char                         buf[NGX_HTTP_SLA_MAX_NAME_LEN];
+    u_char                         group_buf[NGX_HTTP_SLA_MAX_NAME_LEN];
+
+    runtime.data = buf;
+
+    alias = ngx_http_sla_find_alias(conf->alias_table, conf->aliases, name, &runtime);
+    if (alias != NULL) {
+        name = alias;
     }
 
-    timing = pool->timings.elts;
+    /* group_by=upstream:peer - счетчики вида "группа/апстрим" */
+    if (conf->pool->group_by & NGX_HTTP_SLA_GROUP_UPSTREAM) {
+        if (conf->upstream.len + 1 + name->len >= NGX_HTTP_SLA_MAX_NAME_LEN) {
+            return 0;
+        }
 
-    for (i = 0; i < pool->timings.nelts; i++) {
-        if (*timing > ms) {
-            counter->timings[i]++;
+        p = ngx_cpymem(group_buf, conf->upstream.data, conf->upstream.len);
+        *p++ = '/';
+        p = ngx_cpymem(p, name->data, name->len);
+
+        group.data = group_buf;
+        group.len  = p - group_buf;
+
+        name = &group;
+    }
+
+    /* имена счетчиков меняются редко (новый апстрим, sla_purge), поэтому чтение без мьютекса
+       допустимо: в худшем случае метрика не найдется или будет неточной и лишь немного сдвинет веса */
+    counter = conf->pool->shm_ctx;
+    for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
+        if (counter->name_len == 0) {
             break;
         }
 
-        timing++;
-    }
+        if (counter->name_len == name->len && ngx_strncmp(counter->name, name->data, name->len) == 0) {
+            return conf->index < 0 ? counter->timing.time_avg_mov : counter->timing.quantiles[conf->index];
+        }
 
-    for ( ; i < pool->timings.nelts; i++) {
-        counter->timings_agg[i]++;
+        counter++;
     }
 
-    /* средние значения */
-    i = counter->timings_agg[pool->timings.nelts - 1];   /* общее количество обработанных запросов с начала работы */
+    return 0;
+}
 
-    counter->time_avg = (double)(i - 1) / (double)i * counter->time_avg + (double)ms / (double)i;
+#ifdef NGX_STREAM_SLA
 
-    if (i > pool->avg_window) {
-        counter->time_avg_mov = (double)(pool->avg_window - 1) / (double)pool->avg_window * counter->time_avg_mov + (double)ms / (double)pool->avg_window;
-    } else {
-        counter->time_avg_mov = (double)(i - 1) / (double)i * counter->time_avg_mov + (double)ms / (double)i;
-    }
+static ngx_int_t ngx_stream_sla_init (ngx_conf_t* cf)
+{
+    ngx_stream_handler_pt*       handler;
+    ngx_stream_core_main_conf_t* config;
 
-    /* квантили */
-    index = (i - 1) % NGX_HTTP_SLA_QUANTILE_M;
-    counter->quantiles_fifo[index] = ms;
+    config = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
 
-    if (index == NGX_HTTP_SLA_QUANTILE_M - 1) {
-        if (i == NGX_HTTP_SLA_QUANTILE_M) {
-            ngx_http_sla_init_quantiles(pool, counter);
-        } else {
-            ngx_http_sla_update_quantiles(pool, counter);
-        }
+    handler = ngx_array_push(&config->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (handler == NULL) {
+        return NGX_ERROR;
     }
 
+    *handler = ngx_stream_sla_processor;
+
     return NGX_OK;
 }
 
-static void ngx_http_sla_print_pool (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool)
+static void* ngx_stream_sla_create_srv_conf (ngx_conf_t* cf)
 {
-    ngx_uint_t i;
-
-    for (i = 0; i < NGX_HTTP_SLA_MAX_COUNTERS_LEN; i++) {
-        if (pool->shm_ctx[i].name_len == 0) {
-            break;
-        }
+    ngx_http_sla_loc_conf_t* config;
 
-        ngx_http_sla_print_counter(buf, pool, &pool->shm_ctx[i]);
+    config = ngx_pcalloc(cf->pool, sizeof(ngx_http_sla_loc_conf_t));
+    if (config == NULL) {
+        return NULL;
     }
+
+    return config;
 }
 
-static void ngx_http_sla_print_counter (ngx_buf_t* buf, const ngx_http_sla_pool_t* pool, const ngx_http_sla_pool_shm_t* counter)
+static char* ngx_stream_sla_merge_srv_conf (ngx_conf_t* cf, void* parent, void* child)
 {
-    ngx_uint_t        i;
-    ngx_uint_t        http_count;
-    ngx_uint_t        http_xxx_count;
-    ngx_uint_t        timings_count;
-    const ngx_uint_t* http;
-    const ngx_uint_t* timing;
-    const ngx_uint_t* quantile;
+    ngx_http_sla_main_conf_t* config;
 
-    timing         = pool->timings.elts;
-    timings_count  = counter->timings_agg[pool->timings.nelts - 1];
-    http           = pool->http.elts;
-    http_count     = counter->http[pool->http.nelts - 1];
-    http_xxx_count = counter->http_xxx[5];
-    quantile       = pool->quantiles.elts;
+    config = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_sla_module);
 
-    /* коды http */
-    buf->last = ngx_sprintf(buf->last, "%V.%s.http = %uA\n", &pool->name, counter->name, http_count);
+    return ngx_http_sla_merge_pass(cf, parent, child, config);
+}
 
-    for (i = 0; i < pool->http.nelts - 1; i++) {
-        buf->last = ngx_sprintf(buf->last, "%V.%s.http_%uA = %uA\n", &pool->name, counter->name, http[i], counter->http[i]);
+static char* ngx_stream_sla_pool (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    char*                     rv;
+    ngx_http_sla_pool_t*      pool;
+    ngx_http_sla_main_conf_t* config = conf;
+
+    rv = ngx_http_sla_pool(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
     }
 
-    /* группы кодов http */
-    buf->last = ngx_sprintf(buf->last, "%V.%s.http_xxx = %uA\n", &pool->name, counter->name, http_xxx_count);
+    pool = &((ngx_http_sla_pool_t*)config->pools.elts)[config->pools.nelts - 1];
+    pool->stream = 1;
 
-    for (i = 0; i < 5; i++) {
-        buf->last = ngx_sprintf(buf->last, "%V.%s.http_%uAxx = %uA\n", &pool->name, counter->name,  i + 1, counter->http_xxx[i]);
+    if (pool->group_by != NGX_HTTP_SLA_GROUP_PEER) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "group_by is not supported for stream sla_pool \"%V\"", &pool->name);
+        return NGX_CONF_ERROR;
     }
 
-    /* среднее */
-    buf->last = ngx_sprintf(buf->last, "%V.%s.time.avg = %uA\n", &pool->name, counter->name, (ngx_uint_t)counter->time_avg);
-    buf->last = ngx_sprintf(buf->last, "%V.%s.time.avg.mov = %uA\n", &pool->name, counter->name, (ngx_uint_t)counter->time_avg_mov);
+    if (pool->slow != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "slow is not supported for stream sla_pool \"%V\"", &pool->name);
+        return NGX_CONF_ERROR;
+    }
 
-    /* тайминги */
-    for (i = 0; i < pool->timings.nelts; i++) {
-        if (timing[i] != (ngx_uint_t)-1) {
-            buf->last = ngx_sprintf(buf->last, "%V.%s.%uA = %uA\n", &pool->name, counter->name, timing[i], counter->timings[i]);
-            buf->last = ngx_sprintf(buf->last, "%V.%s.%uA.agg = %uA\n", &pool->name, counter->name, timing[i], counter->timings_agg[i]);
-        } else {
-            buf->last = ngx_sprintf(buf->last, "%V.%s.inf = %uA\n", &pool->name, counter->name, counter->timings[i]);
-            buf->last = ngx_sprintf(buf->last, "%V.%s.inf.agg = %uA\n", &pool->name, counter->name, timings_count);
-        }
+    if (pool->retries) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "retries is not supported for stream sla_pool \"%V\"", &pool->name);
+        return NGX_CONF_ERROR;
     }
 
-    /* процентили */
-    for (i = 0; i < pool->quantiles.nelts; i++) {
-        buf->last = ngx_sprintf(buf->last, "%V.%s.%uA%% = %uA\n", &pool->name, counter->name, quantile[i], (ngx_uint_t)counter->quantiles[i]);
+    if (pool->clients) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "clients is not supported for stream sla_pool \"%V\"", &pool->name);
+        return NGX_CONF_ERROR;
     }
+
+    return NGX_CONF_OK;
 }
 
-static int ngx_libc_cdecl ngx_http_sla_compare_uint (const void* p1, const void* p2)
+static char* ngx_stream_sla_pass (ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
-    ngx_uint_t one = *((ngx_uint_t*)p1);
-    ngx_uint_t two = *((ngx_uint_t*)p2);
+    ngx_http_sla_main_conf_t* mconfig;
 
-    if (one == two) {
-        return 0;
-    }
+    mconfig = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_sla_module);
 
-    return one > two ? 1 : -1;
+    return ngx_http_sla_parse_pass(cf, conf, mconfig, 1);
 }
 
-static void ngx_http_sla_init_quantiles (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter)
+static ngx_int_t ngx_stream_sla_processor (ngx_stream_session_t* s)
 {
-    double            r;
-    ngx_uint_t        i;
-    ngx_uint_t        j;
-    ngx_uint_t        quantile_diff[NGX_HTTP_SLA_MAX_QUANTILES_LEN];
-    const ngx_uint_t* quantile;
+    ngx_uint_t                i;
+    ngx_msec_int_t            ms;
+    ngx_time_t*               tp;
+    ngx_http_sla_pool_t**     pools;
+    ngx_http_sla_loc_conf_t*  config;
+    ngx_http_sla_main_conf_t* mconf;
 
-    /* 1. Set the initial estimate S equal to the q-th sample quantile */
-    ngx_qsort(counter->quantiles_fifo, NGX_HTTP_SLA_QUANTILE_M, sizeof(ngx_uint_t), ngx_http_sla_compare_uint);
+    config = ngx_stream_get_module_srv_conf(s, ngx_stream_sla_module);
+    mconf  = ngx_stream_get_module_main_conf(s, ngx_stream_sla_module);
 
-    quantile = pool->quantiles.elts;
-    for (i = 0; i < pool->quantiles.nelts; i++) {
-        counter->quantiles[i] = counter->quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M * quantile[i] / 100];
+    if (config->off != 0 || config->pools == NULL || config->pools->nelts == 0) {
+        return NGX_OK;
     }
 
-    /* 2.1. Estimate the scale r by the difference of the 75 and 25 sample quantiles */
-    r = ngx_max(
-        (double)0.001,
-        (double)(
-            counter->quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M * 75 / 100] -
-            counter->quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M * 25 / 100]
-        )
-    );
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0, "stream sla processor");
 
-    /* 2.2. Than take c */
-    counter->quantiles_c = 0;
-    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
-        counter->quantiles_c += (double)1 / sqrt(i + 1);
-    }
+    /* длительность сессии */
+    tp = ngx_timeofday();
 
-    counter->quantiles_c = r / (double)NGX_HTTP_SLA_QUANTILE_M * counter->quantiles_c;
+    ms = (ngx_msec_int_t)((tp->sec - s->start_sec) * 1000 + (tp->msec - s->start_msec));
+    ms = ngx_max(ms, 0);
 
-    /* 3. Take f */
-    ngx_memzero(quantile_diff, sizeof(ngx_uint_t) * NGX_HTTP_SLA_MAX_QUANTILES_LEN);
+    /* мьютексы пулов захватываются по одному в порядке конфигурации */
+    pools = config->pools->elts;
 
-    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
-        for (j = 0; j < pool->quantiles.nelts; j++) {
-            if (abs((double)counter->quantiles_fifo[i] - counter->quantiles[j]) <= counter->quantiles_c) {
-                quantile_diff[j]++;
-            }
+    for (i = 0; i < config->pools->nelts; i++) {
+        if (pools[i]->shm_ctx == NULL) {
+            pools[i] = ngx_http_sla_get_pool(&mconf->pools, &pools[i]->name);
         }
-    }
 
-    for (i = 0; i < pool->quantiles.nelts; i++) {
-        counter->quantiles_f[i] = (double)1 / ((double)2 * counter->quantiles_c * (double)NGX_HTTP_SLA_QUANTILE_M) * (double)ngx_max(1, quantile_diff[i]);
+        ngx_stream_sla_record(pools[i], s, config->aliases, ms);
     }
+
+    return NGX_OK;
 }
 
-static void ngx_http_sla_update_quantiles (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter)
+static void ngx_stream_sla_record (ngx_http_sla_pool_t* pool, ngx_stream_session_t* s, const ngx_array_t* aliases, ngx_msec_int_t ms)
 {
-    double            r;
-    ngx_uint_t        i;
-    ngx_uint_t        j;
-    ngx_uint_t        quantile_25;
-    ngx_uint_t        quantile_75;
-    ngx_uint_t        quantile_diff[NGX_HTTP_SLA_MAX_QUANTILES_LEN];
-    ngx_uint_t        quantile_less[NGX_HTTP_SLA_MAX_QUANTILES_LEN];
-    const ngx_uint_t* quantile;
+    ngx_uint_t                   i;
+    ngx_uint_t                   status;
+    ngx_str_t*                   alias;
+    ngx_http_sla_pool_shm_t*     counter;
+    ngx_stream_upstream_state_t* state;
+
+    ngx_http_sla_lock(pool);
+
+    if (pool->generation != pool->shm_ctx->generation) {
+        pool->stats_local->drop_generation++;
+        ngx_http_sla_unlock(pool);
+        return;
+    }
+
+    state = NULL;
+
+    if (s->upstream_states != NULL && s->upstream_states->nelts > 0) {
+        state = s->upstream_states->elts;
 
-    /* 1 and 2. Updating */
-    ngx_memzero(quantile_diff, sizeof(ngx_uint_t) * NGX_HTTP_SLA_MAX_QUANTILES_LEN);
-    ngx_memzero(quantile_less, sizeof(ngx_uint_t) * NGX_HTTP_SLA_MAX_QUANTILES_LEN);
+        for (i = 0; i < s->upstream_states->nelts; i++) {
+            if (state[i].peer == NULL) {
+                continue;
+            }
 
-    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
-        for (j = 0; j < pool->quantiles.nelts; j++) {
-            if ((double)counter->quantiles_fifo[i] <= counter->quantiles[j]) {
-                quantile_less[j]++;
+            alias = ngx_http_sla_get_alias(aliases, state[i].peer);
+            if (alias == NULL) {
+                alias = state[i].peer;
             }
-            if (abs((double)counter->quantiles_fifo[i] - counter->quantiles[j]) <= counter->quantiles_c) {
-                quantile_diff[j]++;
+
+            counter = ngx_http_sla_get_counter(pool, alias);
+            if (counter == NULL) {
+                pool->stats_local->drop_counter++;
+                continue;
             }
+
+            /* все попытки, кроме последней, завершились ошибкой соединения */
+            status = (i == s->upstream_states->nelts - 1) ? s->status : NGX_STREAM_BAD_GATEWAY;
+
+            ngx_http_sla_set_http_time(pool, counter, state[i].response_time, status);
+            ngx_http_sla_set_http_status(pool, counter, status);
+            ngx_http_sla_set_rates(&counter->rates, status, state[i].response_time);
+            ngx_stream_sla_set_state(pool, counter, state[i].connect_time, state[i].first_byte_time, state[i].bytes_sent, state[i].bytes_received);
+            ngx_http_sla_touch_counter(pool, counter);
         }
-    }
 
-    quantile = pool->quantiles.elts;
-    for (i = 0; i < pool->quantiles.nelts; i++) {
-        counter->quantiles[i]   = counter->quantiles[i] + NGX_HTTP_SLA_QUANTILE_W / counter->quantiles_f[i] * ((double)quantile[i] / (double)100 - (double)quantile_less[i] / (double)NGX_HTTP_SLA_QUANTILE_M);
-        counter->quantiles_f[i] = ((double)1 - NGX_HTTP_SLA_QUANTILE_W) * counter->quantiles_f[i] + NGX_HTTP_SLA_QUANTILE_W / ((double)2 * counter->quantiles_c * (double)NGX_HTTP_SLA_QUANTILE_M) * (double)quantile_diff[i];
+        state = &state[s->upstream_states->nelts - 1];
     }
 
-    // may be used uninitialized in this function warning
-    quantile_25 = 0;
-    quantile_75 = 0;
+    /* счетчик по умолчанию - сессия целиком */
+    ngx_http_sla_set_http_time(pool, pool->shm_ctx, ms, s->status);
+    ngx_http_sla_set_http_status(pool, pool->shm_ctx, s->status);
+    ngx_http_sla_set_rates(&pool->shm_ctx->rates, s->status, ms);
+    ngx_stream_sla_set_state(pool, pool->shm_ctx,
+                             state != NULL ? state->connect_time : (ngx_msec_t)-1,
+                             state != NULL ? state->first_byte_time : (ngx_msec_t)-1,
+                             s->connection->sent, s->received);
+    ngx_http_sla_touch_counter(pool, pool->shm_ctx);
+
+    ngx_http_sla_flush_stats(pool, 0);
+    ngx_http_sla_unlock(pool);
+}
 
-    /* 3.1. Take r to be the difference of the current EWSA estimates for the 75 and 25 quantiles */
-    for (i = 0; i < pool->quantiles.nelts; i++) {
-        if (quantile[i] == 25) {
-            quantile_25 = counter->quantiles[i];
-        } else if (quantile[i] == 75) {
-            quantile_75 = counter->quantiles[i];
-            break;
-        }
+static void ngx_stream_sla_set_state (const ngx_http_sla_pool_t* pool, ngx_http_sla_pool_shm_t* counter, ngx_msec_t connect, ngx_msec_t first_byte, off_t sent, off_t received)
+{
+    /* (ngx_msec_t)-1 - соединение не установлено или ответа не было */
+    if (connect != (ngx_msec_t)-1) {
+        ngx_http_sla_set_avg_mov(pool, &counter->connect_avg_mov, &counter->connect_count, connect);
     }
 
-    r = ngx_max((double)0.001, (double)(quantile_75 - quantile_25));
+    if (first_byte != (ngx_msec_t)-1) {
+        ngx_http_sla_set_avg_mov(pool, &counter->first_byte_avg_mov, &counter->first_byte_count, first_byte);
+    }
 
-    /* 3.2. Take c to the next M observations */
-    counter->quantiles_c = r * ngx_http_sla_quantile_cc;
+    counter->bytes_sent     += ngx_max(sent, 0);
+    counter->bytes_received += ngx_max(received, 0);
 }
+
+#endif
@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Двоичный формат вывода sla_status format=binary (общий для модуля и sla_merge)
+ *
+ * Все числа - беззнаковые, в сетевом порядке байт:
+ *
+ *   dump    := magic[4] version:u16 pools:u16 pool*
+ *   pool    := name timings:u16 timing:u32* http:u16 status:u32* quantiles:u16 quantile:u16* counters:u16 counter*
+ *   counter := name http:u64* http_xxx:u64[6] timings:u64* samples:u64 time_sum:u64
+ *   name    := len:u16 byte*
+ *
+ * Последний тайминг и последний статус - NGX_HTTP_SLA_BINARY_INF ("бесконечный" интервал
+ * и общее количество ответов). Счетчики дампов с одинаковыми пулами складываются поэлементно.
+ */
+
+#ifndef _NGX_HTTP_SLA_BINARY_H_INCLUDED_
+#define _NGX_HTTP_SLA_BINARY_H_INCLUDED_
+
+#include <stdint.h>
+
+#define NGX_HTTP_SLA_BINARY_MAGIC   "NSLA"
+#define NGX_HTTP_SLA_BINARY_VERSION 1
+#define NGX_HTTP_SLA_BINARY_INF     0xffffffff
+
+static inline unsigned char* ngx_http_sla_binary_put16 (unsigned char* p, uint16_t value)
+{
+    p[0] = (unsigned char)(value >> 8);
+    p[1] = (unsigned char)value;
+
+    return p + 2;
+}
+
+static inline unsigned char* ngx_http_sla_binary_put32 (unsigned char* p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+
+    return p + 4;
+}
+
+static inline unsigned char* ngx_http_sla_binary_put64 (unsigned char* p, uint64_t value)
+{
+    p = ngx_http_sla_binary_put32(p, (uint32_t)(value >> 32));
+
+    return ngx_http_sla_binary_put32(p, (uint32_t)value);
+}
+
+static inline uint16_t ngx_http_sla_binary_get16 (const unsigned char* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t ngx_http_sla_binary_get32 (const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t ngx_http_sla_binary_get64 (const unsigned char* p)
+{
+    return ((uint64_t)ngx_http_sla_binary_get32(p) << 32) | ngx_http_sla_binary_get32(p + 4);
+}
+
+#endif
@@ -0,0 +1,314 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Ядро агрегации: распределение времени ответов по интервалам, средние и квантили EWSA,
+ * учет статусов HTTP (общее для модуля и утилит, не зависит от nginx)
+ *
+ * Состояние серии (ngx_http_sla_timing_t) хранится в shm модуля как есть, поэтому типы полей
+ * совпадают с ngx_uint_t nginx (uintptr_t). Синхронизация - на стороне вызывающего.
+ */
+
+#ifndef _NGX_HTTP_SLA_ENGINE_H_INCLUDED_
+#define _NGX_HTTP_SLA_ENGINE_H_INCLUDED_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/**
+ * Максимальное количество отслеживаемых таймингов (минус 1 для "бесконечности")
+ */
+#ifndef NGX_HTTP_SLA_MAX_TIMINGS_LEN
+    #define NGX_HTTP_SLA_MAX_TIMINGS_LEN 32
+#endif
+
+#if NGX_HTTP_SLA_MAX_TIMINGS_LEN < 4
+    #error "NGX_HTTP_SLA_MAX_TIMINGS_LEN must be at least 4"
+#endif
+
+/**
+ * Максимальное число вычисляемых квантилей (минус 2 для 25% и 75%)
+ * На данный момент список квантилей не конфигурируется (их 7)
+ */
+#ifndef NGX_HTTP_SLA_MAX_QUANTILES_LEN
+    #define NGX_HTTP_SLA_MAX_QUANTILES_LEN 7
+#endif
+
+#if NGX_HTTP_SLA_MAX_QUANTILES_LEN != 7
+    #error "NGX_HTTP_SLA_MAX_QUANTILES_LEN must be 7"
+#endif
+
+/**
+ * Размер FIFO буфера для вычисления квантилей
+ */
+#ifndef NGX_HTTP_SLA_QUANTILE_M
+    #define NGX_HTTP_SLA_QUANTILE_M 100
+#endif
+
+#if NGX_HTTP_SLA_QUANTILE_M < 10
+    #error "NGX_HTTP_SLA_QUANTILE_M must be at least 10"
+#endif
+
+/**
+ * Весовой коэффициент обновления вычисляемых квантилей
+ */
+#ifndef NGX_HTTP_SLA_QUANTILE_W
+    #define NGX_HTTP_SLA_QUANTILE_W 0.01
+#endif
+
+/**
+ * Параметры пула для ядра (указывают на списки пула, последний тайминг и статус - (uintptr_t)-1)
+ */
+typedef struct {
+    const uintptr_t* timings;         /** Тайминги                                 */
+    size_t           timings_len;     /** Количество таймингов                     */
+    const uintptr_t* quantiles;       /** Квантили                                 */
+    size_t           quantiles_len;   /** Количество квантилей                     */
+    const uintptr_t* http;            /** Статусы HTTP                             */
+    size_t           http_len;        /** Количество статусов                      */
+    uintptr_t        avg_window;      /** Окно скользящего среднего                */
+    double           quantile_cc;     /** Средний вес шага EWSA (engine_init)      */
+} ngx_http_sla_engine_t;
+
+/**
+ * Распределение времени ответов
+ */
+typedef struct {
+    uintptr_t timings[NGX_HTTP_SLA_MAX_TIMINGS_LEN];          /** Количество ответов в интервале времени  */
+    uintptr_t timings_agg[NGX_HTTP_SLA_MAX_TIMINGS_LEN];      /** Количество ответов до интервала времени */
+    double    quantiles[NGX_HTTP_SLA_MAX_QUANTILES_LEN];      /** Значения квантилей                      */
+    double    time_avg;                                       /** Среднее время ответа                    */
+    double    time_avg_mov;                                   /** Скользящее среднее время ответа         */
+    uintptr_t time_sum;                                       /** Суммарное время ответов                 */
+    uintptr_t quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M];        /** FIFO для вычисления квантилей           */
+    double    quantiles_f[NGX_HTTP_SLA_MAX_QUANTILES_LEN];    /** f-оценки плотности распределения        */
+    double    quantiles_c;                                    /** Коэффициент для вычисления оценок f     */
+} ngx_http_sla_timing_t;
+
+static inline void ngx_http_sla_engine_init (ngx_http_sla_engine_t* engine)
+{
+    size_t i;
+
+    /* EWSA: Calculate average updating weight for next step */
+    engine->quantile_cc = 0;
+    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
+        engine->quantile_cc += (double)1 / sqrt(NGX_HTTP_SLA_QUANTILE_M + i + 1);
+    }
+}
+
+/**
+ * Учет статуса: группы 1xx-5xx и общее количество (http_xxx[6]), отслеживаемые статусы и их сумма (http)
+ */
+static inline int ngx_http_sla_engine_add_status (const ngx_http_sla_engine_t* engine, uintptr_t* http, uintptr_t* http_xxx, uintptr_t status)
+{
+    size_t i;
+
+    if (status < 100 || status > 599) {
+        return -1;
+    }
+
+    /* HTTP-xxx */
+    http_xxx[status / 100 - 1]++;
+    http_xxx[5]++;
+
+    /* HTTP */
+    for (i = 0; i < engine->http_len; i++) {
+        if (engine->http[i] == status) {
+            http[i]++;
+            http[engine->http_len - 1]++;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Учет времени ответа, 1 - FIFO заполнен и требуется ngx_http_sla_engine_quantiles()
+ */
+static inline int ngx_http_sla_engine_add_timing (const ngx_http_sla_engine_t* engine, ngx_http_sla_timing_t* series, uintptr_t ms)
+{
+    size_t    i;
+    uintptr_t n;
+
+    for (i = 0; i < engine->timings_len; i++) {
+        if (engine->timings[i] > ms) {
+            series->timings[i]++;
+            break;
+        }
+    }
+
+    for ( ; i < engine->timings_len; i++) {
+        series->timings_agg[i]++;
+    }
+
+    /* средние значения */
+    n = series->timings_agg[engine->timings_len - 1];   /* общее количество обработанных запросов с начала работы */
+
+    series->time_sum += ms;
+
+    series->time_avg = (double)(n - 1) / (double)n * series->time_avg + (double)ms / (double)n;
+
+    if (n > engine->avg_window) {
+        series->time_avg_mov = (double)(engine->avg_window - 1) / (double)engine->avg_window * series->time_avg_mov + (double)ms / (double)engine->avg_window;
+    } else {
+        series->time_avg_mov = (double)(n - 1) / (double)n * series->time_avg_mov + (double)ms / (double)n;
+    }
+
+    /* квантили */
+    series->quantiles_fifo[(n - 1) % NGX_HTTP_SLA_QUANTILE_M] = ms;
+
+    return (n - 1) % NGX_HTTP_SLA_QUANTILE_M == NGX_HTTP_SLA_QUANTILE_M - 1;
+}
+
+static inline int ngx_http_sla_engine_compare (const void* p1, const void* p2)
+{
+    uintptr_t one = *(const uintptr_t*)p1;
+    uintptr_t two = *(const uintptr_t*)p2;
+
+    if (one == two) {
+        return 0;
+    }
+
+    return one > two ? 1 : -1;
+}
+
+static inline void ngx_http_sla_engine_init_quantiles (const ngx_http_sla_engine_t* engine, ngx_http_sla_timing_t* series)
+{
+    double    r;
+    size_t    i;
+    size_t    j;
+    uintptr_t quantile_diff[NGX_HTTP_SLA_MAX_QUANTILES_LEN];
+
+    /* 1. Set the initial estimate S equal to the q-th sample quantile */
+    qsort(series->quantiles_fifo, NGX_HTTP_SLA_QUANTILE_M, sizeof(uintptr_t), ngx_http_sla_engine_compare);
+
+    for (i = 0; i < engine->quantiles_len; i++) {
+        series->quantiles[i] = series->quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M * engine->quantiles[i] / 100];
+    }
+
+    /* 2.1. Estimate the scale r by the difference of the 75 and 25 sample quantiles */
+    r = (double)(
+        series->quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M * 75 / 100] -
+        series->quantiles_fifo[NGX_HTTP_SLA_QUANTILE_M * 25 / 100]
+    );
+
+    r = r > (double)0.001 ? r : (double)0.001;
+
+    /* 2.2. Than take c */
+    series->quantiles_c = 0;
+    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
+        series->quantiles_c += (double)1 / sqrt(i + 1);
+    }
+
+    series->quantiles_c = r / (double)NGX_HTTP_SLA_QUANTILE_M * series->quantiles_c;
+
+    /* 3. Take f */
+    memset(quantile_diff, 0, sizeof(uintptr_t) * NGX_HTTP_SLA_MAX_QUANTILES_LEN);
+
+    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
+        for (j = 0; j < engine->quantiles_len; j++) {
+            if (abs((int)((double)series->quantiles_fifo[i] - series->quantiles[j])) <= series->quantiles_c) {
+                quantile_diff[j]++;
+            }
+        }
+    }
+
+    for (i = 0; i < engine->quantiles_len; i++) {
+        series->quantiles_f[i] = (double)1 / ((double)2 * series->quantiles_c * (double)NGX_HTTP_SLA_QUANTILE_M) * (double)(quantile_diff[i] > 1 ? quantile_diff[i] : 1);
+    }
+}
+
+static inline void ngx_http_sla_engine_update_quantiles (const ngx_http_sla_engine_t* engine, ngx_http_sla_timing_t* series)
+{
+    double    r;
+    size_t    i;
+    size_t    j;
+    uintptr_t quantile_25;
+    uintptr_t quantile_75;
+    uintptr_t quantile_diff[NGX_HTTP_SLA_MAX_QUANTILES_LEN];
+    uintptr_t quantile_less[NGX_HTTP_SLA_MAX_QUANTILES_LEN];
+
+    /* 1 and 2. Updating */
+    memset(quantile_diff, 0, sizeof(uintptr_t) * NGX_HTTP_SLA_MAX_QUANTILES_LEN);
+    memset(quantile_less, 0, sizeof(uintptr_t) * NGX_HTTP_SLA_MAX_QUANTILES_LEN);
+
+    for (i = 0; i < NGX_HTTP_SLA_QUANTILE_M; i++) {
+        for (j = 0; j < engine->quantiles_len; j++) {
+            if ((double)series->quantiles_fifo[i] <= series->quantiles[j]) {
+                quantile_less[j]++;
+            }
+            if (abs((int)((double)series->quantiles_fifo[i] - series->quantiles[j])) <= series->quantiles_c) {
+                quantile_diff[j]++;
+            }
+        }
+    }
+
+    for (i = 0; i < engine->quantiles_len; i++) {
+        series->quantiles[i]   = series->quantiles[i] + NGX_HTTP_SLA_QUANTILE_W / series->quantiles_f[i] * ((double)engine->quantiles[i] / (double)100 - (double)quantile_less[i] / (double)NGX_HTTP_SLA_QUANTILE_M);
+        series->quantiles_f[i] = ((double)1 - NGX_HTTP_SLA_QUANTILE_W) * series->quantiles_f[i] + NGX_HTTP_SLA_QUANTILE_W / ((double)2 * series->quantiles_c * (double)NGX_HTTP_SLA_QUANTILE_M) * (double)quantile_diff[i];
+    }
+
+    // may be used uninitialized in this function warning
+    quantile_25 = 0;
+    quantile_75 = 0;
+
+    /* 3.1. Take r to be the difference of the current EWSA estimates for the 75 and 25 quantiles */
+    for (i = 0; i < engine->quantiles_len; i++) {
+        if (engine->quantiles[i] == 25) {
+            quantile_25 = series->quantiles[i];
+        } else if (engine->quantiles[i] == 75) {
+            quantile_75 = series->quantiles[i];
+            break;
+        }
+    }
+
+    r = (double)(quantile_75 - quantile_25);
+    r = r > (double)0.001 ? r : (double)0.001;
+
+    /* 3.2. Take c to the next M observations */
+    series->quantiles_c = r * engine->quantile_cc;
+}
+
+/**
+ * Шаг EWSA по заполненному FIFO: первая оценка по выборочным квантилям или обновление
+ */
+static inline void ngx_http_sla_engine_quantiles (const ngx_http_sla_engine_t* engine, ngx_http_sla_timing_t* series)
+{
+    if (series->timings_agg[engine->timings_len - 1] == NGX_HTTP_SLA_QUANTILE_M) {
+        ngx_http_sla_engine_init_quantiles(engine, series);
+    } else {
+        ngx_http_sla_engine_update_quantiles(engine, series);
+    }
+}
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Кольцевой буфер событий sla_events (общий для модуля и внешних читателей)
+ *
+ * Файл отображается в память (MAP_SHARED) всеми рабочими процессами, числа - в порядке байт
+ * узла. Файл состоит из заголовка и capacity записей по NGX_HTTP_SLA_EVENTS_RECORD_SIZE байт,
+ * запись с номером n находится в ячейке n % capacity.
+ *
+ * Писатель атомарно увеличивает head, обнуляет seq ячейки, заполняет запись и последней
+ * записывает seq = n + 1. Читатель для записи n читает seq, копирует запись и снова читает
+ * seq: запись корректна, если оба значения равны n + 1. Если head - n > capacity, запись
+ * уже перезаписана и читатель отстал.
+ *
+ * Проверка не защищает от писателя, которого обогнали на целый круг: если процесс получил номер n
+ * и остановился посреди записи, а другой уже заполнил ту же ячейку для n + capacity, продолжение
+ * первого портит ее поля, пока seq = n + capacity + 1, и читатель примет смешанную запись.
+ * Для этого буфер должен переполниться за время одной записи, поэтому размер выбирается
+ * с запасом к пиковому потоку событий.
+ *
+ * При изменении размера nginx пересоздает файл, поэтому читателю, который ждет новых событий,
+ * следует сверять inode и размер файла по пути с отображенным и отображать файл заново.
+ */
+
+#ifndef _NGX_HTTP_SLA_EVENTS_H_INCLUDED_
+#define _NGX_HTTP_SLA_EVENTS_H_INCLUDED_
+
+#include <stdint.h>
+
+#define NGX_HTTP_SLA_EVENTS_MAGIC       "NSLE"
+#define NGX_HTTP_SLA_EVENTS_VERSION     1
+#define NGX_HTTP_SLA_EVENTS_RECORD_SIZE 128
+#define NGX_HTTP_SLA_EVENTS_POOL_LEN    32
+#define NGX_HTTP_SLA_EVENTS_COUNTER_LEN 64
+
+/**
+ * Заголовок файла (занимает одну запись)
+ */
+typedef struct {
+    char              magic[4];       /** NGX_HTTP_SLA_EVENTS_MAGIC, записывается последним */
+    uint32_t          version;        /** Версия формата                                    */
+    uint32_t          record_size;    /** Размер записи                                     */
+    uint32_t          reserved;       /** Не используется                                   */
+    uint64_t          capacity;       /** Количество записей                                */
+    volatile uint64_t head;           /** Количество записанных событий                     */
+    unsigned char     padding[96];    /** Выравнивание до размера записи                    */
+} ngx_http_sla_events_header_t;
+
+/**
+ * Событие - ответ апстрима (счетчик - имя апстрима) или запрос в целом (счетчик "all")
+ */
+typedef struct {
+    volatile uint64_t seq;                                       /** Номер записи + 1, 0 - запись не завершена */
+    uint64_t          msec;                                      /** Время записи в мс от начала эпохи         */
+    uint32_t          time;                                      /** Время ответа, мс                          */
+    uint32_t          request;                                   /** Полное время обработки запроса, мс        */
+    uint16_t          status;                                    /** Статус ответа                             */
+    uint8_t           pool_len;                                  /** Длина имени пула                          */
+    uint8_t           counter_len;                               /** Длина имени счетчика                      */
+    uint32_t          reserved;                                  /** Не используется                           */
+    char              pool[NGX_HTTP_SLA_EVENTS_POOL_LEN];        /** Имя пула (усекается)                      */
+    char              counter[NGX_HTTP_SLA_EVENTS_COUNTER_LEN];  /** Имя счетчика (усекается)                  */
+} ngx_http_sla_event_t;
+
+#endif
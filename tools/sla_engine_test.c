@@ -0,0 +1,256 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Проверки ядра агрегации ngx_http_sla_engine.h
+ *
+ * Сборка: cc -O2 -I. -o sla_engine_test tools/sla_engine_test.c -lm
+ * Запуск: sla_engine_test (код возврата 1 при ошибке)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "ngx_http_sla_engine.h"
+
+#define SLA_CHECK(expr) sla_check((expr), #expr, __FILE__, __LINE__)
+
+
+static int       failed   = 0;
+static int       checked  = 0;
+static uintptr_t timings[] = { 300, 500, 2000, (uintptr_t)-1 };
+static uintptr_t quantiles[NGX_HTTP_SLA_MAX_QUANTILES_LEN] = { 25, 50, 75, 90, 95, 98, 99 };
+static uintptr_t http[] = { 200, 404, 502, (uintptr_t)-1 };
+
+
+static void sla_check (int ok, const char* expr, const char* file, int line)
+{
+    checked++;
+
+    if (!ok) {
+        failed++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+    }
+}
+
+static void sla_engine (ngx_http_sla_engine_t* engine, uintptr_t avg_window)
+{
+    memset(engine, 0, sizeof(ngx_http_sla_engine_t));
+
+    engine->timings       = timings;
+    engine->timings_len   = sizeof(timings) / sizeof(timings[0]);
+    engine->quantiles     = quantiles;
+    engine->quantiles_len = NGX_HTTP_SLA_MAX_QUANTILES_LEN;
+    engine->http          = http;
+    engine->http_len      = sizeof(http) / sizeof(http[0]);
+    engine->avg_window    = avg_window;
+
+    ngx_http_sla_engine_init(engine);
+}
+
+static void sla_add (const ngx_http_sla_engine_t* engine, ngx_http_sla_timing_t* series, uintptr_t ms)
+{
+    if (ngx_http_sla_engine_add_timing(engine, series, ms)) {
+        ngx_http_sla_engine_quantiles(engine, series);
+    }
+}
+
+/**
+ * Интервал - [предыдущий тайминг, тайминг), граница относится к следующему интервалу
+ */
+static void sla_test_buckets (void)
+{
+    ngx_http_sla_engine_t engine;
+    ngx_http_sla_timing_t series;
+
+    sla_engine(&engine, 1600);
+    memset(&series, 0, sizeof(series));
+
+    sla_add(&engine, &series, 1);
+    sla_add(&engine, &series, 299);
+    sla_add(&engine, &series, 300);
+    sla_add(&engine, &series, 499);
+    sla_add(&engine, &series, 500);
+    sla_add(&engine, &series, 1999);
+    sla_add(&engine, &series, 2000);
+    sla_add(&engine, &series, 100000);
+
+    SLA_CHECK(series.timings[0] == 2);
+    SLA_CHECK(series.timings[1] == 2);
+    SLA_CHECK(series.timings[2] == 2);
+    SLA_CHECK(series.timings[3] == 2);
+
+    SLA_CHECK(series.timings_agg[0] == 2);
+    SLA_CHECK(series.timings_agg[1] == 4);
+    SLA_CHECK(series.timings_agg[2] == 6);
+    SLA_CHECK(series.timings_agg[3] == 8);
+
+    SLA_CHECK(series.time_sum == 1 + 299 + 300 + 499 + 500 + 1999 + 2000 + 100000);
+}
+
+/**
+ * Среднее - точное, скользящее до заполнения окна совпадает со средним, затем экспоненциальное
+ */
+static void sla_test_averages (void)
+{
+    uintptr_t             i;
+    double                mov;
+    ngx_http_sla_engine_t engine;
+    ngx_http_sla_timing_t series;
+
+    sla_engine(&engine, 4);
+    memset(&series, 0, sizeof(series));
+
+    sla_add(&engine, &series, 10);
+    sla_add(&engine, &series, 20);
+    sla_add(&engine, &series, 30);
+    sla_add(&engine, &series, 40);
+
+    SLA_CHECK(fabs(series.time_avg - 25) < 1e-9);
+    SLA_CHECK(fabs(series.time_avg_mov - 25) < 1e-9);
+
+    sla_add(&engine, &series, 100);
+
+    mov = 25.0 * 3 / 4 + 100.0 / 4;
+
+    SLA_CHECK(fabs(series.time_avg - 40) < 1e-9);
+    SLA_CHECK(fabs(series.time_avg_mov - mov) < 1e-9);
+
+    /* после смены уровня скользящее среднее сходится к новому значению, общее - нет */
+    for (i = 0; i < 100; i++) {
+        sla_add(&engine, &series, 1000);
+    }
+
+    SLA_CHECK(fabs(series.time_avg_mov - 1000) < 1);
+    SLA_CHECK(series.time_avg < 1000 * 0.99);
+}
+
+/**
+ * Равномерное распределение 1..1000: квантиль q% - около 10 * q
+ */
+static void sla_test_ewsa_uniform (void)
+{
+    size_t                i;
+    uint64_t              seed;
+    ngx_http_sla_engine_t engine;
+    ngx_http_sla_timing_t series;
+
+    sla_engine(&engine, 1600);
+    memset(&series, 0, sizeof(series));
+
+    seed = 1;
+
+    for (i = 0; i < 200000; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        sla_add(&engine, &series, 1 + (uintptr_t)((seed >> 33) % 1000));
+    }
+
+    for (i = 0; i < engine.quantiles_len; i++) {
+        SLA_CHECK(fabs(series.quantiles[i] - (double)quantiles[i] * 10) < 30);
+    }
+
+    /* оценки упорядочены */
+    for (i = 1; i < engine.quantiles_len; i++) {
+        SLA_CHECK(series.quantiles[i] >= series.quantiles[i - 1]);
+    }
+}
+
+/**
+ * Первая оценка - выборочные квантили первых M значений
+ */
+static void sla_test_ewsa_init (void)
+{
+    size_t                i;
+    ngx_http_sla_engine_t engine;
+    ngx_http_sla_timing_t series;
+
+    sla_engine(&engine, 1600);
+    memset(&series, 0, sizeof(series));
+
+    /* в обратном порядке, чтобы проверить сортировку */
+    for (i = NGX_HTTP_SLA_QUANTILE_M; i > 0; i--) {
+        sla_add(&engine, &series, i);
+    }
+
+    for (i = 0; i < engine.quantiles_len; i++) {
+        SLA_CHECK(series.quantiles[i] == (double)(NGX_HTTP_SLA_QUANTILE_M * quantiles[i] / 100 + 1));
+    }
+}
+
+/**
+ * Статусы: группы 1xx-5xx и общее количество, отслеживаемые коды и их сумма
+ */
+static void sla_test_status (void)
+{
+    ngx_http_sla_engine_t engine;
+    uintptr_t             codes[4];
+    uintptr_t             groups[6];
+
+    sla_engine(&engine, 1600);
+    memset(codes, 0, sizeof(codes));
+    memset(groups, 0, sizeof(groups));
+
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 200) == 0);
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 201) == 0);
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 404) == 0);
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 502) == 0);
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 599) == 0);
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 100) == 0);
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 99) == -1);
+    SLA_CHECK(ngx_http_sla_engine_add_status(&engine, codes, groups, 600) == -1);
+
+    SLA_CHECK(codes[0] == 1);   /* 200 */
+    SLA_CHECK(codes[1] == 1);   /* 404 */
+    SLA_CHECK(codes[2] == 1);   /* 502 */
+    SLA_CHECK(codes[3] == 3);   /* сумма отслеживаемых */
+
+    SLA_CHECK(groups[0] == 1);
+    SLA_CHECK(groups[1] == 2);
+    SLA_CHECK(groups[2] == 0);
+    SLA_CHECK(groups[3] == 1);
+    SLA_CHECK(groups[4] == 2);
+    SLA_CHECK(groups[5] == 6);
+}
+
+int main (void)
+{
+    sla_test_buckets();
+    sla_test_averages();
+    sla_test_ewsa_init();
+    sla_test_ewsa_uniform();
+    sla_test_status();
+
+    printf("sla_engine_test: %d checks, %d failed\n", checked, failed);
+
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,257 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Чтение кольцевого буфера sla_events
+ *
+ * Сборка: cc -O2 -I. -o sla_events tools/sla_events.c
+ * Запуск: sla_events [-a] /dev/shm/nginx-sla.events
+ *
+ * Выводит новые события строками "время пул счетчик статус время_ответа полное_время",
+ * с ключом -a - начиная с самого старого события в буфере. Если при перезагрузке nginx
+ * файл пересоздан (изменился size=), он отображается заново и читается с начала.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ngx_http_sla_events.h"
+
+#define SLA_EVENTS_POLL_USEC 100000
+#define SLA_EVENTS_RETRIES   100
+
+/**
+ * Отображенный файл
+ */
+typedef struct {
+    const ngx_http_sla_events_header_t* header;   /** Заголовок (начало файла) */
+    size_t                              size;     /** Размер отображения       */
+    dev_t                               dev;      /** Устройство файла         */
+    ino_t                               ino;      /** Inode файла              */
+} sla_events_map_t;
+
+
+static void sla_fail (const char* file, const char* message)
+{
+    fprintf(stderr, "sla_events: %s: %s\n", file, message);
+    exit(1);
+}
+
+/**
+ * Отображение файла, NULL - успех, иначе описание ошибки
+ */
+static const char* sla_map (const char* file, sla_events_map_t* map)
+{
+    int         fd;
+    void*       addr;
+    struct stat st;
+
+    const ngx_http_sla_events_header_t* header;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        return "cannot open file";
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return "cannot open file";
+    }
+
+    if ((size_t)st.st_size < sizeof(ngx_http_sla_events_header_t)) {
+        close(fd);
+        return "file too small";
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        return "mmap failed";
+    }
+
+    header = addr;
+
+    if (memcmp(header->magic, NGX_HTTP_SLA_EVENTS_MAGIC, 4) != 0 || header->version != NGX_HTTP_SLA_EVENTS_VERSION) {
+        munmap(addr, st.st_size);
+        return "bad magic or version";
+    }
+
+    if (header->record_size != NGX_HTTP_SLA_EVENTS_RECORD_SIZE || (header->capacity + 1) * header->record_size > (uint64_t)st.st_size) {
+        munmap(addr, st.st_size);
+        return "bad record size or capacity";
+    }
+
+    map->header = header;
+    map->size   = st.st_size;
+    map->dev    = st.st_dev;
+    map->ino    = st.st_ino;
+
+    return NULL;
+}
+
+/**
+ * Проверка, что по пути лежит отображенный файл; 1 - файл пересоздан и отображен заново
+ */
+static int sla_remap (const char* file, sla_events_map_t* map)
+{
+    struct stat      st;
+    sla_events_map_t fresh;
+
+    /* между удалением и созданием файла его может не быть - проверится при следующем опросе */
+    if (stat(file, &st) == -1) {
+        return 0;
+    }
+
+    if (st.st_dev == map->dev && st.st_ino == map->ino && (size_t)st.st_size == map->size) {
+        return 0;
+    }
+
+    /* заголовок нового файла модуль записывает последним - до этого файл еще не готов */
+    if (sla_map(file, &fresh) != NULL) {
+        return 0;
+    }
+
+    munmap((void*)map->header, map->size);
+    *map = fresh;
+
+    return 1;
+}
+
+/**
+ * Копирование записи n, 0 - запись еще не завершена или уже перезаписана
+ */
+static int sla_copy (const ngx_http_sla_events_header_t* header, uint64_t n, ngx_http_sla_event_t* event)
+{
+    const ngx_http_sla_event_t* records = (const ngx_http_sla_event_t*)(header + 1);
+    const ngx_http_sla_event_t* record  = &records[n % header->capacity];
+
+    if (record->seq != n + 1) {
+        return 0;
+    }
+
+    __sync_synchronize();
+    memcpy(event, (const void*)record, sizeof(ngx_http_sla_event_t));
+    __sync_synchronize();
+
+    return record->seq == n + 1;
+}
+
+int main (int argc, char** argv)
+{
+    int                  all;
+    uint64_t             n;
+    uint64_t             head;
+    uint64_t             lost;
+    unsigned             retries;
+    const char*          file;
+    const char*          error;
+    sla_events_map_t     map;
+    ngx_http_sla_event_t event;
+
+    const ngx_http_sla_events_header_t* header;
+
+    all = argc == 3 && strcmp(argv[1], "-a") == 0;
+
+    if (argc != 2 + all) {
+        fprintf(stderr, "usage: sla_events [-a] file\n");
+        return 2;
+    }
+
+    file  = argv[1 + all];
+    error = sla_map(file, &map);
+
+    if (error != NULL) {
+        sla_fail(file, error);
+    }
+
+    header  = map.header;
+    head    = header->head;
+    n       = all && head > header->capacity ? head - header->capacity : (all ? 0 : head);
+    lost    = 0;
+    retries = 0;
+
+    for (;;) {
+        head = header->head;
+
+        if (n == head) {
+            fflush(stdout);
+
+            /* новых событий нет - возможно, nginx пересоздал файл и пишет уже в него */
+            if (sla_remap(file, &map)) {
+                header = map.header;
+                head   = header->head;
+                n      = head > header->capacity ? head - header->capacity : 0;
+
+                fprintf(stderr, "sla_events: %s: file recreated, reading from the start\n", file);
+                continue;
+            }
+
+            usleep(SLA_EVENTS_POLL_USEC);
+            continue;
+        }
+
+        /* читатель отстал больше чем на размер буфера */
+        if (head - n > header->capacity) {
+            lost += head - header->capacity - n;
+            n     = head - header->capacity;
+
+            fprintf(stderr, "sla_events: %" PRIu64 " events lost\n", lost);
+        }
+
+        /* запись еще заполняется - повторить позже, незавершенная (аварийное завершение процесса) пропускается */
+        if (!sla_copy(header, n, &event)) {
+            if (++retries < SLA_EVENTS_RETRIES) {
+                usleep(1000);
+            } else {
+                retries = 0;
+                lost++;
+                n++;
+            }
+            continue;
+        }
+
+        retries = 0;
+
+        printf("%" PRIu64 ".%03" PRIu64 " %.*s %.*s %u %u %u\n", event.msec / 1000, event.msec % 1000,
+               (int)event.pool_len, event.pool, (int)event.counter_len, event.counter,
+               (unsigned)event.status, (unsigned)event.time, (unsigned)event.request);
+
+        n++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,516 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Стоимость записи статистики и вывода sla_status на ядре модуля (ngx_http_sla_engine.h)
+ *
+ * Сборка: cc -O2 -I. -o sla_hotpath_bench tools/sla_hotpath_bench.c -lm -lpthread
+ * Запуск: sla_hotpath_bench [-r записей на процесс] [-w процессов] [-p пулов] [-c счетчиков]
+ *
+ * Запись: 1, 2, 4, ... -w процессов (fork) пишут в общие счетчики анонимного разделяемого отображения
+ * под одним мьютексом между процессами, как рабочие процессы nginx в зону пула: поиск счетчика апстрима
+ * по имени, статус и время в счетчике апстрима и в счетчике all, шаг EWSA при заполнении FIFO.
+ * Выводятся пропускная способность, стоимость записи в процессе и ожидание мьютекса (вместе с двумя
+ * вызовами clock_gettime() вокруг захвата, поэтому и без конкуренции оно не нулевое).
+ *
+ * Вывод: текстовый и двоичный формат sla_status для -p пулов по -c счетчиков. Строки и поля те же,
+ * что в модуле, но вместо ngx_sprintf() - snprintf(), поэтому абсолютные значения - оценка сверху.
+ */
+
+#ifndef _POSIX_C_SOURCE
+    #define _POSIX_C_SOURCE 200809L   /* clock_gettime(), pthread_mutexattr_setpshared() */
+#endif
+
+#ifndef _DEFAULT_SOURCE
+    #define _DEFAULT_SOURCE           /* MAP_ANONYMOUS */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "ngx_http_sla_engine.h"
+
+#ifndef MAP_ANONYMOUS
+    #define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define SLA_BENCH_MAX_NAME_LEN 64
+#define SLA_BENCH_MAX_HTTP     14
+#define SLA_BENCH_RENDERS      100
+
+/**
+ * Счетчик (поля счетчика модуля, которые затрагивают запись и вывод)
+ */
+typedef struct {
+    char                  name[SLA_BENCH_MAX_NAME_LEN];   /** Имя апстрима                      */
+    size_t                name_len;                       /** Длина имени апстрима              */
+    uintptr_t             http[SLA_BENCH_MAX_HTTP];       /** Количество ответов HTTP           */
+    uintptr_t             http_xxx[6];                    /** Количество ответов в группах HTTP */
+    ngx_http_sla_timing_t timing;                         /** Времена ответов                   */
+} sla_counter_t;
+
+/**
+ * Разделяемая область записи
+ */
+typedef struct {
+    pthread_mutex_t mutex;       /** Мьютекс пула                           */
+    volatile int    ready;       /** Количество процессов, готовых к записи */
+    volatile int    go;          /** Старт записи                           */
+    uint64_t        lock_wait;   /** Суммарное ожидание мьютекса, нс        */
+    uint64_t        busy;        /** Суммарное время записи процессов, нс   */
+    sla_counter_t   counters[1]; /** Счетчики пула (all - первый)           */
+} sla_shared_t;
+
+
+static size_t                records_len = 100000;
+static size_t                writers_max = 64;
+static size_t                pools_len = 4;
+static size_t                counters_len = 16;
+static uintptr_t             timings[] = { 100, 300, 500, 1000, 2000, (uintptr_t)-1 };
+static uintptr_t             quantiles[NGX_HTTP_SLA_MAX_QUANTILES_LEN] = { 25, 50, 75, 90, 95, 98, 99 };
+static uintptr_t             http[SLA_BENCH_MAX_HTTP] = { 200, 301, 302, 304, 400, 401, 403, 404, 499, 500, 502, 503, 504, (uintptr_t)-1 };
+static ngx_http_sla_engine_t engine;
+
+
+static uint64_t sla_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t sla_random (uint64_t* seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    return *seed >> 33;
+}
+
+/* логнормальное время ответа с медианой 100 мс */
+static uintptr_t sla_random_ms (uint64_t* seed)
+{
+    double u1;
+    double u2;
+
+    u1 = ((double)sla_random(seed) + 0.5) / 2147483648.0;
+    u2 = ((double)sla_random(seed) + 0.5) / 2147483648.0;
+
+    return (uintptr_t)exp(log(100) + 0.5 * sqrt(-2 * log(u1)) * cos(6.283185307179586 * u2)) + 1;
+}
+
+static uintptr_t sla_random_status (uint64_t* seed)
+{
+    static const uintptr_t statuses[] = { 200, 200, 200, 200, 200, 200, 200, 304, 404, 502 };
+
+    return statuses[sla_random(seed) % (sizeof(statuses) / sizeof(statuses[0]))];
+}
+
+static void sla_init_counters (sla_counter_t* counters, size_t n)
+{
+    size_t i;
+
+    memset(counters, 0, sizeof(sla_counter_t) * n);
+
+    for (i = 0; i < n; i++) {
+        if (i == 0) {
+            counters[i].name_len = snprintf(counters[i].name, SLA_BENCH_MAX_NAME_LEN, "all");
+        } else {
+            counters[i].name_len = snprintf(counters[i].name, SLA_BENCH_MAX_NAME_LEN, "10.0.%zu.%zu:8080", i / 256, i % 256);
+        }
+    }
+}
+
+/* поиск счетчика по имени - линейный, как ngx_http_sla_get_counter() */
+static sla_counter_t* sla_get_counter (sla_counter_t* counters, const char* name, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < counters_len; i++) {
+        if (counters[i].name_len == len && strncmp(counters[i].name, name, len) == 0) {
+            return &counters[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void sla_add (sla_counter_t* counter, uintptr_t status, uintptr_t ms)
+{
+    ngx_http_sla_engine_add_status(&engine, counter->http, counter->http_xxx, status);
+
+    if (ngx_http_sla_engine_add_timing(&engine, &counter->timing, ms)) {
+        ngx_http_sla_engine_quantiles(&engine, &counter->timing);
+    }
+}
+
+static void sla_record (sla_counter_t* counters, uint64_t* seed)
+{
+    size_t         peer;
+    uintptr_t      ms;
+    uintptr_t      status;
+    sla_counter_t* counter;
+    char           name[SLA_BENCH_MAX_NAME_LEN];
+    int            len;
+
+    peer = counters_len > 1 ? 1 + sla_random(seed) % (counters_len - 1) : 0;
+    len  = snprintf(name, sizeof(name), peer == 0 ? "all" : "10.0.%zu.%zu:8080", peer / 256, peer % 256);
+
+    ms     = sla_random_ms(seed);
+    status = sla_random_status(seed);
+
+    counter = sla_get_counter(counters, name, len);
+    if (counter != NULL && counter != counters) {
+        sla_add(counter, status, ms);
+    }
+
+    sla_add(counters, status, ms);
+}
+
+static void sla_writer (sla_shared_t* shared, size_t id)
+{
+    size_t   i;
+    uint64_t seed;
+    uint64_t t0;
+    uint64_t t1;
+    uint64_t start;
+    uint64_t wait;
+
+    seed = id + 1;
+    wait = 0;
+
+    __sync_fetch_and_add(&shared->ready, 1);
+
+    while (!shared->go) {
+        /* ожидание остальных процессов */
+    }
+
+    start = sla_now();
+
+    for (i = 0; i < records_len; i++) {
+        t0 = sla_now();
+        pthread_mutex_lock(&shared->mutex);
+        t1 = sla_now();
+
+        sla_record(shared->counters, &seed);
+
+        pthread_mutex_unlock(&shared->mutex);
+
+        wait += t1 - t0;
+    }
+
+    __sync_fetch_and_add(&shared->lock_wait, wait);
+    __sync_fetch_and_add(&shared->busy, sla_now() - start);
+}
+
+static void sla_bench_record (void)
+{
+    size_t              i;
+    size_t              n;
+    size_t              size;
+    uint64_t            start;
+    double              total;
+    double              seconds;
+    pid_t               pid;
+    sla_shared_t*       shared;
+    pthread_mutexattr_t attr;
+
+    size   = sizeof(sla_shared_t) + sizeof(sla_counter_t) * (counters_len - 1);
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (shared == MAP_FAILED) {
+        perror("sla_hotpath_bench: mmap");
+        exit(1);
+    }
+
+    printf("record: %zu records per writer, %zu counters, ns/record and lock wait per writer\n", records_len, counters_len);
+    printf("%8s %14s %12s %12s\n", "writers", "records/s", "ns/record", "lock wait");
+
+    /* 1, 2, 4, ... и последней ступенью ровно -w процессов */
+    for (n = 1; n <= writers_max; n = n * 2 < writers_max || n == writers_max ? n * 2 : writers_max) {
+        memset(shared, 0, size);
+        sla_init_counters(shared->counters, counters_len);
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&shared->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        for (i = 0; i < n; i++) {
+            pid = fork();
+
+            if (pid < 0) {
+                perror("sla_hotpath_bench: fork");
+                exit(1);
+            }
+
+            if (pid == 0) {
+                sla_writer(shared, i);
+                _exit(0);
+            }
+        }
+
+        while (shared->ready < (int)n) {
+            /* ожидание запуска всех процессов */
+        }
+
+        start = sla_now();
+        __sync_synchronize();
+        shared->go = 1;
+
+        for (i = 0; i < n; i++) {
+            wait(NULL);
+        }
+
+        seconds = (double)(sla_now() - start) / 1e9;
+        total   = (double)records_len * (double)n;
+
+        printf("%8zu %14.0f %12.1f %12.1f\n", n, total / seconds, (double)shared->busy / total, (double)shared->lock_wait / total);
+
+        pthread_mutex_destroy(&shared->mutex);
+    }
+
+    munmap(shared, size);
+}
+
+static size_t sla_render_text (char* buf, size_t size, const char* pool, const sla_counter_t* counter)
+{
+    size_t                       i;
+    char*                        p;
+    char*                        last;
+    const ngx_http_sla_timing_t* series = &counter->timing;
+
+    p    = buf;
+    last = buf + size;
+
+#define SLA_PRINT(...) p += snprintf(p, last - p, __VA_ARGS__)
+
+    SLA_PRINT("%s.%s.http = %" PRIuPTR "\n", pool, counter->name, counter->http[engine.http_len - 1]);
+
+    for (i = 0; i < engine.http_len - 1; i++) {
+        SLA_PRINT("%s.%s.http_%" PRIuPTR " = %" PRIuPTR "\n", pool, counter->name, http[i], counter->http[i]);
+    }
+
+    SLA_PRINT("%s.%s.http_xxx = %" PRIuPTR "\n", pool, counter->name, counter->http_xxx[5]);
+
+    for (i = 0; i < 5; i++) {
+        SLA_PRINT("%s.%s.http_%zuxx = %" PRIuPTR "\n", pool, counter->name, i + 1, counter->http_xxx[i]);
+    }
+
+    SLA_PRINT("%s.%s.time.avg = %" PRIuPTR "\n", pool, counter->name, (uintptr_t)series->time_avg);
+    SLA_PRINT("%s.%s.time.avg.mov = %" PRIuPTR "\n", pool, counter->name, (uintptr_t)series->time_avg_mov);
+
+    for (i = 0; i < engine.timings_len; i++) {
+        if (timings[i] != (uintptr_t)-1) {
+            SLA_PRINT("%s.%s.%" PRIuPTR " = %" PRIuPTR "\n", pool, counter->name, timings[i], series->timings[i]);
+            SLA_PRINT("%s.%s.%" PRIuPTR ".agg = %" PRIuPTR "\n", pool, counter->name, timings[i], series->timings_agg[i]);
+        } else {
+            SLA_PRINT("%s.%s.inf = %" PRIuPTR "\n", pool, counter->name, series->timings[i]);
+            SLA_PRINT("%s.%s.inf.agg = %" PRIuPTR "\n", pool, counter->name, series->timings_agg[i]);
+        }
+    }
+
+    for (i = 0; i < engine.quantiles_len; i++) {
+        SLA_PRINT("%s.%s.%" PRIuPTR "%% = %" PRIuPTR "\n", pool, counter->name, quantiles[i], (uintptr_t)series->quantiles[i]);
+    }
+
+#undef SLA_PRINT
+
+    return p - buf;
+}
+
+static unsigned char* sla_put64 (unsigned char* p, uint64_t value)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        *p++ = (unsigned char)(value >> (i * 8));
+    }
+
+    return p;
+}
+
+static size_t sla_render_binary (unsigned char* buf, const sla_counter_t* counter)
+{
+    size_t         i;
+    unsigned char* p;
+
+    p    = buf;
+    *p++ = (unsigned char)(counter->name_len >> 8);
+    *p++ = (unsigned char)counter->name_len;
+
+    memcpy(p, counter->name, counter->name_len);
+    p += counter->name_len;
+
+    for (i = 0; i < engine.http_len; i++) {
+        p = sla_put64(p, counter->http[i]);
+    }
+
+    for (i = 0; i < 6; i++) {
+        p = sla_put64(p, counter->http_xxx[i]);
+    }
+
+    for (i = 0; i < engine.timings_len; i++) {
+        p = sla_put64(p, counter->timing.timings[i]);
+    }
+
+    p = sla_put64(p, counter->timing.timings_agg[engine.timings_len - 1]);
+    p = sla_put64(p, counter->timing.time_sum);
+
+    return p - buf;
+}
+
+static void sla_bench_render (void)
+{
+    size_t         i;
+    size_t         j;
+    size_t         k;
+    size_t         size;
+    size_t         text;
+    size_t         binary;
+    uint64_t       seed;
+    uint64_t       t1;
+    uint64_t       t2;
+    uint64_t       t3;
+    char*          buf;
+    char           pool[32];
+    sla_counter_t* counters;
+
+    counters = malloc(sizeof(sla_counter_t) * counters_len * pools_len);
+    size     = (counters_len * pools_len + 1) * 8192;
+    buf      = malloc(size);
+
+    if (counters == NULL || buf == NULL) {
+        fprintf(stderr, "sla_hotpath_bench: out of memory\n");
+        exit(1);
+    }
+
+    /* счетчики с данными - вывод процентилей и таймингов не вырождается в нули */
+    seed = 1;
+
+    for (i = 0; i < pools_len; i++) {
+        sla_init_counters(counters + i * counters_len, counters_len);
+
+        for (j = 0; j < counters_len * 1000; j++) {
+            sla_record(counters + i * counters_len, &seed);
+        }
+    }
+
+    text   = 0;
+    binary = 0;
+
+    t1 = sla_now();
+
+    for (k = 0; k < SLA_BENCH_RENDERS; k++) {
+        text = 0;
+
+        for (i = 0; i < pools_len; i++) {
+            snprintf(pool, sizeof(pool), "pool%zu", i);
+
+            for (j = 0; j < counters_len; j++) {
+                text += sla_render_text(buf + text, size - text, pool, &counters[i * counters_len + j]);
+            }
+        }
+    }
+
+    t2 = sla_now();
+
+    for (k = 0; k < SLA_BENCH_RENDERS; k++) {
+        binary = 0;
+
+        for (i = 0; i < pools_len * counters_len; i++) {
+            binary += sla_render_binary((unsigned char*)buf + binary, &counters[i]);
+        }
+    }
+
+    t3 = sla_now();
+
+    printf("\nrender: %zu pools x %zu counters, %d renders\n", pools_len, counters_len, SLA_BENCH_RENDERS);
+    printf("%8s %12s %12s %12s\n", "format", "bytes", "us/render", "ns/counter");
+    printf("%8s %12zu %12.1f %12.1f\n", "text", text, (double)(t2 - t1) / 1e3 / SLA_BENCH_RENDERS,
+           (double)(t2 - t1) / SLA_BENCH_RENDERS / (double)(pools_len * counters_len));
+    printf("%8s %12zu %12.1f %12.1f\n", "binary", binary, (double)(t3 - t2) / 1e3 / SLA_BENCH_RENDERS,
+           (double)(t3 - t2) / SLA_BENCH_RENDERS / (double)(pools_len * counters_len));
+
+    free(counters);
+    free(buf);
+}
+
+int main (int argc, char** argv)
+{
+    int  i;
+    long value;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        value = atol(argv[i + 1]);
+
+        if (strcmp(argv[i], "-r") == 0 && value >= 1) {
+            records_len = value;
+        } else if (strcmp(argv[i], "-w") == 0 && value >= 1 && value <= 1024) {
+            writers_max = value;
+        } else if (strcmp(argv[i], "-p") == 0 && value >= 1) {
+            pools_len = value;
+        } else if (strcmp(argv[i], "-c") == 0 && value >= 1 && value <= 65536) {
+            counters_len = value;
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc) {
+        fprintf(stderr, "usage: sla_hotpath_bench [-r records] [-w writers] [-p pools] [-c counters]\n");
+        return 2;
+    }
+
+    engine.timings       = timings;
+    engine.timings_len   = sizeof(timings) / sizeof(timings[0]);
+    engine.quantiles     = quantiles;
+    engine.quantiles_len = NGX_HTTP_SLA_MAX_QUANTILES_LEN;
+    engine.http          = http;
+    engine.http_len      = SLA_BENCH_MAX_HTTP;
+    engine.avg_window    = 1600;
+
+    ngx_http_sla_engine_init(&engine);
+
+    sla_bench_record();
+    sla_bench_render();
+
+    return 0;
+}
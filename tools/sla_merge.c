@@ -0,0 +1,459 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Суммирование дампов sla_status format=binary с нескольких серверов
+ *
+ * Сборка: cc -O2 -I. -o sla_merge tools/sla_merge.c
+ * Запуск: sla_merge node1.bin node2.bin ... (- для stdin)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "ngx_http_sla_binary.h"
+
+/**
+ * Счетчик
+ */
+typedef struct {
+    char*     name;          /** Имя апстрима                           */
+    uint64_t* http;          /** Количество ответов HTTP                */
+    uint64_t  http_xxx[6];   /** Количество ответов в группах HTTP      */
+    uint64_t* timings;       /** Количество ответов в интервале времени */
+    uint64_t  samples;       /** Количество ответов с учтенным временем */
+    uint64_t  time_sum;      /** Суммарное время ответов                */
+} sla_counter_t;
+
+/**
+ * Пул
+ */
+typedef struct {
+    char*          name;          /** Имя пула                */
+    uint16_t       timings_len;   /** Количество таймингов    */
+    uint32_t*      timings;       /** Тайминги                */
+    uint16_t       http_len;      /** Количество статусов     */
+    uint32_t*      http;          /** Статусы HTTP            */
+    uint16_t       quantiles_len; /** Количество квантилей    */
+    uint16_t*      quantiles;     /** Квантили                */
+    size_t         counters_len;  /** Количество счетчиков    */
+    sla_counter_t* counters;      /** Счетчики                */
+} sla_pool_t;
+
+/**
+ * Разбираемый дамп
+ */
+typedef struct {
+    const char*          file;   /** Имя файла         */
+    const unsigned char* pos;    /** Текущая позиция   */
+    const unsigned char* end;    /** Конец данных      */
+} sla_reader_t;
+
+
+static sla_pool_t* pools     = NULL;
+static size_t      pools_len = 0;
+
+
+static void* sla_alloc (size_t size)
+{
+    void* result;
+
+    result = calloc(1, size > 0 ? size : 1);
+    if (result == NULL) {
+        fprintf(stderr, "sla_merge: out of memory\n");
+        exit(1);
+    }
+
+    return result;
+}
+
+static void sla_fail (const sla_reader_t* reader, const char* message)
+{
+    fprintf(stderr, "sla_merge: %s: %s\n", reader->file, message);
+    exit(1);
+}
+
+static const unsigned char* sla_read (sla_reader_t* reader, size_t size)
+{
+    const unsigned char* result;
+
+    if ((size_t)(reader->end - reader->pos) < size) {
+        sla_fail(reader, "unexpected end of data");
+    }
+
+    result       = reader->pos;
+    reader->pos += size;
+
+    return result;
+}
+
+static uint16_t sla_read16 (sla_reader_t* reader)
+{
+    return ngx_http_sla_binary_get16(sla_read(reader, 2));
+}
+
+static uint32_t sla_read32 (sla_reader_t* reader)
+{
+    return ngx_http_sla_binary_get32(sla_read(reader, 4));
+}
+
+static uint64_t sla_read64 (sla_reader_t* reader)
+{
+    return ngx_http_sla_binary_get64(sla_read(reader, 8));
+}
+
+static char* sla_read_name (sla_reader_t* reader)
+{
+    uint16_t len;
+    char*    result;
+
+    len    = sla_read16(reader);
+    result = sla_alloc(len + 1);
+
+    memcpy(result, sla_read(reader, len), len);
+
+    return result;
+}
+
+static sla_pool_t* sla_get_pool (const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < pools_len; i++) {
+        if (strcmp(pools[i].name, name) == 0) {
+            return &pools[i];
+        }
+    }
+
+    pools = realloc(pools, (pools_len + 1) * sizeof(sla_pool_t));
+    if (pools == NULL) {
+        fprintf(stderr, "sla_merge: out of memory\n");
+        exit(1);
+    }
+
+    memset(&pools[pools_len], 0, sizeof(sla_pool_t));
+    pools[pools_len].name = sla_alloc(strlen(name) + 1);
+    strcpy(pools[pools_len].name, name);
+
+    return &pools[pools_len++];
+}
+
+static sla_counter_t* sla_get_counter (sla_pool_t* pool, const char* name)
+{
+    size_t         i;
+    sla_counter_t* counter;
+
+    for (i = 0; i < pool->counters_len; i++) {
+        if (strcmp(pool->counters[i].name, name) == 0) {
+            return &pool->counters[i];
+        }
+    }
+
+    pool->counters = realloc(pool->counters, (pool->counters_len + 1) * sizeof(sla_counter_t));
+    if (pool->counters == NULL) {
+        fprintf(stderr, "sla_merge: out of memory\n");
+        exit(1);
+    }
+
+    counter = &pool->counters[pool->counters_len++];
+    memset(counter, 0, sizeof(sla_counter_t));
+
+    counter->name = sla_alloc(strlen(name) + 1);
+    strcpy(counter->name, name);
+
+    counter->http    = sla_alloc(pool->http_len * sizeof(uint64_t));
+    counter->timings = sla_alloc(pool->timings_len * sizeof(uint64_t));
+
+    return counter;
+}
+
+static void sla_merge_pool (sla_reader_t* reader)
+{
+    uint16_t       i;
+    uint16_t       j;
+    uint16_t       len;
+    uint32_t       value;
+    char*          name;
+    sla_pool_t*    pool;
+    sla_counter_t* counter;
+    int            created;
+
+    name    = sla_read_name(reader);
+    pool    = sla_get_pool(name);
+    created = pool->timings == NULL;
+
+    free(name);
+
+    /* тайминги и статусы должны совпадать, иначе суммирование невозможно */
+    len = sla_read16(reader);
+    if (created) {
+        pool->timings_len = len;
+        pool->timings     = sla_alloc(len * sizeof(uint32_t));
+    } else if (len != pool->timings_len) {
+        sla_fail(reader, "timings of pool differ from previous dumps");
+    }
+
+    for (i = 0; i < len; i++) {
+        value = sla_read32(reader);
+        if (created) {
+            pool->timings[i] = value;
+        } else if (pool->timings[i] != value) {
+            sla_fail(reader, "timings of pool differ from previous dumps");
+        }
+    }
+
+    len = sla_read16(reader);
+    if (created) {
+        pool->http_len = len;
+        pool->http     = sla_alloc(len * sizeof(uint32_t));
+    } else if (len != pool->http_len) {
+        sla_fail(reader, "http statuses of pool differ from previous dumps");
+    }
+
+    for (i = 0; i < len; i++) {
+        value = sla_read32(reader);
+        if (created) {
+            pool->http[i] = value;
+        } else if (pool->http[i] != value) {
+            sla_fail(reader, "http statuses of pool differ from previous dumps");
+        }
+    }
+
+    if (pool->timings_len == 0 || pool->http_len == 0) {
+        sla_fail(reader, "empty timings or http statuses");
+    }
+
+    /* квантили только для вывода - берутся из первого дампа */
+    len = sla_read16(reader);
+    if (created) {
+        pool->quantiles_len = len;
+        pool->quantiles     = sla_alloc(len * sizeof(uint16_t));
+    }
+
+    for (i = 0; i < len; i++) {
+        value = sla_read16(reader);
+        if (created) {
+            pool->quantiles[i] = (uint16_t)value;
+        }
+    }
+
+    /* счетчики */
+    len = sla_read16(reader);
+    for (i = 0; i < len; i++) {
+        name    = sla_read_name(reader);
+        counter = sla_get_counter(pool, name);
+
+        free(name);
+
+        for (j = 0; j < pool->http_len; j++) {
+            counter->http[j] += sla_read64(reader);
+        }
+
+        for (j = 0; j < 6; j++) {
+            counter->http_xxx[j] += sla_read64(reader);
+        }
+
+        for (j = 0; j < pool->timings_len; j++) {
+            counter->timings[j] += sla_read64(reader);
+        }
+
+        counter->samples  += sla_read64(reader);
+        counter->time_sum += sla_read64(reader);
+    }
+}
+
+static void sla_merge_file (const char* file)
+{
+    FILE*          fd;
+    unsigned char* data;
+    size_t         size;
+    size_t         len;
+    uint16_t       i;
+    uint16_t       count;
+    sla_reader_t   reader;
+
+    fd = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    if (fd == NULL) {
+        perror(file);
+        exit(1);
+    }
+
+    size = 0;
+    len  = 65536;
+    data = sla_alloc(len);
+
+    while (!feof(fd)) {
+        if (size == len) {
+            len *= 2;
+            data = realloc(data, len);
+            if (data == NULL) {
+                fprintf(stderr, "sla_merge: out of memory\n");
+                exit(1);
+            }
+        }
+
+        size += fread(data + size, 1, len - size, fd);
+
+        if (ferror(fd)) {
+            perror(file);
+            exit(1);
+        }
+    }
+
+    if (fd != stdin) {
+        fclose(fd);
+    }
+
+    reader.file = file;
+    reader.pos  = data;
+    reader.end  = data + size;
+
+    if (memcmp(sla_read(&reader, 4), NGX_HTTP_SLA_BINARY_MAGIC, 4) != 0) {
+        sla_fail(&reader, "not a sla_status binary dump");
+    }
+
+    if (sla_read16(&reader) != NGX_HTTP_SLA_BINARY_VERSION) {
+        sla_fail(&reader, "unsupported dump version");
+    }
+
+    count = sla_read16(&reader);
+    for (i = 0; i < count; i++) {
+        sla_merge_pool(&reader);
+    }
+
+    free(data);
+}
+
+static uint64_t sla_percentile (const sla_pool_t* pool, const sla_counter_t* counter, uint16_t quantile)
+{
+    uint16_t i;
+    uint64_t agg;
+    double   rank;
+    double   lower;
+
+    if (counter->samples == 0) {
+        return 0;
+    }
+
+    rank = (double)quantile * (double)counter->samples / 100;
+    agg  = 0;
+
+    for (i = 0; i < pool->timings_len; i++) {
+        if (counter->timings[i] > 0 && (double)(agg + counter->timings[i]) >= rank) {
+            lower = i > 0 ? pool->timings[i - 1] : 0;
+
+            /* "бесконечный" интервал - известна только нижняя граница */
+            if (pool->timings[i] == NGX_HTTP_SLA_BINARY_INF) {
+                return (uint64_t)lower;
+            }
+
+            /* линейная интерполяция внутри интервала */
+            return (uint64_t)(lower + (pool->timings[i] - lower) * (rank - (double)agg) / (double)counter->timings[i]);
+        }
+
+        agg += counter->timings[i];
+    }
+
+    return 0;
+}
+
+static void sla_print (void)
+{
+    size_t               i;
+    size_t               j;
+    uint16_t             k;
+    uint64_t             agg;
+    const sla_pool_t*    pool;
+    const sla_counter_t* counter;
+
+    for (i = 0; i < pools_len; i++) {
+        pool = &pools[i];
+
+        for (j = 0; j < pool->counters_len; j++) {
+            counter = &pool->counters[j];
+
+            /* коды http */
+            printf("%s.%s.http = %" PRIu64 "\n", pool->name, counter->name, counter->http[pool->http_len - 1]);
+
+            for (k = 0; k < pool->http_len - 1; k++) {
+                printf("%s.%s.http_%" PRIu32 " = %" PRIu64 "\n", pool->name, counter->name, pool->http[k], counter->http[k]);
+            }
+
+            /* группы кодов http */
+            printf("%s.%s.http_xxx = %" PRIu64 "\n", pool->name, counter->name, counter->http_xxx[5]);
+
+            for (k = 0; k < 5; k++) {
+                printf("%s.%s.http_%uxx = %" PRIu64 "\n", pool->name, counter->name, k + 1, counter->http_xxx[k]);
+            }
+
+            /* среднее */
+            printf("%s.%s.time.avg = %" PRIu64 "\n", pool->name, counter->name, counter->samples > 0 ? counter->time_sum / counter->samples : 0);
+
+            /* тайминги */
+            agg = 0;
+            for (k = 0; k < pool->timings_len; k++) {
+                agg += counter->timings[k];
+
+                if (pool->timings[k] != NGX_HTTP_SLA_BINARY_INF) {
+                    printf("%s.%s.%" PRIu32 " = %" PRIu64 "\n", pool->name, counter->name, pool->timings[k], counter->timings[k]);
+                    printf("%s.%s.%" PRIu32 ".agg = %" PRIu64 "\n", pool->name, counter->name, pool->timings[k], agg);
+                } else {
+                    printf("%s.%s.inf = %" PRIu64 "\n", pool->name, counter->name, counter->timings[k]);
+                    printf("%s.%s.inf.agg = %" PRIu64 "\n", pool->name, counter->name, agg);
+                }
+            }
+
+            /* процентили по интервалам */
+            for (k = 0; k < pool->quantiles_len; k++) {
+                printf("%s.%s.%u%% = %" PRIu64 "\n", pool->name, counter->name, pool->quantiles[k], sla_percentile(pool, counter, pool->quantiles[k]));
+            }
+        }
+    }
+}
+
+int main (int argc, char** argv)
+{
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: sla_merge file ... (- for stdin)\n");
+        return 2;
+    }
+
+    for (i = 1; i < argc; i++) {
+        sla_merge_file(argv[i]);
+    }
+
+    sla_print();
+
+    return 0;
+}
@@ -0,0 +1,281 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Точность и стоимость оценки процентилей EWSA (ngx_http_sla_engine.h)
+ *
+ * Сборка: cc -O2 -I. -o sla_quantile_bench tools/sla_quantile_bench.c -lm
+ *         (параметры - -DNGX_HTTP_SLA_QUANTILE_M=200 -DNGX_HTTP_SLA_QUANTILE_W=0.005)
+ * Запуск: sla_quantile_bench [количество значений]
+ *
+ * Синтетические потоки времен ответа (логнормальный, бимодальный, с тяжелым хвостом и со сменой
+ * уровня) пропускаются через ядро модуля, оценки сравниваются с точными процентилями отсортированной
+ * выборки (для смены уровня - выборки после смены). Для смены уровня выводится число значений после
+ * смены, через которое все оценки отклоняются от точных не более чем на SLA_BENCH_CONVERGED процентов.
+ */
+
+#ifndef _POSIX_C_SOURCE
+    #define _POSIX_C_SOURCE 200809L   /* clock_gettime() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include "ngx_http_sla_engine.h"
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+#define SLA_BENCH_SAMPLES   1000000
+#define SLA_BENCH_CONVERGED 10.0
+
+/**
+ * Поток
+ */
+typedef struct {
+    const char* name;                  /** Название                     */
+    uintptr_t   (*next) (size_t i);    /** i-е значение потока, мс      */
+    int         step;                  /** Уровень меняется в середине  */
+} sla_stream_t;
+
+
+static uint64_t  seed = 1;
+static size_t    samples_len = SLA_BENCH_SAMPLES;
+static uintptr_t timings[] = { 300, 500, 2000, (uintptr_t)-1 };
+static uintptr_t quantiles[NGX_HTTP_SLA_MAX_QUANTILES_LEN] = { 25, 50, 75, 90, 95, 98, 99 };
+static uintptr_t http[] = { 200, (uintptr_t)-1 };
+
+
+static double sla_uniform (void)
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    return ((double)(seed >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double sla_normal (void)
+{
+    return sqrt(-2 * log(sla_uniform())) * cos(2 * M_PI * sla_uniform());
+}
+
+static uintptr_t sla_ms (double value)
+{
+    return value < 1 ? 1 : (uintptr_t)(value + 0.5);
+}
+
+static uintptr_t sla_lognormal (size_t i)
+{
+    (void)i;
+
+    return sla_ms(exp(log(100) + 0.5 * sla_normal()));
+}
+
+/* 80% быстрых ответов (кэш) и 20% медленных */
+static uintptr_t sla_bimodal (size_t i)
+{
+    (void)i;
+
+    if (sla_uniform() < 0.8) {
+        return sla_ms(exp(log(20) + 0.3 * sla_normal()));
+    }
+
+    return sla_ms(exp(log(400) + 0.3 * sla_normal()));
+}
+
+/* Парето с alpha = 1.5 и ограничением таймаутом 60 s */
+static uintptr_t sla_heavy (size_t i)
+{
+    double value;
+
+    (void)i;
+
+    value = 20 / pow(sla_uniform(), 1 / 1.5);
+
+    return sla_ms(value < 60000 ? value : 60000);
+}
+
+/* медиана 100 мс, после середины потока - 400 мс */
+static uintptr_t sla_step (size_t i)
+{
+    return sla_ms(exp(log(i < samples_len / 2 ? 100 : 400) + 0.5 * sla_normal()));
+}
+
+static int sla_compare (const void* p1, const void* p2)
+{
+    uintptr_t one = *(const uintptr_t*)p1;
+    uintptr_t two = *(const uintptr_t*)p2;
+
+    return one == two ? 0 : (one > two ? 1 : -1);
+}
+
+static double sla_error (double estimate, double exact)
+{
+    return fabs(estimate - exact) * 100 / exact;
+}
+
+static double sla_max_error (const ngx_http_sla_timing_t* series, const double* exact)
+{
+    size_t i;
+    double error;
+    double result;
+
+    result = 0;
+
+    for (i = 0; i < NGX_HTTP_SLA_MAX_QUANTILES_LEN; i++) {
+        error  = sla_error(series->quantiles[i], exact[i]);
+        result = error > result ? error : result;
+    }
+
+    return result;
+}
+
+static void sla_bench (const ngx_http_sla_engine_t* engine, const sla_stream_t* stream)
+{
+    size_t                i;
+    size_t                start;
+    size_t                converged;
+    double                ns;
+    double                exact[NGX_HTTP_SLA_MAX_QUANTILES_LEN];
+    uintptr_t*            samples;
+    uintptr_t*            sorted;
+    struct timespec       t1;
+    struct timespec       t2;
+    ngx_http_sla_timing_t series;
+
+    samples = malloc(sizeof(uintptr_t) * samples_len);
+    sorted  = malloc(sizeof(uintptr_t) * samples_len);
+
+    if (samples == NULL || sorted == NULL) {
+        fprintf(stderr, "sla_quantile_bench: out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < samples_len; i++) {
+        samples[i] = stream->next(i);
+    }
+
+    /* точные процентили - по стационарной части потока */
+    start = stream->step ? samples_len / 2 : 0;
+
+    memcpy(sorted, samples + start, sizeof(uintptr_t) * (samples_len - start));
+    qsort(sorted, samples_len - start, sizeof(uintptr_t), sla_compare);
+
+    for (i = 0; i < NGX_HTTP_SLA_MAX_QUANTILES_LEN; i++) {
+        exact[i] = (double)sorted[(samples_len - start - 1) * quantiles[i] / 100];
+    }
+
+    /* стоимость - только ядро, значения сгенерированы заранее */
+    memset(&series, 0, sizeof(series));
+    converged = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < samples_len; i++) {
+        if (ngx_http_sla_engine_add_timing(engine, &series, samples[i])) {
+            ngx_http_sla_engine_quantiles(engine, &series);
+
+            /* сходимость после смены уровня - проверяется на шаге EWSA, ошибка вне порога сбрасывает ее */
+            if (stream->step && i >= start) {
+                if (sla_max_error(&series, exact) > SLA_BENCH_CONVERGED) {
+                    converged = 0;
+                } else if (converged == 0) {
+                    converged = i + 1 - start;
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    ns = ((double)(t2.tv_sec - t1.tv_sec) * 1e9 + (double)(t2.tv_nsec - t1.tv_nsec)) / (double)samples_len;
+
+    printf("%-10s %8.2f %8.2f %8.2f %8.2f %8.2f ", stream->name,
+           sla_error(series.quantiles[1], exact[1]), sla_error(series.quantiles[3], exact[3]),
+           sla_error(series.quantiles[5], exact[5]), sla_error(series.quantiles[6], exact[6]),
+           sla_max_error(&series, exact));
+
+    if (!stream->step) {
+        printf("%10s ", "-");
+    } else if (converged == 0) {
+        printf("%10s ", "never");
+    } else {
+        printf("%10zu ", converged);
+    }
+
+    printf("%9.1f\n", ns);
+
+    free(samples);
+    free(sorted);
+}
+
+int main (int argc, char** argv)
+{
+    size_t                i;
+    ngx_http_sla_engine_t engine;
+
+    static const sla_stream_t streams[] = {
+        { "lognormal", sla_lognormal, 0 },
+        { "bimodal",   sla_bimodal,   0 },
+        { "heavy",     sla_heavy,     0 },
+        { "step",      sla_step,      1 },
+    };
+
+    if (argc > 2 || (argc == 2 && (samples_len = strtoul(argv[1], NULL, 10)) < (size_t)NGX_HTTP_SLA_QUANTILE_M * 10)) {
+        fprintf(stderr, "usage: sla_quantile_bench [samples, at least %d]\n", NGX_HTTP_SLA_QUANTILE_M * 10);
+        return 2;
+    }
+
+    memset(&engine, 0, sizeof(engine));
+
+    engine.timings       = timings;
+    engine.timings_len   = sizeof(timings) / sizeof(timings[0]);
+    engine.quantiles     = quantiles;
+    engine.quantiles_len = NGX_HTTP_SLA_MAX_QUANTILES_LEN;
+    engine.http          = http;
+    engine.http_len      = sizeof(http) / sizeof(http[0]);
+    engine.avg_window    = 1600;
+
+    ngx_http_sla_engine_init(&engine);
+
+    printf("M = %d, W = %g, samples = %zu, errors in %%, convergence in samples after the shift (<= %g%%)\n",
+           NGX_HTTP_SLA_QUANTILE_M, (double)NGX_HTTP_SLA_QUANTILE_W, samples_len, SLA_BENCH_CONVERGED);
+    printf("%-10s %8s %8s %8s %8s %8s %10s %9s\n", "stream", "p50", "p90", "p98", "p99", "max", "converge", "ns/sample");
+
+    for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        sla_bench(&engine, &streams[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,394 @@
+/**
+ * Copyright (c) 2012 Anton Batenev
+ * Copyright (c) 2012 Fernando Systems Ltd
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Воспроизведение логов доступа через ядро агрегации модуля
+ *
+ * Сборка: cc -O2 -I. -o sla_replay tools/sla_replay.c -lm
+ * Запуск: sla_replay [-p пул] [-t 300:500:2000] [-w 1600] [-m 0] access.log ... (- для stdin)
+ *
+ * Строка лога - "$status $upstream_addr $upstream_response_time" (списки через ", " и " : ").
+ * Как и модуль, счетчик all учитывает сумму времен апстримов, счетчики апстримов - время каждого
+ * апстрима, статус в логе один - итоговый, он учитывается для всех апстримов запроса.
+ * Вывод совпадает с текстовым выводом sla_status (без скоростей), скорость разбора - в stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "ngx_http_sla_engine.h"
+
+#define SLA_REPLAY_MAX_COUNTERS 1024
+#define SLA_REPLAY_MAX_FIELDS   32
+#define SLA_REPLAY_MAX_HTTP     14
+
+/**
+ * Счетчик
+ */
+typedef struct {
+    char*                 name;                           /** Имя апстрима                      */
+    uintptr_t             http[SLA_REPLAY_MAX_HTTP];      /** Количество ответов HTTP           */
+    uintptr_t             http_xxx[6];                    /** Количество ответов в группах HTTP */
+    ngx_http_sla_timing_t timing;                         /** Времена ответов                   */
+} sla_counter_t;
+
+/**
+ * Поле строки лога - список значений
+ */
+typedef struct {
+    char*  values[SLA_REPLAY_MAX_FIELDS];   /** Значения    */
+    size_t len;                             /** Количество  */
+} sla_field_t;
+
+
+static const char*           pool_name = "replay";
+static uintptr_t             min_timing = 0;
+static uintptr_t             timings[NGX_HTTP_SLA_MAX_TIMINGS_LEN];
+static uintptr_t             quantiles[NGX_HTTP_SLA_MAX_QUANTILES_LEN] = { 25, 50, 75, 90, 95, 98, 99 };
+static uintptr_t             http[SLA_REPLAY_MAX_HTTP] = { 200, 301, 302, 304, 400, 401, 403, 404, 499, 500, 502, 503, 504, (uintptr_t)-1 };
+static ngx_http_sla_engine_t engine;
+static sla_counter_t*        counters[SLA_REPLAY_MAX_COUNTERS];
+static size_t                counters_len = 0;
+static uint64_t              lines = 0;
+static uint64_t              skipped = 0;
+
+
+static void* sla_alloc (size_t size)
+{
+    void* result;
+
+    result = calloc(1, size > 0 ? size : 1);
+    if (result == NULL) {
+        fprintf(stderr, "sla_replay: out of memory\n");
+        exit(1);
+    }
+
+    return result;
+}
+
+static sla_counter_t* sla_get_counter (const char* name)
+{
+    size_t         i;
+    sla_counter_t* counter;
+
+    for (i = 0; i < counters_len; i++) {
+        if (strcmp(counters[i]->name, name) == 0) {
+            return counters[i];
+        }
+    }
+
+    if (counters_len == SLA_REPLAY_MAX_COUNTERS) {
+        return NULL;
+    }
+
+    counter       = sla_alloc(sizeof(sla_counter_t));
+    counter->name = sla_alloc(strlen(name) + 1);
+    strcpy(counter->name, name);
+
+    counters[counters_len++] = counter;
+
+    return counter;
+}
+
+static void sla_add (sla_counter_t* counter, uintptr_t ms, uintptr_t status)
+{
+    ngx_http_sla_engine_add_status(&engine, counter->http, counter->http_xxx, status);
+
+    /* нулевой тайминг (статика) и тайминг меньше времени отсечки не учитывается */
+    if (ms == 0 || ms < min_timing) {
+        return;
+    }
+
+    if (ngx_http_sla_engine_add_timing(&engine, &counter->timing, ms)) {
+        ngx_http_sla_engine_quantiles(&engine, &counter->timing);
+    }
+}
+
+/**
+ * Разбор следующего поля: элементы списка разделены ", " или " : "
+ */
+static char* sla_parse_field (char* p, sla_field_t* field)
+{
+    char* start;
+
+    field->len = 0;
+
+    for ( ;; ) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+
+        if (*p == '\0' || *p == '\n') {
+            return p;
+        }
+
+        start = p;
+        while (*p != '\0' && *p != '\n' && *p != ' ' && *p != '\t' && *p != ',') {
+            p++;
+        }
+
+        if (field->len < SLA_REPLAY_MAX_FIELDS) {
+            field->values[field->len++] = start;
+        }
+
+        /* продолжение списка */
+        if (*p == ',') {
+            *p++ = '\0';
+            continue;
+        }
+
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+
+        if (*p == ':' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            continue;
+        }
+
+        return p;
+    }
+}
+
+/**
+ * Время ответа в секундах с миллисекундами ("0.123") или "-"
+ */
+static uintptr_t sla_parse_time (const char* value)
+{
+    char*  end;
+    double seconds;
+
+    if (value[0] == '-') {
+        return 0;
+    }
+
+    seconds = strtod(value, &end);
+    if (end == value || seconds < 0) {
+        return 0;
+    }
+
+    return (uintptr_t)(seconds * 1000 + 0.5);
+}
+
+static void sla_replay_line (char* line)
+{
+    size_t         i;
+    char*          end;
+    uintptr_t      ms;
+    uintptr_t      sum;
+    unsigned long  status;
+    sla_field_t    addrs;
+    sla_field_t    times;
+    sla_counter_t* counter;
+
+    lines++;
+
+    status = strtoul(line, &end, 10);
+    if (end == line || status < 100 || status > 599) {
+        skipped++;
+        return;
+    }
+
+    end = sla_parse_field(end, &addrs);
+    sla_parse_field(end, &times);
+
+    sum = 0;
+
+    for (i = 0; i < addrs.len && i < times.len; i++) {
+        if (addrs.values[i][0] == '-' && addrs.values[i][1] == '\0') {
+            continue;
+        }
+
+        ms   = sla_parse_time(times.values[i]);
+        sum += ms;
+
+        counter = sla_get_counter(addrs.values[i]);
+        if (counter != NULL) {
+            sla_add(counter, ms, status);
+        }
+    }
+
+    sla_add(counters[0], sum, status);
+}
+
+static void sla_replay_file (const char* file)
+{
+    FILE* fp;
+    char  line[8192];
+
+    fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "sla_replay: %s: cannot open file\n", file);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        sla_replay_line(line);
+    }
+
+    if (fp != stdin) {
+        fclose(fp);
+    }
+}
+
+static void sla_print_counter (const sla_counter_t* counter)
+{
+    size_t                       i;
+    const ngx_http_sla_timing_t* series = &counter->timing;
+
+    printf("%s.%s.http = %" PRIuPTR "\n", pool_name, counter->name, counter->http[engine.http_len - 1]);
+
+    for (i = 0; i < engine.http_len - 1; i++) {
+        printf("%s.%s.http_%" PRIuPTR " = %" PRIuPTR "\n", pool_name, counter->name, http[i], counter->http[i]);
+    }
+
+    printf("%s.%s.http_xxx = %" PRIuPTR "\n", pool_name, counter->name, counter->http_xxx[5]);
+
+    for (i = 0; i < 5; i++) {
+        printf("%s.%s.http_%zuxx = %" PRIuPTR "\n", pool_name, counter->name, i + 1, counter->http_xxx[i]);
+    }
+
+    printf("%s.%s.time.avg = %" PRIuPTR "\n", pool_name, counter->name, (uintptr_t)series->time_avg);
+    printf("%s.%s.time.avg.mov = %" PRIuPTR "\n", pool_name, counter->name, (uintptr_t)series->time_avg_mov);
+
+    for (i = 0; i < engine.timings_len; i++) {
+        if (timings[i] != (uintptr_t)-1) {
+            printf("%s.%s.%" PRIuPTR " = %" PRIuPTR "\n", pool_name, counter->name, timings[i], series->timings[i]);
+            printf("%s.%s.%" PRIuPTR ".agg = %" PRIuPTR "\n", pool_name, counter->name, timings[i], series->timings_agg[i]);
+        } else {
+            printf("%s.%s.inf = %" PRIuPTR "\n", pool_name, counter->name, series->timings[i]);
+            printf("%s.%s.inf.agg = %" PRIuPTR "\n", pool_name, counter->name, series->timings_agg[i]);
+        }
+    }
+
+    for (i = 0; i < engine.quantiles_len; i++) {
+        printf("%s.%s.%" PRIuPTR "%% = %" PRIuPTR "\n", pool_name, counter->name, quantiles[i], (uintptr_t)series->quantiles[i]);
+    }
+}
+
+/**
+ * Тайминги через двоеточие, как в sla_pool timings=
+ */
+static size_t sla_parse_timings (const char* value)
+{
+    size_t      n;
+    char*       end;
+    const char* p;
+
+    for (n = 0, p = value; *p != '\0'; n++) {
+        if (n == NGX_HTTP_SLA_MAX_TIMINGS_LEN - 1) {
+            fprintf(stderr, "sla_replay: timings list too long\n");
+            exit(2);
+        }
+
+        timings[n] = strtoul(p, &end, 10);
+        if (end == p || timings[n] == 0 || (n > 0 && timings[n] <= timings[n - 1]) || (*end != ':' && *end != '\0')) {
+            fprintf(stderr, "sla_replay: incorrect timings \"%s\"\n", value);
+            exit(2);
+        }
+
+        p = *end == ':' ? end + 1 : end;
+    }
+
+    return n;
+}
+
+int main (int argc, char** argv)
+{
+    int     i;
+    size_t  j;
+    size_t  timings_len;
+    clock_t start;
+    double  seconds;
+
+    timings[0]  = 300;
+    timings[1]  = 500;
+    timings[2]  = 2000;
+    timings_len = 3;
+
+    engine.avg_window = 1600;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            pool_name = argv[i + 1];
+        } else if (strcmp(argv[i], "-t") == 0) {
+            timings_len = sla_parse_timings(argv[i + 1]);
+        } else if (strcmp(argv[i], "-w") == 0 && atoi(argv[i + 1]) >= 2) {
+            engine.avg_window = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-m") == 0 && atoi(argv[i + 1]) >= 0) {
+            min_timing = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+
+    if (i >= argc) {
+        fprintf(stderr, "usage: sla_replay [-p pool] [-t timings] [-w avg_window] [-m min_timing] file ... (- for stdin)\n");
+        return 2;
+    }
+
+    /* "бесконечный" интервал для учета общего числа, как в модуле */
+    timings[timings_len++] = (uintptr_t)-1;
+
+    engine.timings       = timings;
+    engine.timings_len   = timings_len;
+    engine.quantiles     = quantiles;
+    engine.quantiles_len = NGX_HTTP_SLA_MAX_QUANTILES_LEN;
+    engine.http          = http;
+    engine.http_len      = SLA_REPLAY_MAX_HTTP;
+
+    ngx_http_sla_engine_init(&engine);
+
+    sla_get_counter("all");
+
+    start = clock();
+
+    for ( ; i < argc; i++) {
+        sla_replay_file(argv[i]);
+    }
+
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    for (j = 0; j < counters_len; j++) {
+        sla_print_counter(counters[j]);
+    }
+
+    fprintf(stderr, "sla_replay: %" PRIu64 " lines, %" PRIu64 " skipped, %.3f s, %.0f lines/s\n",
+            lines, skipped, seconds, seconds > 0 ? (double)lines / seconds : (double)0);
+
+    return 0;
+}